@@ -15,12 +15,13 @@ public:
 	~BoundingBox();
 
 	void growToInclude(glm::vec3 point);
-	void growToInclude(Triangle triangle);
-	void growToInclude(Sphere sphere);
-	void growToInclude(Wall wall);
+	void growToInclude(const Triangle& triangle);
+	void growToInclude(const Sphere& sphere);
+	void growToInclude(const Wall& wall);
 	void growToInclude(Mesh mesh);
 
-	void growToInclude(std::unique_ptr<Shape> &shape);
+	void growToInclude(const std::unique_ptr<Shape> &shape);
+	void growToInclude(const BoundingBox& box);
 
 	glm::vec3 Min, Max;
 
@@ -28,6 +29,17 @@ public:
         return (Min + Max) * 0.5f;
     }
 
+	bool isEmpty() const {
+		return Max.x < Min.x || Max.y < Min.y || Max.z < Min.z;
+	}
+
+	// Surface area (0 for empty box)
+	float area() const {
+		if (isEmpty()) return 0.f;
+		glm::vec3 size = Max - Min;
+		return 2.f * (size.x * size.y + size.y * size.z + size.z * size.x);
+	}
+
 private:
 };
 
@@ -47,7 +59,7 @@ inline void BoundingBox::growToInclude(glm::vec3 point)
 	Max = glm::max(Max, point);
 }
 
-inline void BoundingBox::growToInclude(Triangle triangle)
+inline void BoundingBox::growToInclude(const Triangle& triangle)
 {
     if (std::isfinite(triangle.a.x) && std::isfinite(triangle.b.x) && std::isfinite(triangle.c.x)) {
         growToInclude(triangle.a);
@@ -64,13 +76,13 @@ inline void BoundingBox::growToInclude(Triangle triangle)
     }
 }
 
-inline void BoundingBox::growToInclude(Sphere sphere)
+inline void BoundingBox::growToInclude(const Sphere& sphere)
 {
 	growToInclude(sphere.m_center + sphere.m_radius);
 	growToInclude(sphere.m_center - sphere.m_radius);
 }
 
-inline void BoundingBox::growToInclude(Wall wall)
+inline void BoundingBox::growToInclude(const Wall& wall)
 {
 	growToInclude(wall.start);
 	growToInclude(wall.end());
@@ -84,14 +96,20 @@ inline void BoundingBox::growToInclude(Mesh mesh)
 	}
 }
 
-inline void BoundingBox::growToInclude(std::unique_ptr<Shape> &shape)
+inline void BoundingBox::growToInclude(const BoundingBox& box)
 {
-	if (auto sphere = dynamic_cast<Sphere*>(shape.get()))
-		growToInclude(*sphere);
-	else if (auto wall = dynamic_cast<Wall*>(shape.get()))
-		growToInclude(*wall);
-	else if (auto triangle = dynamic_cast<Triangle*>(shape.get()))
-		growToInclude(*triangle);
+	Min = glm::min(Min, box.Min);
+	Max = glm::max(Max, box.Max);
+}
+
+inline void BoundingBox::growToInclude(const std::unique_ptr<Shape> &shape)
+{
+	switch (shape->type) {
+	case SHAPE_SPHERE: growToInclude(static_cast<const Sphere&>(*shape)); break;
+	case SHAPE_WALL: growToInclude(static_cast<const Wall&>(*shape)); break;
+	case SHAPE_TRIANGLE: growToInclude(static_cast<const Triangle&>(*shape)); break;
+	default: break; // Infinite planes have no bounds
+	}
 }
 
 
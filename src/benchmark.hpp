@@ -0,0 +1,239 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Measurements for the benchmark harness (--benchmark), written as JSON so runs can be compared
+
+// Stopwatch
+class BenchmarkTimer
+{
+public:
+	BenchmarkTimer();
+
+	void restart();
+	double elapsedMs() const;
+
+private:
+	std::chrono::high_resolution_clock::time_point start;
+};
+
+// Samples of one measured quantity
+class BenchmarkMetric
+{
+public:
+	BenchmarkMetric(const std::string& name, const std::string& unit);
+
+	void add(double value);
+
+	// p in [0, 100], linear interpolation between the closest samples
+	double percentile(double p) const;
+	double median() const;
+	double mean() const;
+	double min() const;
+	double max() const;
+
+	std::string name;
+	std::string unit;
+	std::vector<double> samples;
+};
+
+// Results of one scene
+struct BenchmarkScene
+{
+	std::string name;
+	std::vector<std::pair<std::string, double>> info;	// Shape count, node count...
+	std::deque<BenchmarkMetric> metrics;	// Deque, references to metrics stay valid when more are added
+	std::string skipped;	// Reason if the scene could not be measured
+
+	// Metric with given name, created on first use
+	BenchmarkMetric& metric(const std::string& name, const std::string& unit);
+};
+
+class BenchmarkReport
+{
+public:
+	BenchmarkReport();
+	~BenchmarkReport();
+
+	void setInfo(const std::string& key, const std::string& value);
+	BenchmarkScene& addScene(const std::string& name);
+
+	void print() const;
+	bool write(const std::string& path) const;
+
+private:
+	std::vector<std::pair<std::string, std::string>> info;
+	std::deque<BenchmarkScene> scenes;
+};
+
+BenchmarkTimer::BenchmarkTimer()
+{
+	restart();
+}
+
+inline void BenchmarkTimer::restart()
+{
+	start = std::chrono::high_resolution_clock::now();
+}
+
+inline double BenchmarkTimer::elapsedMs() const
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+BenchmarkMetric::BenchmarkMetric(const std::string& name, const std::string& unit) : name(name), unit(unit)
+{
+}
+
+inline void BenchmarkMetric::add(double value)
+{
+	samples.push_back(value);
+}
+
+inline double BenchmarkMetric::percentile(double p) const
+{
+	if (samples.empty()) return 0;
+
+	std::vector<double> sorted = samples;
+	std::sort(sorted.begin(), sorted.end());
+
+	double rank = p / 100.0 * (sorted.size() - 1);
+	size_t lower = static_cast<size_t>(rank);
+	size_t upper = std::min(lower + 1, sorted.size() - 1);
+	return sorted[lower] + (sorted[upper] - sorted[lower]) * (rank - lower);
+}
+
+inline double BenchmarkMetric::median() const
+{
+	return percentile(50);
+}
+
+inline double BenchmarkMetric::mean() const
+{
+	if (samples.empty()) return 0;
+
+	double sum = 0;
+	for (double value : samples)
+		sum += value;
+	return sum / samples.size();
+}
+
+inline double BenchmarkMetric::min() const
+{
+	return samples.empty() ? 0 : *std::min_element(samples.begin(), samples.end());
+}
+
+inline double BenchmarkMetric::max() const
+{
+	return samples.empty() ? 0 : *std::max_element(samples.begin(), samples.end());
+}
+
+inline BenchmarkMetric& BenchmarkScene::metric(const std::string& metricName, const std::string& unit)
+{
+	for (BenchmarkMetric& m : metrics) {
+		if (m.name == metricName) return m;
+	}
+	metrics.push_back(BenchmarkMetric(metricName, unit));
+	return metrics.back();
+}
+
+BenchmarkReport::BenchmarkReport()
+{
+}
+
+BenchmarkReport::~BenchmarkReport()
+{
+}
+
+inline void BenchmarkReport::setInfo(const std::string& key, const std::string& value)
+{
+	info.push_back(std::make_pair(key, value));
+}
+
+inline BenchmarkScene& BenchmarkReport::addScene(const std::string& name)
+{
+	scenes.push_back(BenchmarkScene());
+	scenes.back().name = name;
+	return scenes.back();
+}
+
+inline void BenchmarkReport::print() const
+{
+	for (const BenchmarkScene& scene : scenes) {
+		std::cout << scene.name;
+		if (!scene.skipped.empty()) {
+			std::cout << ": skipped (" << scene.skipped << ")" << std::endl;
+			continue;
+		}
+		std::cout << std::endl << "metric\tunit\tmedian\tp10\tp90\tsamples" << std::endl;
+		for (const BenchmarkMetric& m : scene.metrics) {
+			std::cout << m.name << "\t" << m.unit << "\t" << m.median() << "\t" << m.percentile(10) << "\t"
+				<< m.percentile(90) << "\t" << m.samples.size() << std::endl;
+		}
+	}
+}
+
+// Names are plain ASCII, only quotes and backslashes need escaping
+inline std::string benchmarkJsonString(const std::string& text)
+{
+	std::string out = "\"";
+	for (char c : text) {
+		if (c == '"' || c == '\\') out += '\\';
+		out += c;
+	}
+	return out + "\"";
+}
+
+inline bool BenchmarkReport::write(const std::string& path) const
+{
+	std::ofstream file(path);
+	if (!file) {
+		std::cout << "Failed to write " << path << std::endl;
+		return false;
+	}
+
+	file << std::setprecision(10) << "{\n";
+	for (const auto& entry : info)
+		file << "  " << benchmarkJsonString(entry.first) << ": " << benchmarkJsonString(entry.second) << ",\n";
+
+	file << "  \"scenes\": [";
+	for (size_t s = 0; s < scenes.size(); ++s) {
+		const BenchmarkScene& scene = scenes[s];
+		file << (s ? ",\n" : "\n") << "    {\n      \"name\": " << benchmarkJsonString(scene.name);
+		if (!scene.skipped.empty())
+			file << ",\n      \"skipped\": " << benchmarkJsonString(scene.skipped);
+		for (const auto& entry : scene.info)
+			file << ",\n      " << benchmarkJsonString(entry.first) << ": " << entry.second;
+
+		file << ",\n      \"metrics\": {";
+		for (size_t m = 0; m < scene.metrics.size(); ++m) {
+			const BenchmarkMetric& metric = scene.metrics[m];
+			file << (m ? ",\n" : "\n") << "        " << benchmarkJsonString(metric.name) << ": { "
+				<< "\"unit\": " << benchmarkJsonString(metric.unit)
+				<< ", \"median\": " << metric.median()
+				<< ", \"p10\": " << metric.percentile(10)
+				<< ", \"p90\": " << metric.percentile(90)
+				<< ", \"p99\": " << metric.percentile(99)
+				<< ", \"min\": " << metric.min()
+				<< ", \"max\": " << metric.max()
+				<< ", \"mean\": " << metric.mean()
+				<< ", \"samples\": " << metric.samples.size() << " }";
+		}
+		file << (scene.metrics.empty() ? "}" : "\n      }") << "\n    }";
+	}
+	file << (scenes.empty() ? "]" : "\n  ]") << "\n}\n";
+
+	std::cout << "Benchmark results written to " << path << std::endl;
+	return true;
+}
+
+#endif // !BENCHMARK_H
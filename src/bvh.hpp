@@ -0,0 +1,856 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <memory>
+#include <vector>
+#include "flatStructures.hpp"
+#include "ray.hpp"
+#include "intersection.hpp"
+#include "shapes/shape.hpp"
+#include "BoundingBox.hpp"
+#include "shapeStore.hpp"
+#include "threadPool.hpp"
+#include "cacheSim.hpp"
+
+// BVH builders and CPU traversal of the flattened BVH (flatNodes + bvhIndices), same layout as the GPU uses.
+// flatNodes holds one BVH per instance (see tlas.hpp). Builders write nodes in depth-first order: the root of every
+// BVH is its first node, children are stored after their parents. Leaves are marked by FlatNode::isLeaf().
+
+const int BVH_STACK_SIZE = 64;
+
+// Parameters of the binned SAH builder
+struct SAHBuildParams
+{
+	int binCount = 16;				// Bins per axis, split candidates are the borders between bins
+	int maxLeafSize = SIMD_WIDTH > 4 ? SIMD_WIDTH : 4;	// Bigger nodes are always split, a full triangle block fits
+	int maxDepth = 48;				// Keeps the traversal stack from overflowing
+	float traversalCost = 1.f;		// Cost of visiting an inner node
+	float intersectionCost = 1.f;	// Cost of one ray-shape test
+	int leafBlockSize = SIMD_WIDTH;	// Shapes tested at once by the CPU triangle blocks, costs count whole blocks
+};
+
+// Intersection cost of count shapes tested in blocks
+inline float sahIntersectionCost(const SAHBuildParams& params, int count)
+{
+	return params.intersectionCost * ((count + params.leafBlockSize - 1) / params.leafBlockSize);
+}
+
+// Binned surface area heuristic builder.
+// The shapes are partitioned in place in one index array (a node owns a range of it) and nodes are written straight
+// into the flat node array in depth-first order, root first and every left child right after its parent.
+// With a thread pool, the top of the tree is split on the calling thread with binning and partitioning spread over
+// the threads, the subtrees below are built as independent tasks into their own node arrays and copied behind
+// their parents afterwards. The tree is the same as the one built on a single thread.
+class SAHBuilder
+{
+public:
+	SAHBuilder(const std::vector<std::unique_ptr<Shape>>& shapes, const SAHBuildParams& params, ThreadPool* pool = nullptr);
+	~SAHBuilder();
+
+	// Build BVH over all shapes, appends nodes (root first) and the shape indices of their leaves
+	void build(std::vector<FlatNode>& nodes, std::vector<int>& indices);
+	// Build BVH over given shapes only
+	void build(std::vector<FlatNode>& nodes, std::vector<int>& indices, const std::vector<int>& shapeIndices);
+
+private:
+	struct Bin {
+		BoundingBox box;
+		int count = 0;
+	};
+
+	// Shapes [begin, end) of the index array and their bounds
+	struct Range {
+		int begin = 0;
+		int end = 0;
+		BoundingBox box;
+		int count() const { return end - begin; }
+	};
+
+	// Best split of a node, axis -1 splits the list in half
+	struct SplitChoice {
+		int axis = -1;
+		int bin = -1;
+		BoundingBox centroidBox;
+	};
+
+	// Buffers of one thread, reused by every node it splits
+	struct Scratch {
+		std::vector<Bin> bins;
+		std::vector<float> rightArea;
+		std::vector<int> rightCount;
+		std::vector<int> indices;	// Right side of a partition
+	};
+
+	// Node of the parallel top levels, either split further (left, right) or built as one task into arena
+	struct TopNode {
+		Range range;
+		int depth = 0;
+		int left = -1;
+		int right = -1;
+		bool task = false;
+		std::vector<FlatNode> arena;	// Subtree of the task, root first
+	};
+
+	void split(std::vector<FlatNode>& nodes, int nodeIdx, const Range& range, int depth, Scratch& scratch) const;
+	// False if the node stays a leaf
+	bool chooseSplit(const Range& range, int depth, bool parallel, Scratch& scratch, SplitChoice& choice) const;
+	void partition(const Range& range, const SplitChoice& choice, bool parallel, Scratch& scratch, Range& left, Range& right) const;
+	void binShapes(const int* shapeIndices, int count, const BoundingBox& centroidBox, Bin* bins) const;
+	int binIndex(const glm::vec3& centroid, int axis, const BoundingBox& centroidBox) const;
+
+	void splitTop(std::vector<TopNode>& top, int idx, int taskSize);
+	void mergeTop(std::vector<TopNode>& top, int idx, std::vector<FlatNode>& nodes, int nodeIdx) const;
+	int chunkCount(int count) const;
+
+	const std::vector<std::unique_ptr<Shape>>& shapes;
+	SAHBuildParams params;
+	ThreadPool* pool;
+
+	std::vector<BoundingBox> shapeBoxes;
+	std::vector<glm::vec3> centroids;
+
+	int* indices = nullptr;			// Index array of the current build
+	std::vector<Scratch> scratch;	// One per thread
+};
+
+const int SAH_PARALLEL_MIN_SHAPES = 16384;	// Smaller nodes are binned and partitioned on one thread
+const int SAH_TASKS_PER_THREAD = 8;			// Subtree tasks per thread, for load balancing
+
+SAHBuilder::SAHBuilder(const std::vector<std::unique_ptr<Shape>>& shapes, const SAHBuildParams& params, ThreadPool* pool)
+	: shapes(shapes), params(params), pool(pool && pool->size() > 1 ? pool : nullptr)
+{
+	this->params.binCount = glm::max(params.binCount, 2);
+	this->params.maxLeafSize = glm::max(params.maxLeafSize, 1);
+	this->params.leafBlockSize = glm::max(params.leafBlockSize, 1);
+	scratch.resize(this->pool ? this->pool->size() : 1);
+
+	// Bounds are computed once, the recursion only reads them
+	shapeBoxes.resize(shapes.size());
+	centroids.resize(shapes.size());
+	auto computeBounds = [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			shapeBoxes[i].growToInclude(shapes[i]);
+			centroids[i] = shapeBoxes[i].isEmpty() ? glm::vec3(0) : shapeBoxes[i].center();
+		}
+	};
+
+	int count = static_cast<int>(shapes.size());
+	if (this->pool && count >= SAH_PARALLEL_MIN_SHAPES) {
+		int chunks = chunkCount(count);
+		this->pool->parallelFor(chunks, [&](int chunk, int) {
+			computeBounds(static_cast<long long>(count) * chunk / chunks, static_cast<long long>(count) * (chunk + 1) / chunks);
+		});
+	}
+	else {
+		computeBounds(0, count);
+	}
+}
+
+SAHBuilder::~SAHBuilder()
+{
+}
+
+inline void SAHBuilder::build(std::vector<FlatNode>& nodes, std::vector<int>& indices)
+{
+	std::vector<int> shapeIndices(shapes.size());
+	for (int i = 0; i < shapes.size(); ++i)
+		shapeIndices[i] = i;
+
+	build(nodes, indices, shapeIndices);
+}
+
+inline void SAHBuilder::build(std::vector<FlatNode>& nodes, std::vector<int>& indices, const std::vector<int>& shapeIndices)
+{
+	int count = static_cast<int>(shapeIndices.size());
+	Range root;
+	root.begin = static_cast<int>(indices.size());
+	root.end = root.begin + count;
+	for (int idx : shapeIndices)
+		root.box.growToInclude(shapeBoxes[idx]);
+
+	indices.insert(indices.end(), shapeIndices.begin(), shapeIndices.end());
+	this->indices = indices.data();
+
+	// A binary tree over count shapes has at most 2 count - 1 nodes, the array is not reallocated during the build
+	nodes.reserve(nodes.size() + glm::max(2 * count - 1, 1));
+	int rootIdx = static_cast<int>(nodes.size());
+	nodes.push_back(FlatNode());
+
+	if (!pool || count < SAH_PARALLEL_MIN_SHAPES) {
+		split(nodes, rootIdx, root, 0, scratch[0]);
+		return;
+	}
+
+	// Split the top levels until the subtrees are small enough to balance over the threads
+	std::vector<TopNode> top(1);
+	top[0].range = root;
+	int taskSize = glm::max(count / (pool->size() * SAH_TASKS_PER_THREAD), 1);
+	splitTop(top, 0, taskSize);
+
+	// Build the subtrees, biggest first
+	std::vector<int> tasks;
+	for (int i = 0; i < top.size(); ++i) {
+		if (top[i].task) tasks.push_back(i);
+	}
+	std::sort(tasks.begin(), tasks.end(), [&](int a, int b) {
+		return top[a].range.count() > top[b].range.count();
+	});
+	pool->parallelFor(static_cast<int>(tasks.size()), [&](int i, int threadIdx) {
+		TopNode& task = top[tasks[i]];
+		task.arena.reserve(glm::max(2 * task.range.count() - 1, 1));
+		task.arena.push_back(FlatNode());
+		split(task.arena, 0, task.range, task.depth, scratch[threadIdx]);
+	});
+
+	mergeTop(top, 0, nodes, rootIdx);
+}
+
+inline void SAHBuilder::splitTop(std::vector<TopNode>& top, int idx, int taskSize)
+{
+	// Copied, the vector grows below
+	Range range = top[idx].range;
+	int depth = top[idx].depth;
+
+	if (range.count() <= taskSize) {
+		top[idx].task = true;
+		return;
+	}
+
+	SplitChoice choice;
+	if (!chooseSplit(range, depth, true, scratch[0], choice))
+		return;
+
+	TopNode left, right;
+	partition(range, choice, true, scratch[0], left.range, right.range);
+	left.depth = right.depth = depth + 1;
+
+	int leftIdx = static_cast<int>(top.size());
+	top.push_back(std::move(left));
+	int rightIdx = static_cast<int>(top.size());
+	top.push_back(std::move(right));
+	top[idx].left = leftIdx;
+	top[idx].right = rightIdx;
+
+	splitTop(top, leftIdx, taskSize);
+	splitTop(top, rightIdx, taskSize);
+}
+
+inline void SAHBuilder::mergeTop(std::vector<TopNode>& top, int idx, std::vector<FlatNode>& nodes, int nodeIdx) const
+{
+	TopNode& entry = top[idx];
+
+	// Same order as split(): the node, the left subtree, then the right subtree
+	if (entry.task) {
+		// The arena root takes the reserved slot, the other nodes follow at the end
+		int base = static_cast<int>(nodes.size()) - 1;
+		auto moved = [&](FlatNode node) {
+			if (!node.isLeaf())
+				node.setInner(node.leftChild() + base, node.rightChild() + base);
+			return node;
+		};
+		nodes[nodeIdx] = moved(entry.arena[0]);
+		for (int i = 1; i < entry.arena.size(); ++i)
+			nodes.push_back(moved(entry.arena[i]));
+		entry.arena = std::vector<FlatNode>();
+		return;
+	}
+
+	nodes[nodeIdx].boundsMin = entry.range.box.Min;
+	nodes[nodeIdx].boundsMax = entry.range.box.Max;
+	nodes[nodeIdx].setLeaf(entry.range.begin, entry.range.count());
+	if (entry.left == -1)
+		return;
+
+	int leftIdx = static_cast<int>(nodes.size());
+	nodes.push_back(FlatNode());
+	mergeTop(top, entry.left, nodes, leftIdx);
+
+	int rightIdx = static_cast<int>(nodes.size());
+	nodes.push_back(FlatNode());
+	mergeTop(top, entry.right, nodes, rightIdx);
+
+	nodes[nodeIdx].setInner(leftIdx, rightIdx);
+}
+
+inline int SAHBuilder::chunkCount(int count) const
+{
+	return glm::min(pool->size() * 4, glm::max(count / 4096, 1));
+}
+
+inline int SAHBuilder::binIndex(const glm::vec3& centroid, int axis, const BoundingBox& centroidBox) const
+{
+	float extent = centroidBox.Max[axis] - centroidBox.Min[axis];
+	int bin = static_cast<int>((centroid[axis] - centroidBox.Min[axis]) / extent * params.binCount);
+	return glm::clamp(bin, 0, params.binCount - 1);
+}
+
+inline void SAHBuilder::binShapes(const int* shapeIndices, int count, const BoundingBox& centroidBox, Bin* bins) const
+{
+	// All axes in one pass, bins of axis a start at a * binCount
+	for (int axis = 0; axis < 3; ++axis) {
+		if (centroidBox.Max[axis] - centroidBox.Min[axis] <= 0.f)
+			continue;
+
+		Bin* axisBins = bins + axis * params.binCount;
+		for (int i = 0; i < count; ++i) {
+			int idx = shapeIndices[i];
+			Bin& bin = axisBins[binIndex(centroids[idx], axis, centroidBox)];
+			bin.box.growToInclude(shapeBoxes[idx]);
+			bin.count++;
+		}
+	}
+}
+
+inline bool SAHBuilder::chooseSplit(const Range& range, int depth, bool parallel, Scratch& scratch, SplitChoice& choice) const
+{
+	int count = range.count();
+	if (count <= 1 || depth >= params.maxDepth)
+		return false;
+
+	const int* shapeIndices = indices + range.begin;
+	std::vector<Bin>& bins = scratch.bins;
+	bins.assign(3 * params.binCount, Bin());
+
+	// Split candidates are taken from centroid bounds. Large nodes reduce per-chunk boxes and bins,
+	// min/max and counts do not depend on the order, so the result is the same as on one thread.
+	if (parallel && pool && count >= SAH_PARALLEL_MIN_SHAPES) {
+		int chunks = chunkCount(count);
+		std::vector<BoundingBox> chunkBoxes(chunks);
+		pool->parallelFor(chunks, [&](int chunk, int) {
+			int begin = static_cast<long long>(count) * chunk / chunks;
+			int end = static_cast<long long>(count) * (chunk + 1) / chunks;
+			for (int i = begin; i < end; ++i)
+				chunkBoxes[chunk].growToInclude(centroids[shapeIndices[i]]);
+		});
+		for (const BoundingBox& box : chunkBoxes)
+			choice.centroidBox.growToInclude(box);
+
+		std::vector<Bin> chunkBins(chunks * bins.size());
+		pool->parallelFor(chunks, [&](int chunk, int) {
+			int begin = static_cast<long long>(count) * chunk / chunks;
+			int end = static_cast<long long>(count) * (chunk + 1) / chunks;
+			binShapes(shapeIndices + begin, end - begin, choice.centroidBox, &chunkBins[chunk * bins.size()]);
+		});
+		for (int chunk = 0; chunk < chunks; ++chunk) {
+			for (int i = 0; i < bins.size(); ++i) {
+				const Bin& chunkBin = chunkBins[chunk * bins.size() + i];
+				bins[i].box.growToInclude(chunkBin.box);
+				bins[i].count += chunkBin.count;
+			}
+		}
+	}
+	else {
+		for (int i = 0; i < count; ++i)
+			choice.centroidBox.growToInclude(centroids[shapeIndices[i]]);
+		binShapes(shapeIndices, count, choice.centroidBox, bins.data());
+	}
+
+	float parentArea = range.box.area();
+	float bestCost = std::numeric_limits<float>::max();
+	std::vector<float>& rightArea = scratch.rightArea;
+	std::vector<int>& rightCount = scratch.rightCount;
+	rightArea.resize(params.binCount);
+	rightCount.resize(params.binCount);
+
+	for (int axis = 0; axis < 3; ++axis) {
+		if (choice.centroidBox.Max[axis] - choice.centroidBox.Min[axis] <= 0.f)
+			continue;
+
+		const Bin* axisBins = &bins[axis * params.binCount];
+
+		// Sweep from the right, then from the left evaluating split after bin i
+		BoundingBox box;
+		int n = 0;
+		for (int i = params.binCount - 1; i > 0; --i) {
+			box.growToInclude(axisBins[i].box);
+			n += axisBins[i].count;
+			rightArea[i] = box.area();
+			rightCount[i] = n;
+		}
+
+		box = BoundingBox();
+		n = 0;
+		for (int i = 0; i < params.binCount - 1; ++i) {
+			box.growToInclude(axisBins[i].box);
+			n += axisBins[i].count;
+			if (n == 0 || rightCount[i + 1] == 0) continue;
+
+			float cost = params.traversalCost + (box.area() * sahIntersectionCost(params, n) +
+				rightArea[i + 1] * sahIntersectionCost(params, rightCount[i + 1])) / parentArea;
+			if (cost < bestCost) {
+				bestCost = cost;
+				choice.axis = axis;
+				choice.bin = i;
+			}
+		}
+	}
+
+	// Keep small nodes as leaves when splitting does not pay off
+	float leafCost = sahIntersectionCost(params, count);
+	if (count <= params.maxLeafSize && (choice.axis == -1 || leafCost <= bestCost))
+		return false;
+
+	return true;
+}
+
+inline void SAHBuilder::partition(const Range& range, const SplitChoice& choice, bool parallel, Scratch& scratch, Range& left, Range& right) const
+{
+	int count = range.count();
+	int* shapeIndices = indices + range.begin;
+
+	auto goesLeft = [&](int i, int idx) {
+		return choice.axis != -1 ? binIndex(centroids[idx], choice.axis, choice.centroidBox) <= choice.bin
+			: i < count / 2; // All centroids are in one point, split the list in half
+	};
+
+	// Stable, both sides keep the list order
+	int leftCount = 0;
+	if (!parallel || !pool || count < SAH_PARALLEL_MIN_SHAPES) {
+		// Left shapes move down in place, right shapes wait in the scratch buffer
+		scratch.indices.clear();
+		for (int i = 0; i < count; ++i) {
+			int idx = shapeIndices[i];
+			if (goesLeft(i, idx)) {
+				left.box.growToInclude(shapeBoxes[idx]);
+				shapeIndices[leftCount++] = idx;
+			}
+			else {
+				right.box.growToInclude(shapeBoxes[idx]);
+				scratch.indices.push_back(idx);
+			}
+		}
+		std::copy(scratch.indices.begin(), scratch.indices.end(), shapeIndices + leftCount);
+	}
+	else {
+		// Chunks count their sides, then scatter to offsets in chunk order, the result is the same as on one thread
+		int chunks = chunkCount(count);
+		std::vector<int> leftOffsets(chunks + 1, 0), rightOffsets(chunks + 1, 0);
+		std::vector<BoundingBox> leftBoxes(chunks), rightBoxes(chunks);
+		pool->parallelFor(chunks, [&](int chunk, int) {
+			int begin = static_cast<long long>(count) * chunk / chunks;
+			int end = static_cast<long long>(count) * (chunk + 1) / chunks;
+			for (int i = begin; i < end; ++i) {
+				int idx = shapeIndices[i];
+				if (goesLeft(i, idx)) {
+					leftBoxes[chunk].growToInclude(shapeBoxes[idx]);
+					leftOffsets[chunk + 1]++;
+				}
+				else {
+					rightBoxes[chunk].growToInclude(shapeBoxes[idx]);
+					rightOffsets[chunk + 1]++;
+				}
+			}
+		});
+		for (int chunk = 0; chunk < chunks; ++chunk) {
+			left.box.growToInclude(leftBoxes[chunk]);
+			right.box.growToInclude(rightBoxes[chunk]);
+			leftOffsets[chunk + 1] += leftOffsets[chunk];
+			rightOffsets[chunk + 1] += rightOffsets[chunk];
+		}
+		leftCount = leftOffsets[chunks];
+
+		scratch.indices.resize(count);
+		pool->parallelFor(chunks, [&](int chunk, int) {
+			int begin = static_cast<long long>(count) * chunk / chunks;
+			int end = static_cast<long long>(count) * (chunk + 1) / chunks;
+			int nextLeft = leftOffsets[chunk], nextRight = leftCount + rightOffsets[chunk];
+			for (int i = begin; i < end; ++i) {
+				int idx = shapeIndices[i];
+				scratch.indices[goesLeft(i, idx) ? nextLeft++ : nextRight++] = idx;
+			}
+		});
+		pool->parallelFor(chunks, [&](int chunk, int) {
+			int begin = static_cast<long long>(count) * chunk / chunks;
+			int end = static_cast<long long>(count) * (chunk + 1) / chunks;
+			std::copy(scratch.indices.begin() + begin, scratch.indices.begin() + end, shapeIndices + begin);
+		});
+	}
+
+	left.begin = range.begin;
+	left.end = right.begin = range.begin + leftCount;
+	right.end = range.end;
+}
+
+inline void SAHBuilder::split(std::vector<FlatNode>& nodes, int nodeIdx, const Range& range, int depth, Scratch& scratch) const
+{
+	nodes[nodeIdx].boundsMin = range.box.Min;
+	nodes[nodeIdx].boundsMax = range.box.Max;
+	nodes[nodeIdx].setLeaf(range.begin, range.count());
+
+	SplitChoice choice;
+	if (!chooseSplit(range, depth, false, scratch, choice))
+		return;
+
+	Range left, right;
+	partition(range, choice, false, scratch, left, right);
+
+	// Depth-first, the left child directly follows its parent
+	int leftIdx = static_cast<int>(nodes.size());
+	nodes.push_back(FlatNode());
+	split(nodes, leftIdx, left, depth + 1, scratch);
+
+	int rightIdx = static_cast<int>(nodes.size());
+	nodes.push_back(FlatNode());
+	split(nodes, rightIdx, right, depth + 1, scratch);
+
+	nodes[nodeIdx].setInner(leftIdx, rightIdx);
+}
+
+// Bottom-up refit of the flattened BVH for animated shapes.
+// Only leaves holding animated shapes and the nodes above them are recomputed, children before parents,
+// so boxes follow the shapes (and shrink again) without rebuilding or re-serializing the tree.
+class BVHRefitter
+{
+public:
+	BVHRefitter();
+	~BVHRefitter();
+
+	// Find dirty nodes in BVHs with given roots (call again after the BVH is rebuilt)
+	void init(const std::vector<FlatNode>& nodes, const std::vector<int>& indices, const std::vector<int>& roots, const std::vector<int>& animatedShapes);
+
+	// Recompute dirty node bounds from current shape positions
+	void refit(std::vector<FlatNode>& nodes, const std::vector<int>& indices, const std::vector<std::unique_ptr<Shape>>& shapes) const;
+
+	// Ranges of dirty nodes as (first node, node count), for partial uploads
+	const std::vector<glm::ivec2>& dirtyRanges() const;
+
+private:
+	std::vector<int> refitOrder;		// Dirty nodes, children before parents
+	std::vector<glm::ivec2> ranges;
+};
+
+BVHRefitter::BVHRefitter()
+{
+}
+
+BVHRefitter::~BVHRefitter()
+{
+}
+
+inline void BVHRefitter::init(const std::vector<FlatNode>& nodes, const std::vector<int>& indices, const std::vector<int>& roots, const std::vector<int>& animatedShapes)
+{
+	refitOrder.clear();
+	ranges.clear();
+	if (nodes.empty() || animatedShapes.empty()) return;
+
+	std::vector<bool> animated;
+	for (int idx : animatedShapes) {
+		if (idx >= animated.size()) animated.resize(idx + 1, false);
+		animated[idx] = true;
+	}
+
+	// Breadth first order from the roots, remember parents
+	std::vector<int> order(roots);
+	std::vector<int> parents(nodes.size(), -1);
+	for (int i = 0; i < order.size(); ++i) {
+		const FlatNode& node = nodes[order[i]];
+		if (node.isLeaf()) continue;
+		parents[node.leftChild()] = order[i];
+		parents[node.rightChild()] = order[i];
+		order.push_back(node.leftChild());
+		order.push_back(node.rightChild());
+	}
+
+	// Mark leaves with animated shapes and everything above them
+	std::vector<bool> dirty(nodes.size(), false);
+	for (int nodeIdx : order) {
+		const FlatNode& node = nodes[nodeIdx];
+		if (!node.isLeaf()) continue;
+
+		bool hasAnimated = false;
+		for (int i = 0; i < node.numShapes(); ++i) {
+			int shapeIdx = indices[node.startShapeIdx() + i];
+			hasAnimated |= shapeIdx < animated.size() && animated[shapeIdx];
+		}
+
+		for (int n = nodeIdx; hasAnimated && n != -1 && !dirty[n]; n = parents[n])
+			dirty[n] = true;
+	}
+
+	// Reversed breadth first order visits children before parents
+	for (auto it = order.rbegin(); it != order.rend(); ++it) {
+		if (dirty[*it]) refitOrder.push_back(*it);
+	}
+
+	// Merge dirty nodes into contiguous ranges
+	for (int i = 0; i < nodes.size(); ++i) {
+		if (!dirty[i]) continue;
+		if (!ranges.empty() && ranges.back().x + ranges.back().y == i)
+			ranges.back().y++;
+		else
+			ranges.push_back(glm::ivec2(i, 1));
+	}
+}
+
+inline void BVHRefitter::refit(std::vector<FlatNode>& nodes, const std::vector<int>& indices, const std::vector<std::unique_ptr<Shape>>& shapes) const
+{
+	for (int nodeIdx : refitOrder) {
+		FlatNode& node = nodes[nodeIdx];
+		BoundingBox box;
+
+		if (node.isLeaf()) {
+			for (int i = 0; i < node.numShapes(); ++i)
+				box.growToInclude(shapes[indices[node.startShapeIdx() + i]]);
+		}
+		else {
+			const FlatNode& left = nodes[node.leftChild()];
+			const FlatNode& right = nodes[node.rightChild()];
+			box.Min = glm::min(left.boundsMin, right.boundsMin);
+			box.Max = glm::max(left.boundsMax, right.boundsMax);
+		}
+
+		node.boundsMin = box.Min;
+		node.boundsMax = box.Max;
+	}
+}
+
+inline const std::vector<glm::ivec2>& BVHRefitter::dirtyRanges() const
+{
+	return ranges;
+}
+
+// Indices in bvhIndices of the leaves of the BVH at root as (first index, index count), count 0 if it has no shapes.
+// Every builder gives the leaves of one BVH a contiguous index range (with the SBVH longer than its shape list).
+inline glm::ivec2 bvhIndexRange(const std::vector<FlatNode>& nodes, int root)
+{
+	glm::ivec2 range(-1, 0);
+	if (root < 0) return range;
+
+	std::vector<int> stack(1, root);
+	while (!stack.empty()) {
+		const FlatNode& node = nodes[stack.back()];
+		stack.pop_back();
+		if (!node.isLeaf()) {
+			stack.push_back(node.leftChild());
+			stack.push_back(node.rightChild());
+		}
+		else if (node.numShapes() > 0) {
+			if (range.x == -1 || node.startShapeIdx() < range.x)
+				range.x = node.startShapeIdx();
+			range.y += node.numShapes();
+		}
+	}
+	return range;
+}
+
+// SAH cost of the flattened BVH with given root, relative to the root area (lower is better)
+inline float bvhSAHCost(const std::vector<FlatNode>& nodes, int root, const SAHBuildParams& params)
+{
+	if (root < 0 || root >= nodes.size()) return 0.f;
+
+	auto area = [](const FlatNode& node) {
+		glm::vec3 size = glm::max(node.boundsMax - node.boundsMin, glm::vec3(0));
+		return 2.f * (size.x * size.y + size.y * size.z + size.z * size.x);
+	};
+
+	float rootArea = area(nodes[root]);
+	if (rootArea <= 0.f) return 0.f;
+
+	float cost = 0.f;
+	std::vector<int> stack(1, root);
+	while (!stack.empty()) {
+		const FlatNode& node = nodes[stack.back()];
+		stack.pop_back();
+
+		if (node.isLeaf()) {
+			cost += sahIntersectionCost(params, node.numShapes()) * area(node) / rootArea;
+		}
+		else {
+			cost += params.traversalCost * area(node) / rootArea;
+			stack.push_back(node.leftChild());
+			stack.push_back(node.rightChild());
+		}
+	}
+	return cost;
+}
+
+// Closest hit found during traversal
+struct BVHHit
+{
+	int shapeIdx = -1;
+	float dist = std::numeric_limits<float>::max();
+	glm::vec3 point = glm::vec3(0);
+};
+
+// Memory traffic counters of a traversal (optional)
+struct BVHStats
+{
+	long long nodeVisits = 0;			// Node boxes tested
+	std::vector<long long> shapeTests;	// Per shape index, sized by the caller
+	CacheSim* cache = nullptr;			// Node and index fetches
+};
+
+// Slab test, invDir = 1 / ray direction
+inline bool rayIntersectsAABB(const glm::vec3& start, const glm::vec3& invDir, const glm::vec3& boxMin, const glm::vec3& boxMax, float& tMin, float& tMax)
+{
+	glm::vec3 t0 = (boxMin - start) * invDir;
+	glm::vec3 t1 = (boxMax - start) * invDir;
+
+	glm::vec3 tMin3 = glm::min(t0, t1);
+	glm::vec3 tMax3 = glm::max(t0, t1);
+
+	tMin = glm::max(glm::max(tMin3.x, tMin3.y), tMin3.z);
+	tMax = glm::min(glm::min(tMax3.x, tMax3.y), tMax3.z);
+
+	return tMax >= tMin && tMax > 0.f;
+}
+
+// Push the children of an inner node entered before maxDist with their entry distances, the nearer child last (visited first)
+inline void pushChildrenOrdered(const std::vector<FlatNode>& nodes, const FlatNode& node, const glm::vec3& start, const glm::vec3& invDir,
+	float maxDist, int* stack, float* stackT, int& stackIdx, BVHStats* stats)
+{
+	int nearIdx = node.leftChild(), farIdx = node.rightChild();
+	const FlatNode& nearNode = nodes[nearIdx];
+	const FlatNode& farNode = nodes[farIdx];
+	if (stats) stats->nodeVisits += 2;
+	if (stats && stats->cache) {
+		stats->cache->access(nodes.data(), nearIdx * sizeof(FlatNode), sizeof(FlatNode));
+		stats->cache->access(nodes.data(), farIdx * sizeof(FlatNode), sizeof(FlatNode));
+	}
+
+	float tNear, tFar, tExit;
+	bool hitNear = rayIntersectsAABB(start, invDir, nearNode.boundsMin, nearNode.boundsMax, tNear, tExit) && tNear <= maxDist;
+	bool hitFar = rayIntersectsAABB(start, invDir, farNode.boundsMin, farNode.boundsMax, tFar, tExit) && tFar <= maxDist;
+
+	if (hitNear && hitFar && tFar < tNear) {
+		std::swap(nearIdx, farIdx);
+		std::swap(tNear, tFar);
+	}
+
+	if (hitFar) {
+		stackT[stackIdx] = tFar;
+		stack[stackIdx++] = farIdx;
+	}
+	if (hitNear) {
+		stackT[stackIdx] = tNear;
+		stack[stackIdx++] = nearIdx;
+	}
+}
+
+// Closest hit among the shapes of a leaf, triangles are tested in SIMD blocks when the store has them
+inline void intersectLeaf(const std::vector<FlatNode>& nodes, const std::vector<int>& indices, const ShapeStore& store,
+	int nodeIdx, const glm::vec3& start, const glm::vec3& dir, BVHHit& hit, BVHStats* stats)
+{
+	const FlatNode& node = nodes[nodeIdx];
+	bool blocks = store.useBlocks();
+	bool scalarShapes = !blocks || store.hasOtherShapes(nodeIdx);
+	if (stats && stats->cache && node.numShapes() > 0)
+		stats->cache->access(indices.data(), node.startShapeIdx() * sizeof(int), node.numShapes() * sizeof(int));
+
+	for (int i = 0; (scalarShapes || stats) && i < node.numShapes(); ++i) {
+		int shapeIdx = indices[node.startShapeIdx() + i];
+		if (stats) stats->shapeTests[shapeIdx]++;
+		if (blocks && store.isTriangle(shapeIdx)) continue;
+
+		float t;
+		if (store.intersect(shapeIdx, start, dir, t) && t < hit.dist) {
+			hit.dist = t;
+			hit.point = start + t * dir;
+			hit.shapeIdx = shapeIdx;
+		}
+	}
+
+	// Triangles of the leaf at once
+	if (blocks && store.intersectBlocks(nodeIdx, start, dir, hit.dist, hit.shapeIdx))
+		hit.point = start + hit.dist * dir;
+}
+
+// Any hit closer than maxDist among the shapes of a leaf
+inline bool occludedLeaf(const std::vector<FlatNode>& nodes, const std::vector<int>& indices, const ShapeStore& store,
+	int nodeIdx, const glm::vec3& start, const glm::vec3& dir, float maxDist)
+{
+	const FlatNode& node = nodes[nodeIdx];
+	bool blocks = store.useBlocks();
+
+	for (int i = 0; (!blocks || store.hasOtherShapes(nodeIdx)) && i < node.numShapes(); ++i) {
+		int shapeIdx = indices[node.startShapeIdx() + i];
+		if (blocks && store.isTriangle(shapeIdx)) continue;
+
+		float t;
+		if (store.intersect(shapeIdx, start, dir, t) && t < maxDist)
+			return true;
+	}
+	return blocks && store.occludedBlocks(nodeIdx, start, dir, maxDist);
+}
+
+// Closest hit query in the BVH with given root, returns true if any shape was hit (closer than hit.dist)
+inline bool intersectBVH(const std::vector<FlatNode>& nodes, const std::vector<int>& indices,
+	const ShapeStore& store, Ray ray, BVHHit& hit, int root, BVHStats* stats = nullptr)
+{
+	if (root < 0) return false;
+
+	glm::vec3 start = ray.get_start();
+	glm::vec3 dir = ray.get_dir();
+	glm::vec3 invDir = 1.f / dir;
+
+	float tMin, tMax;
+	if (stats) stats->nodeVisits++;
+	if (stats && stats->cache) stats->cache->access(nodes.data(), root * sizeof(FlatNode), sizeof(FlatNode));
+	if (!rayIntersectsAABB(start, invDir, nodes[root].boundsMin, nodes[root].boundsMax, tMin, tMax) || tMin > hit.dist)
+		return false;
+
+	// Nodes are stacked with their entry distance, nodes behind the closest hit are skipped
+	int stack[BVH_STACK_SIZE];
+	float stackT[BVH_STACK_SIZE];
+	int stackIdx = 0;
+	stackT[stackIdx] = tMin;
+	stack[stackIdx++] = root;
+
+	while (stackIdx > 0) {
+		--stackIdx;
+		if (stackT[stackIdx] > hit.dist)
+			continue;
+		const FlatNode& node = nodes[stack[stackIdx]];
+
+		if (node.isLeaf()) { // Leaf
+			intersectLeaf(nodes, indices, store, stack[stackIdx], start, dir, hit, stats);
+		}
+		else { // Go deeper, nearer child first
+			pushChildrenOrdered(nodes, node, start, invDir, hit.dist, stack, stackT, stackIdx, stats);
+		}
+	}
+
+	return hit.shapeIdx != -1;
+}
+
+// Any hit query in the BVH with given root (e.g. shadow rays), returns true as soon as something closer than maxDist is hit.
+// Expects normalized ray direction, so box entry distances can be compared with maxDist.
+inline bool occludedBVH(const std::vector<FlatNode>& nodes, const std::vector<int>& indices,
+	const ShapeStore& store, Ray ray, float maxDist, int root)
+{
+	if (root < 0) return false;
+
+	glm::vec3 start = ray.get_start();
+	glm::vec3 dir = ray.get_dir();
+	glm::vec3 invDir = 1.f / dir;
+
+	int stack[BVH_STACK_SIZE];
+	int stackIdx = 0;
+	stack[stackIdx++] = root;
+
+	while (stackIdx > 0) {
+		int nodeIdx = stack[--stackIdx];
+		const FlatNode& node = nodes[nodeIdx];
+
+		float tMin, tMax;
+		if (!rayIntersectsAABB(start, invDir, node.boundsMin, node.boundsMax, tMin, tMax) || tMin > maxDist)
+			continue;
+
+		if (node.isLeaf()) { // Leaf
+			if (occludedLeaf(nodes, indices, store, nodeIdx, start, dir, maxDist))
+				return true;
+		}
+		else { // Go deeper
+			stack[stackIdx++] = node.leftChild();
+			stack[stackIdx++] = node.rightChild();
+		}
+	}
+
+	return false;
+}
+
+#endif // !BVH_H
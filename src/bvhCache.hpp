@@ -0,0 +1,190 @@
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "flatStructures.hpp"
+#include "mappedFile.hpp"
+
+// Prebuilt flat BVH of a scene (flatNodes, bvhIndices and the BLAS root of every instance) stored on disk.
+// The file is identified by a hash of the build input (builder, parameters, shape bounds and instance shape lists),
+// a scene whose input hashes the same gets the same tree without building it.
+// Layout: header, nodes (16 byte aligned, same layout as the GPU buffer), indices, roots.
+
+const char BVH_CACHE_MAGIC[8] = { 'R', 'T', 'B', 'V', 'H', 0, 0, 0 };
+const uint32_t BVH_CACHE_VERSION = 2;
+
+struct BVHCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t nodeSize;		// sizeof(FlatNode) of the writer
+	uint32_t nodeCount;
+	uint32_t indexCount;
+	uint32_t rootCount;
+	uint32_t padding;
+	uint64_t inputHash;
+	uint64_t fileSize;		// Whole cache file, catches truncated writes
+};
+
+// Read-only view of a cache file, the arrays point into the mapped file
+class BVHCache
+{
+public:
+	BVHCache();
+	~BVHCache();
+
+	// Map the cache and check it matches the build input, false if it is missing, stale or damaged
+	bool open(const std::string& path, uint64_t inputHash, int shapeCount, int instanceCount);
+	void close();
+	bool isOpen() const;
+
+	const FlatNode* nodes() const;
+	const int* indices() const;
+	const int* roots() const;
+	int nodeCount() const;
+	int indexCount() const;
+
+private:
+	MappedFile file;
+	BVHCacheHeader header;
+};
+
+BVHCache::BVHCache()
+{
+	std::memset(&header, 0, sizeof(header));
+}
+
+BVHCache::~BVHCache()
+{
+}
+
+inline bool BVHCache::open(const std::string& path, uint64_t inputHash, int shapeCount, int instanceCount)
+{
+	close();
+	if (!file.open(path) || file.size() < sizeof(BVHCacheHeader)) {
+		close();
+		return false;
+	}
+
+	std::memcpy(&header, file.data(), sizeof(header));
+	uint64_t expectedSize = sizeof(BVHCacheHeader) + uint64_t(header.nodeCount) * sizeof(FlatNode)
+		+ (uint64_t(header.indexCount) + header.rootCount) * sizeof(int);
+	if (std::memcmp(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != BVH_CACHE_VERSION
+		|| header.nodeSize != sizeof(FlatNode) || header.inputHash != inputHash || header.rootCount != instanceCount
+		|| header.fileSize != file.size() || expectedSize != file.size()) {
+		close();
+		return false;
+	}
+
+	// Children after parents and every index in range, a damaged file must not crash the traversal
+	const FlatNode* flat = nodes();
+	for (int i = 0; i < nodeCount(); ++i) {
+		const FlatNode& node = flat[i];
+		bool valid = node.isLeaf()
+			? node.startShapeIdx() >= 0 && uint64_t(node.startShapeIdx()) + node.numShapes() <= header.indexCount
+			: node.leftChild() > i && node.leftChild() < nodeCount() && node.rightChild() > i && node.rightChild() < nodeCount();
+		if (!valid) {
+			close();
+			return false;
+		}
+	}
+	for (int i = 0; i < indexCount(); ++i) {
+		if (indices()[i] < 0 || indices()[i] >= shapeCount) {
+			close();
+			return false;
+		}
+	}
+	for (int i = 0; i < instanceCount; ++i) {
+		if (roots()[i] < -1 || roots()[i] >= nodeCount()) {
+			close();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+inline void BVHCache::close()
+{
+	file.close();
+	std::memset(&header, 0, sizeof(header));
+}
+
+inline bool BVHCache::isOpen() const
+{
+	return file.data() != nullptr;
+}
+
+inline const FlatNode* BVHCache::nodes() const
+{
+	return reinterpret_cast<const FlatNode*>(file.data() + sizeof(BVHCacheHeader));
+}
+
+inline const int* BVHCache::indices() const
+{
+	return reinterpret_cast<const int*>(nodes() + header.nodeCount);
+}
+
+inline const int* BVHCache::roots() const
+{
+	return indices() + header.indexCount;
+}
+
+inline int BVHCache::nodeCount() const
+{
+	return static_cast<int>(header.nodeCount);
+}
+
+inline int BVHCache::indexCount() const
+{
+	return static_cast<int>(header.indexCount);
+}
+
+// Write the flat BVH with the hash of its build input, false if it cannot be written
+inline bool saveBVHCache(const std::string& path, uint64_t inputHash, const std::vector<FlatNode>& nodes,
+	const std::vector<int>& indices, const std::vector<int>& roots)
+{
+	BVHCacheHeader header;
+	std::memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+	header.version = BVH_CACHE_VERSION;
+	header.nodeSize = sizeof(FlatNode);
+	header.nodeCount = static_cast<uint32_t>(nodes.size());
+	header.indexCount = static_cast<uint32_t>(indices.size());
+	header.rootCount = static_cast<uint32_t>(roots.size());
+	header.padding = 0;
+	header.inputHash = inputHash;
+	header.fileSize = sizeof(BVHCacheHeader) + nodes.size() * sizeof(FlatNode) + (indices.size() + roots.size()) * sizeof(int);
+
+	// Written to a temporary file first, a reader never sees a partial cache under the final name
+	std::string tempPath = path + ".tmp";
+	{
+		std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+		if (!out)
+			return false;
+
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(FlatNode));
+		out.write(reinterpret_cast<const char*>(indices.data()), indices.size() * sizeof(int));
+		out.write(reinterpret_cast<const char*>(roots.data()), roots.size() * sizeof(int));
+
+		if (!out) {
+			out.close();
+			std::remove(tempPath.c_str());
+			return false;
+		}
+	}
+
+	std::remove(path.c_str());	// rename does not replace on Windows
+	if (std::rename(tempPath.c_str(), path.c_str()) != 0) {
+		std::remove(tempPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+#endif // !BVH_CACHE_H
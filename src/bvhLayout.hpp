@@ -0,0 +1,183 @@
+#ifndef BVH_LAYOUT_H
+#define BVH_LAYOUT_H
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <vector>
+#include "flatStructures.hpp"
+
+// Order of the nodes of an instance BVH in flatNodes.
+// The builders write depth-first order: the left child follows its parent, the right child comes after the whole left
+// subtree. The treelet layout stores small subtrees (treelets) contiguously and both children of a node next to each
+// other, the traversal tests them together. Parents always stay before their children.
+enum BVHLayout
+{
+	BVH_LAYOUT_DEPTH_FIRST,	// As built
+	BVH_LAYOUT_TREELET		// Clusters of BVH_TREELET_NODES nodes grown from the largest boxes
+};
+
+const int BVH_TREELET_NODES = 16;	// 512 bytes, 8 cache lines
+
+// Index for the root of a BVH whose nodes could start at firstFree. The treelet layout stores sibling pairs right
+// after the root, with the root on an odd index every pair starts on an even one and shares a 64 byte line
+// (the node buffer starts on a line). Skipped nodes are filled with unusedBVHNode().
+inline int alignedBVHRoot(int firstFree, BVHLayout layout)
+{
+	return layout == BVH_LAYOUT_TREELET && firstFree % 2 == 0 ? firstFree + 1 : firstFree;
+}
+
+// Empty leaf that is never referenced
+inline FlatNode unusedBVHNode()
+{
+	FlatNode node;
+	node.boundsMin = glm::vec3(0);
+	node.boundsMax = glm::vec3(0);
+	node.setLeaf(0, 0);
+	return node;
+}
+
+// Moves the nodes of one BVH into the treelet layout in place, and the shape indices of its leaves into the new leaf
+// order, so leaves next to each other in memory read neighbouring indices. Keeps its scratch between calls.
+class BVHReorderer
+{
+public:
+	BVHReorderer();
+	~BVHReorderer();
+
+	// The BVH at root is stored in [root, root + node count), as every builder writes it. The root stays in place
+	void apply(std::vector<FlatNode>& nodes, std::vector<int>& indices, int root, BVHLayout layout);
+
+private:
+	void placeTreelet(int node);
+	void placeChildren(int node);
+	float area(int node) const;
+
+	const FlatNode* oldNodes = nullptr;	// Relative to the root
+	int root = 0;
+
+	std::vector<FlatNode> nodeCopy;
+	std::vector<int> indexCopy;
+	std::vector<int> position;	// Old node -> new node, relative to the root
+	std::vector<int> order;		// New node -> old node
+	std::vector<int> stack;
+};
+
+BVHReorderer::BVHReorderer()
+{
+}
+
+BVHReorderer::~BVHReorderer()
+{
+}
+
+inline void BVHReorderer::apply(std::vector<FlatNode>& nodes, std::vector<int>& indices, int root, BVHLayout layout)
+{
+	if (layout == BVH_LAYOUT_DEPTH_FIRST || root < 0)
+		return;
+
+	// Nodes of the tree and the index range of its leaves
+	int nodeCount = 0;
+	int firstIndex = -1, indexCount = 0;
+	stack.clear();
+	stack.push_back(root);
+	while (!stack.empty()) {
+		const FlatNode& node = nodes[stack.back()];
+		stack.pop_back();
+		nodeCount++;
+		if (node.isLeaf()) {
+			if (node.numShapes() > 0 && (firstIndex == -1 || node.startShapeIdx() < firstIndex))
+				firstIndex = node.startShapeIdx();
+			indexCount += node.numShapes();
+		}
+		else {
+			stack.push_back(node.leftChild());
+			stack.push_back(node.rightChild());
+		}
+	}
+	if (nodeCount < 3)
+		return;
+
+	nodeCopy.assign(nodes.begin() + root, nodes.begin() + root + nodeCount);
+	oldNodes = nodeCopy.data();
+	this->root = root;
+	position.assign(nodeCount, -1);
+	order.clear();
+	position[0] = 0;
+	order.push_back(0);
+	placeTreelet(0);
+
+	// Nodes in the new order, leaves take their indices in that order too
+	if (indexCount > 0)
+		indexCopy.assign(indices.begin() + firstIndex, indices.begin() + firstIndex + indexCount);
+	int indexCursor = firstIndex;
+	for (int i = 0; i < nodeCount; ++i) {
+		FlatNode node = oldNodes[order[i]];
+		if (node.isLeaf()) {
+			int count = node.numShapes();
+			if (count > 0) {
+				for (int k = 0; k < count; ++k)
+					indices[indexCursor + k] = indexCopy[node.startShapeIdx() - firstIndex + k];
+				node.setLeaf(indexCursor, count);
+				indexCursor += count;
+			}
+		}
+		else {
+			node.setInner(root + position[node.leftChild() - root], root + position[node.rightChild() - root]);
+		}
+		nodes[root + i] = node;
+	}
+}
+
+inline void BVHReorderer::placeTreelet(int node)
+{
+	// Grow the treelet below the (already placed) node by the inner node with the largest box, a ray enters a node
+	// with a probability about proportional to its surface area. Frontier holds inner nodes without placed children.
+	int frontier[BVH_TREELET_NODES];
+	int frontierCount = 0;
+	if (!oldNodes[node].isLeaf())
+		frontier[frontierCount++] = node;
+
+	int treeletSize = 1;
+	while (frontierCount > 0 && treeletSize + 2 <= BVH_TREELET_NODES) {
+		int best = 0;
+		for (int i = 1; i < frontierCount; ++i) {
+			if (area(frontier[i]) > area(frontier[best]))
+				best = i;
+		}
+		int expanded = frontier[best];
+		frontier[best] = frontier[--frontierCount];
+
+		placeChildren(expanded);
+		treeletSize += 2;
+		for (int child : { oldNodes[expanded].leftChild() - root, oldNodes[expanded].rightChild() - root }) {
+			if (!oldNodes[child].isLeaf())
+				frontier[frontierCount++] = child;
+		}
+	}
+
+	// Children of the frontier start new treelets, in depth-first order of their parents
+	std::sort(frontier, frontier + frontierCount);
+	for (int i = 0; i < frontierCount; ++i) {
+		const FlatNode& parent = oldNodes[frontier[i]];
+		placeChildren(frontier[i]);
+		placeTreelet(parent.leftChild() - root);
+		placeTreelet(parent.rightChild() - root);
+	}
+}
+
+inline void BVHReorderer::placeChildren(int node)
+{
+	// Siblings are always stored next to each other
+	for (int child : { oldNodes[node].leftChild() - root, oldNodes[node].rightChild() - root }) {
+		position[child] = static_cast<int>(order.size());
+		order.push_back(child);
+	}
+}
+
+inline float BVHReorderer::area(int node) const
+{
+	glm::vec3 extent = oldNodes[node].boundsMax - oldNodes[node].boundsMin;
+	return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+}
+
+#endif // !BVH_LAYOUT_H
@@ -0,0 +1,112 @@
+#ifndef CACHE_SIM_H
+#define CACHE_SIM_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Set-associative LRU cache model for benchmarks: counts the misses of a stream of memory accesses.
+// Misses are passed on to the next level when one is given (e.g. L1 -> L2). Accesses are given relative to the start
+// of their buffer and every buffer starts on its own line, as GPU buffers do, so the result does not depend on where
+// the CPU allocator placed the arrays.
+class CacheSim
+{
+public:
+	CacheSim(size_t sizeBytes, int ways, int lineBytes = 64, CacheSim* next = nullptr);
+	~CacheSim();
+
+	// Touch every line of [offset, offset + size) in given buffer
+	void access(const void* buffer, size_t offset, size_t size);
+	// Empty all lines and reset the counters
+	void reset();
+
+	long long accesses() const;
+	long long misses() const;
+
+private:
+	void accessLine(uint64_t line);
+	uint64_t bufferBase(const void* buffer);
+
+	int ways;
+	int lineShift = 0;
+	uint64_t setCount;
+	std::vector<uint64_t> tags;	// setCount * ways lines, most recently used first, 0 is empty
+	std::vector<const void*> buffers;	// Buffer i starts at address (i + 1) << 40
+	CacheSim* next;
+
+	long long accessCount = 0;
+	long long missCount = 0;
+};
+
+CacheSim::CacheSim(size_t sizeBytes, int ways, int lineBytes, CacheSim* next)
+	: ways(ways > 0 ? ways : 1), next(next)
+{
+	while ((1 << (lineShift + 1)) <= lineBytes)
+		lineShift++;
+	setCount = sizeBytes >> lineShift;
+	setCount = setCount >= static_cast<uint64_t>(this->ways) ? setCount / this->ways : 1;
+	tags.assign(setCount * this->ways, 0);
+}
+
+CacheSim::~CacheSim()
+{
+}
+
+inline void CacheSim::access(const void* buffer, size_t offset, size_t size)
+{
+	uint64_t address = bufferBase(buffer) + offset;
+	uint64_t first = address >> lineShift;
+	uint64_t last = (address + (size > 0 ? size - 1 : 0)) >> lineShift;
+	for (uint64_t line = first; line <= last; ++line)
+		accessLine(line);
+}
+
+inline uint64_t CacheSim::bufferBase(const void* buffer)
+{
+	size_t i = std::find(buffers.begin(), buffers.end(), buffer) - buffers.begin();
+	if (i == buffers.size())
+		buffers.push_back(buffer);
+	return uint64_t(i + 1) << 40;
+}
+
+inline void CacheSim::accessLine(uint64_t line)
+{
+	accessCount++;
+	uint64_t* set = &tags[(line % setCount) * ways];
+	uint64_t tag = line + 1;
+
+	// Hit moves the line to the front, a miss evicts the last one
+	int way = 0;
+	while (way < ways && set[way] != tag)
+		way++;
+	if (way == ways) {
+		missCount++;
+		if (next) next->accessLine(line);
+		way = ways - 1;
+	}
+	for (; way > 0; --way)
+		set[way] = set[way - 1];
+	set[0] = tag;
+}
+
+inline void CacheSim::reset()
+{
+	std::fill(tags.begin(), tags.end(), 0);
+	buffers.clear();
+	accessCount = 0;
+	missCount = 0;
+	if (next) next->reset();
+}
+
+inline long long CacheSim::accesses() const
+{
+	return accessCount;
+}
+
+inline long long CacheSim::misses() const
+{
+	return missCount;
+}
+
+#endif // !CACHE_SIM_H
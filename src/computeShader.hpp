@@ -13,9 +13,12 @@
 class ComputeShader
 {
 public:
-	unsigned ID;
-	ComputeShader(const char* computePath);
+	unsigned ID = 0;
+	// defines: "#define NAME value" lines inserted after the #version line
+	ComputeShader(const char* computePath, const std::string& defines = "");
 	~ComputeShader();
+	// Compile again with other defines (e.g. workgroup size), the previous program is deleted
+	void compile(const std::string& defines);
 	void use();
 	void setBool(const std::string& name, bool value) const;
 	void setInt(const std::string& name, int value) const;
@@ -24,11 +27,17 @@ public:
 	void setVec2(const std::string& name, glm::vec2 v) const;
 
 private:
-
+	std::string path;
 };
 
-ComputeShader::ComputeShader(const char* computePath)
+ComputeShader::ComputeShader(const char* computePath, const std::string& defines) : path(computePath)
 {
+	compile(defines);
+}
+
+void ComputeShader::compile(const std::string& defines)
+{
+	const char* computePath = path.c_str();
 	std::string computeCode;
 	std::ifstream cShaderFile;
 
@@ -49,6 +58,12 @@ ComputeShader::ComputeShader(const char* computePath)
 		std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ" << std::endl;
 	}
 
+	// Defines must follow the #version directive
+	size_t versionEnd = computeCode.find("#version");
+	versionEnd = versionEnd == std::string::npos ? 0 : computeCode.find('\n', versionEnd);
+	versionEnd = versionEnd == std::string::npos ? computeCode.size() : versionEnd + 1;
+	computeCode.insert(versionEnd, defines);
+
 	const char* cShaderCode = computeCode.c_str();
 
 	// Compile shaders
@@ -68,6 +83,7 @@ ComputeShader::ComputeShader(const char* computePath)
 	};
 
 	// Shader program
+	if (ID) glDeleteProgram(ID);
 	ID = glCreateProgram();
 	glAttachShader(ID, compute);
 	glLinkProgram(ID);
@@ -0,0 +1,308 @@
+#ifndef EMBREE_SCENE_H
+#define EMBREE_SCENE_H
+
+#include <glm/glm.hpp>
+#include <embree4/rtcore.h>
+#include <embree4/rtcore_ray.h>
+#include <limits>
+#include <memory>
+#include <vector>
+#include "ray.hpp"
+#include "shapes/shape.hpp"
+#include "shapes/triangle.hpp"
+#include "mesh.hpp"
+
+// Triangles of the scene uploaded to Embree.
+// Every mesh is one indexed triangle geometry sharing its vertex and index buffers with Embree, placed into the scene
+// as an instance so it can be moved by a transform. Loose triangles are batched into one more geometry on commit.
+// Hits are mapped back to scene shape indices.
+class EmbreeScene
+{
+public:
+	EmbreeScene();
+	~EmbreeScene();
+
+	void init(RTCDevice device);
+	void release();
+
+	// Triangles of the mesh were added to the scene as shapes [firstShapeIdx, firstShapeIdx + indices / 3)
+	void addMesh(const Mesh& mesh, int firstShapeIdx);
+	// Single triangle, uploaded on commit()
+	void addTriangle(const Triangle& triangle, int shapeIdx);
+	// Build Embree scene (once after the scene is generated, again after updateTriangles)
+	void commit();
+
+	// Copy current vertices of moved triangles into the geometry buffers
+	void updateTriangles(const std::vector<std::unique_ptr<Shape>>& shapes, const std::vector<int>& shapeIndices);
+	// Place the mesh containing the shape (object -> world transform), applied on commit()
+	void setMeshTransform(int shapeIdx, const glm::mat4& transform);
+
+	// Closest triangle hit, returns shape index (-1 if nothing was hit) and its distance
+	int intersect(Ray ray, float& dist) const;
+	// Any triangle hit closer than maxDist
+	bool occluded(Ray ray, float maxDist) const;
+
+	bool empty() const;
+
+private:
+	struct Geometry {
+		RTCGeometry geom = nullptr;
+		RTCScene meshScene = nullptr;		// Meshes only, scene with the geometry and its instance
+		RTCGeometry instance = nullptr;
+		std::vector<float> vertices;	// xyz, padded by one float for Embree's 16 byte reads
+		std::vector<unsigned> indices;
+		std::vector<int> shapeIndices;	// primID -> shape index
+		bool dirty = false;
+	};
+
+	void attach(Geometry& geometry, bool instanced);
+
+	RTCDevice device = nullptr;
+	RTCScene scene = nullptr;
+
+	// Geometry ID is the position in this vector (owned, buffers must not move)
+	std::vector<std::unique_ptr<Geometry>> geometries;
+	std::unique_ptr<Geometry> looseTriangles;
+
+	// Shape index -> geometry ID and primitive ID (for updates)
+	std::vector<glm::ivec2> shapePrims;
+	bool needsCommit = false;
+};
+
+EmbreeScene::EmbreeScene()
+{
+}
+
+EmbreeScene::~EmbreeScene()
+{
+	release();
+}
+
+inline void EmbreeScene::init(RTCDevice dev)
+{
+	release();
+	device = dev;
+	scene = rtcNewScene(device);
+}
+
+inline void EmbreeScene::release()
+{
+	for (auto& geometry : geometries) {
+		if (geometry->meshScene) rtcReleaseScene(geometry->meshScene);
+	}
+	if (scene) rtcReleaseScene(scene);
+	scene = nullptr;
+	geometries.clear();
+	looseTriangles.reset();
+	shapePrims.clear();
+}
+
+inline bool EmbreeScene::empty() const
+{
+	return geometries.empty() && !looseTriangles;
+}
+
+inline void EmbreeScene::addMesh(const Mesh& mesh, int firstShapeIdx)
+{
+	std::unique_ptr<Geometry> geometry(new Geometry());
+
+	geometry->vertices.reserve(mesh.vertices.size() * 3 + 1);
+	for (const Vertex& vertex : mesh.vertices) {
+		glm::vec3 p = vertex.Position + mesh.origin;
+		geometry->vertices.push_back(p.x);
+		geometry->vertices.push_back(p.y);
+		geometry->vertices.push_back(p.z);
+	}
+	geometry->vertices.push_back(0.f);
+
+	geometry->indices = mesh.indices;
+	for (int i = 0; i < mesh.indices.size() / 3; ++i)
+		geometry->shapeIndices.push_back(firstShapeIdx + i);
+
+	attach(*geometry, true);
+	geometries.push_back(std::move(geometry));
+}
+
+inline void EmbreeScene::addTriangle(const Triangle& triangle, int shapeIdx)
+{
+	if (!looseTriangles)
+		looseTriangles.reset(new Geometry());
+
+	// Drop padding, added back on commit
+	auto& vertices = looseTriangles->vertices;
+	if (!vertices.empty()) vertices.pop_back();
+
+	unsigned first = static_cast<unsigned>(vertices.size() / 3);
+	for (const glm::vec3& p : { triangle.a, triangle.b, triangle.c }) {
+		vertices.push_back(p.x);
+		vertices.push_back(p.y);
+		vertices.push_back(p.z);
+	}
+	vertices.push_back(0.f);
+
+	looseTriangles->indices.push_back(first);
+	looseTriangles->indices.push_back(first + 1);
+	looseTriangles->indices.push_back(first + 2);
+	looseTriangles->shapeIndices.push_back(shapeIdx);
+}
+
+inline void EmbreeScene::attach(Geometry& geometry, bool instanced)
+{
+	geometry.geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
+	rtcSetSharedGeometryBuffer(geometry.geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3,
+		geometry.vertices.data(), 0, 3 * sizeof(float), (geometry.vertices.size() - 1) / 3);
+	rtcSetSharedGeometryBuffer(geometry.geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3,
+		geometry.indices.data(), 0, 3 * sizeof(unsigned), geometry.indices.size() / 3);
+	rtcCommitGeometry(geometry.geom);
+
+	unsigned geomID = static_cast<unsigned>(geometries.size());
+	if (instanced) {
+		geometry.meshScene = rtcNewScene(device);
+		rtcAttachGeometry(geometry.meshScene, geometry.geom);
+		rtcReleaseGeometry(geometry.geom); // Mesh scene holds the reference
+		rtcCommitScene(geometry.meshScene);
+
+		const glm::mat4 identity(1.f);
+		geometry.instance = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_INSTANCE);
+		rtcSetGeometryInstancedScene(geometry.instance, geometry.meshScene);
+		rtcSetGeometryTransform(geometry.instance, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, &identity[0][0]);
+		rtcCommitGeometry(geometry.instance);
+		rtcAttachGeometryByID(scene, geometry.instance, geomID);
+		rtcReleaseGeometry(geometry.instance);
+	}
+	else {
+		rtcAttachGeometryByID(scene, geometry.geom, geomID);
+		rtcReleaseGeometry(geometry.geom); // Scene holds the reference
+	}
+
+	for (int primID = 0; primID < geometry.shapeIndices.size(); ++primID) {
+		int shapeIdx = geometry.shapeIndices[primID];
+		if (shapeIdx >= shapePrims.size())
+			shapePrims.resize(shapeIdx + 1, glm::ivec2(-1));
+		shapePrims[shapeIdx] = glm::ivec2(geomID, primID);
+	}
+
+	needsCommit = true;
+}
+
+inline void EmbreeScene::commit()
+{
+	if (!scene) return;
+
+	// Loose triangles become the last geometry
+	if (looseTriangles) {
+		attach(*looseTriangles, false);
+		geometries.push_back(std::move(looseTriangles));
+	}
+
+	for (auto& geometry : geometries) {
+		if (geometry->dirty) {
+			rtcUpdateGeometryBuffer(geometry->geom, RTC_BUFFER_TYPE_VERTEX, 0);
+			rtcCommitGeometry(geometry->geom);
+			if (geometry->meshScene) {
+				rtcCommitScene(geometry->meshScene);
+				rtcCommitGeometry(geometry->instance);
+			}
+			geometry->dirty = false;
+		}
+	}
+
+	if (needsCommit) {
+		rtcCommitScene(scene);
+		needsCommit = false;
+	}
+}
+
+inline void EmbreeScene::updateTriangles(const std::vector<std::unique_ptr<Shape>>& shapes, const std::vector<int>& shapeIndices)
+{
+	for (int shapeIdx : shapeIndices) {
+		if (shapeIdx >= shapePrims.size() || shapePrims[shapeIdx].x < 0) continue;
+
+		if (shapes[shapeIdx]->type != SHAPE_TRIANGLE) continue;
+		auto triangle = static_cast<const Triangle*>(shapes[shapeIdx].get());
+
+		Geometry& geometry = *geometries[shapePrims[shapeIdx].x];
+		const unsigned* tri = &geometry.indices[shapePrims[shapeIdx].y * 3];
+		const glm::vec3 corners[3] = { triangle->a, triangle->b, triangle->c };
+		for (int i = 0; i < 3; ++i) {
+			geometry.vertices[tri[i] * 3 + 0] = corners[i].x;
+			geometry.vertices[tri[i] * 3 + 1] = corners[i].y;
+			geometry.vertices[tri[i] * 3 + 2] = corners[i].z;
+		}
+
+		geometry.dirty = true;
+		needsCommit = true;
+	}
+}
+
+inline void EmbreeScene::setMeshTransform(int shapeIdx, const glm::mat4& transform)
+{
+	if (shapeIdx >= shapePrims.size() || shapePrims[shapeIdx].x < 0) return;
+
+	Geometry& geometry = *geometries[shapePrims[shapeIdx].x];
+	if (!geometry.instance) return;
+
+	rtcSetGeometryTransform(geometry.instance, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, &transform[0][0]);
+	rtcCommitGeometry(geometry.instance);
+	needsCommit = true;
+}
+
+inline int EmbreeScene::intersect(Ray ray, float& dist) const
+{
+	if (!scene) return -1;
+
+	RTCRayHit rayhit;
+	memset(&rayhit, 0, sizeof(RTCRayHit));
+
+	rayhit.ray.org_x = ray.get_start().x;
+	rayhit.ray.org_y = ray.get_start().y;
+	rayhit.ray.org_z = ray.get_start().z;
+
+	rayhit.ray.dir_x = ray.get_dir().x;
+	rayhit.ray.dir_y = ray.get_dir().y;
+	rayhit.ray.dir_z = ray.get_dir().z;
+
+	rayhit.ray.tnear = 0.0f;
+	rayhit.ray.tfar = std::numeric_limits<float>::infinity();
+	rayhit.ray.mask = 0xFFFFFFFF;
+	rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
+	rayhit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
+
+	rtcIntersect1(scene, &rayhit);
+
+	if (rayhit.hit.geomID == RTC_INVALID_GEOMETRY_ID)
+		return -1;
+
+	// Mesh hits report the instance as the scene level geometry
+	unsigned geomID = rayhit.hit.instID[0] != RTC_INVALID_GEOMETRY_ID ? rayhit.hit.instID[0] : rayhit.hit.geomID;
+
+	dist = rayhit.ray.tfar;
+	return geometries[geomID]->shapeIndices[rayhit.hit.primID];
+}
+
+inline bool EmbreeScene::occluded(Ray ray, float maxDist) const
+{
+	if (!scene) return false;
+
+	RTCRay rtcray;
+	memset(&rtcray, 0, sizeof(RTCRay));
+
+	rtcray.org_x = ray.get_start().x;
+	rtcray.org_y = ray.get_start().y;
+	rtcray.org_z = ray.get_start().z;
+
+	rtcray.dir_x = ray.get_dir().x;
+	rtcray.dir_y = ray.get_dir().y;
+	rtcray.dir_z = ray.get_dir().z;
+
+	rtcray.tnear = 0.0f;
+	rtcray.tfar = maxDist;
+	rtcray.mask = 0xFFFFFFFF;
+
+	rtcOccluded1(scene, &rtcray);
+
+	// tfar is set to -inf on hit
+	return rtcray.tfar < 0.f;
+}
+
+#endif // !EMBREE_SCENE_H
@@ -52,6 +52,48 @@ struct FlatShape {
 
 };
 
+// Packed GPU layout: one tightly packed buffer per shape type, materials are shared through a table.
+// materialInstance = material id (low 16 bits) | instance + 1 (high 16 bits, 0 for world space)
+inline unsigned packMaterialInstance(int materialId, int instance) {
+	return static_cast<unsigned>(materialId & 0xFFFF) | (static_cast<unsigned>(instance + 1) << 16);
+}
+
+// Primitive reference: index in the buffer of its type * 4 + type
+enum FlatShapeType { FLAT_SPHERE = 0, FLAT_WALL = 2, FLAT_TRIANGLE = 3 };
+inline int makePrimitiveRef(int index, int type) { return (index << 2) | type; }
+
+struct FlatTriangle {
+	alignas(16) glm::vec3 v0;
+	unsigned materialInstance;
+
+	alignas(16) glm::vec3 edge1; // Ordered so cross(edge1, edge2) points along the triangle normal
+	float padding1;
+
+	alignas(16) glm::vec3 edge2;
+	float padding2;
+};
+
+struct FlatSphere {
+	alignas(16) glm::vec3 center;
+	float radius;
+
+	unsigned materialInstance;
+	float padding[3];
+};
+
+// Planes are walls with width < 0
+struct FlatWall {
+	alignas(16) glm::vec3 normal;
+	float d;
+
+	alignas(16) glm::vec3 start;
+	float width;
+
+	float height;
+	unsigned materialInstance;
+	float padding[2];
+};
+
 struct FlatCamera {
 	glm::vec3 Position;
 	float aspectRatio;
@@ -80,7 +122,14 @@ struct FlatLight {
 struct FlatScene {
 	FlatCamera camera;
 	FlatLight light;
-	std::vector <FlatShape> shapes;
+
+	std::vector<FlatMaterial> materials;
+	std::vector<FlatTriangle> triangles;
+	std::vector<FlatSphere> spheres;
+	std::vector<FlatWall> walls;
+
+	std::vector<int> shapeRefs;			// Shape index -> primitive reference (primitives are stored in BVH leaf order)
+	std::vector<int> shapeMaterials;	// Shape index -> material id
 };
 
 struct FlatBBox {
@@ -91,22 +140,37 @@ struct FlatBBox {
 	float padding2;
 };
 
+// 32 bytes, child or leaf data is packed into the slots after the bounds
 struct FlatNode {
 	alignas(16) glm::vec3 boundsMin;
-	float padding1;
+	int leftFirst;       // Inner node: index of the left child | leaf: first index in bvhIndices
 
 	alignas(16) glm::vec3 boundsMax;
-	float padding2;
-	
-	int leftChild;       // Index of the left child (-1 for leaf)
-	int rightChild;      // Index of the right child (-1 for leaf)
-	
-	int startShapeIdx;   // Index of the triangle (only valid for leaf nodes)
-	int numShapes;
+	int rightCount;      // Inner node: index of the right child | leaf: sign bit set, number of shapes
+
+	bool isLeaf() const { return rightCount < 0; }
+	int leftChild() const { return leftFirst; }
+	int rightChild() const { return rightCount; }
+	int startShapeIdx() const { return leftFirst; }
+	int numShapes() const { return rightCount & 0x7FFFFFFF; }
+
+	void setInner(int left, int right) { leftFirst = left; rightCount = right; }
+	void setLeaf(int start, int count) { leftFirst = start; rightCount = static_cast<int>(0x80000000u | static_cast<unsigned>(count)); }
 };
 std::vector<FlatNode> flatNodes;
 std::vector<int> bvhIndices; // Node 1 - shape indices; Node 2...
 
+struct FlatInstance {
+	glm::mat4 worldToObject;
+	glm::mat4 objectToWorld;
+
+	int blasRoot;        // Root of the instance BVH in flatNodes
+	int primitiveType;   // FlatShapeType of all shapes of the instance
+	int primitiveOffset; // Leaf shape i (in bvhIndices) is element i + primitiveOffset of the buffer of primitiveType
+	int padding;
+};
+std::vector<FlatInstance> flatInstances;
+
 
 #endif // !FLAT_STRUCTURES_H
 
@@ -12,16 +12,17 @@ enum IntersectType {
 class Intersection
 {
 public:
-	Intersection(IntersectType itype, glm::vec3 hit);
+	Intersection(IntersectType itype, glm::vec3 hit, float t);
 	~Intersection();
 	IntersectType intersect_type;
 	glm::vec3 hit_point;
+	float t;	// Ray parameter of the hit (distance along normalized rays)
 
 private:
 
 };
 
-Intersection::Intersection(IntersectType itype = NONE, glm::vec3 hit = glm::vec3()): intersect_type(itype), hit_point(hit)
+Intersection::Intersection(IntersectType itype = NONE, glm::vec3 hit = glm::vec3(), float t = 0): intersect_type(itype), hit_point(hit), t(t)
 {
 }
 
@@ -0,0 +1,587 @@
+#ifndef LBVH_H
+#define LBVH_H
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "flatStructures.hpp"
+#include "shapes/shape.hpp"
+#include "BoundingBox.hpp"
+#include "threadPool.hpp"
+#include "bvh.hpp"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Linear BVH builder for scenes that are rebuilt every frame instead of refitted.
+// Shape centroids get Morton codes (30 or 63 bits), the codes are radix sorted and the binary radix tree over the
+// sorted codes is emitted with the Karras construction (every inner node independently). An optional pass
+// restructures small treelets for a lower SAH cost. Subtrees are collapsed into leaves by the same costs as
+// the binned SAH builder, then written straight into the flat layout.
+// The BVH of an instance always fits into nodeCapacity() nodes and one index per shape, so it can be
+// rebuilt in place in flatNodes and bvhIndices.
+
+const int LBVH_PARALLEL_MIN_SHAPES = 16384;	// Smaller BVHs are built on one thread
+const int LBVH_TREELET_LEAVES = 7;			// Treelet size of the restructuring pass (2^7 subsets)
+
+// Parameters of the LBVH builder (leaf sizes and costs come from SAHBuildParams)
+struct LBVHParams
+{
+	int mortonBits = 30;			// 30 (10 bits per axis) or 63 (21 bits per axis)
+	int treeletPasses = 0;			// Treelet restructuring passes, 0 = plain LBVH
+};
+
+// Nodes and indices reserved for the BVH of one instance
+struct LBVHRange
+{
+	int firstNode = 0;
+	int nodeCount = 0;
+	int firstIndex = 0;
+	int indexCount = 0;
+};
+
+class LBVHBuilder
+{
+public:
+	LBVHBuilder();
+	~LBVHBuilder();
+
+	void init(const SAHBuildParams& params, const LBVHParams& lbvhParams, ThreadPool* pool = nullptr);
+
+	// Nodes reserved for a BVH over count shapes
+	static int nodeCapacity(int count);
+
+	// Build BVH over given shapes into nodes [firstNode, firstNode + nodeCapacity) and indices [firstIndex, firstIndex + count),
+	// both must be allocated. Returns the root (firstNode), unused nodes at the end of the range are empty leaves
+	int build(const std::vector<std::unique_ptr<Shape>>& shapes, const std::vector<int>& shapeIndices,
+		std::vector<FlatNode>& nodes, int firstNode, std::vector<int>& indices, int firstIndex);
+
+private:
+	void computeCodes(const std::vector<std::unique_ptr<Shape>>& shapes, const std::vector<int>& shapeIndices);
+	void sortCodes();
+	void buildHierarchy();
+	void computeBounds();
+	void computePreorder();
+	void restructureTreelet(int root);
+	int emit(int node, int depth, std::vector<FlatNode>& nodes, std::vector<int>& indices);
+
+	int delta(int i, int j) const;
+	float area(int node) const;
+	void setCost(int node);
+	bool isLeaf(int node) const;
+
+	template<typename Task>
+	void parallelChunks(int count, const Task& task);
+
+	SAHBuildParams params;
+	LBVHParams lbvhParams;
+	ThreadPool* pool = nullptr;
+
+	// Scratch of the last build, kept so per-frame rebuilds do not allocate
+	int shapeCount = 0;
+	std::vector<uint64_t> codes, sortedCodes;
+	std::vector<int> order, sortedOrder;	// Shape per sorted position
+	std::vector<glm::vec3> shapeMin, shapeMax;
+	std::vector<int> histograms;
+
+	// Inner nodes 0 .. n-2 (root 0), leaves n-1 .. 2n-2 (sorted shape + n - 1)
+	std::vector<int> left, right;
+	std::vector<glm::vec3> boxMin, boxMax;
+	std::vector<int> counts;
+	std::vector<float> costs;
+	std::vector<char> collapse;		// Subtree is cheaper as one leaf
+	std::vector<int> preorder, stack;
+	int nodeCursor = 0;
+	int indexCursor = 0;
+};
+
+LBVHBuilder::LBVHBuilder()
+{
+}
+
+LBVHBuilder::~LBVHBuilder()
+{
+}
+
+inline void LBVHBuilder::init(const SAHBuildParams& params, const LBVHParams& lbvhParams, ThreadPool* pool)
+{
+	this->params = params;
+	this->params.maxLeafSize = glm::max(params.maxLeafSize, 1);
+	this->params.leafBlockSize = glm::max(params.leafBlockSize, 1);
+	this->lbvhParams = lbvhParams;
+	this->lbvhParams.mortonBits = lbvhParams.mortonBits > 30 ? 63 : 30;
+	this->pool = pool && pool->size() > 1 ? pool : nullptr;
+}
+
+inline int LBVHBuilder::nodeCapacity(int count)
+{
+	return count > 0 ? 2 * count - 1 : 1;
+}
+
+// Spread the low 21 bits so there are two zero bits between them
+inline uint64_t mortonSpread(uint64_t x)
+{
+	x &= 0x1fffff;
+	x = (x | x << 32) & 0x1f00000000ffffull;
+	x = (x | x << 16) & 0x1f0000ff0000ffull;
+	x = (x | x << 8) & 0x100f00f00f00f00full;
+	x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+	x = (x | x << 2) & 0x1249249249249249ull;
+	return x;
+}
+
+inline int leadingZeros64(uint64_t x)
+{
+	if (x == 0) return 64;
+#ifdef _MSC_VER
+	unsigned long bit;
+	_BitScanReverse64(&bit, x);
+	return 63 - static_cast<int>(bit);
+#else
+	return __builtin_clzll(x);
+#endif
+}
+
+template<typename Task>
+inline void LBVHBuilder::parallelChunks(int count, const Task& task)
+{
+	if (!pool || count < LBVH_PARALLEL_MIN_SHAPES) {
+		task(0, count, 0);
+		return;
+	}
+
+	int chunks = glm::min(pool->size() * 4, glm::max(count / 4096, 1));
+	pool->parallelFor(chunks, [&](int chunk, int) {
+		task(static_cast<int>(static_cast<long long>(count) * chunk / chunks),
+			static_cast<int>(static_cast<long long>(count) * (chunk + 1) / chunks), chunk);
+	});
+}
+
+inline int LBVHBuilder::build(const std::vector<std::unique_ptr<Shape>>& shapes, const std::vector<int>& shapeIndices,
+	std::vector<FlatNode>& nodes, int firstNode, std::vector<int>& indices, int firstIndex)
+{
+	shapeCount = static_cast<int>(shapeIndices.size());
+	int capacity = nodeCapacity(shapeCount);
+
+	if (shapeCount == 0) {
+		FlatNode& leaf = nodes[firstNode];
+		leaf.boundsMin = glm::vec3(INFINITY);
+		leaf.boundsMax = glm::vec3(-INFINITY);
+		leaf.setLeaf(firstIndex, 0);
+		return firstNode;
+	}
+
+	computeCodes(shapes, shapeIndices);
+	sortCodes();
+	buildHierarchy();
+	computeBounds();
+
+	// Bottom-up over the current tree, a restructured treelet keeps the nodes below it
+	for (int pass = 0; pass < lbvhParams.treeletPasses; ++pass) {
+		if (pass > 0) computePreorder();
+		for (int i = static_cast<int>(preorder.size()) - 1; i >= 0; --i) {
+			if (!isLeaf(preorder[i]) && counts[preorder[i]] >= LBVH_TREELET_LEAVES)
+				restructureTreelet(preorder[i]);
+		}
+	}
+
+	// Shapes in sorted (or restructured) leaf order
+	nodeCursor = firstNode;
+	indexCursor = firstIndex;
+	for (int i = 0; i < shapeCount; ++i)
+		sortedOrder[i] = shapeIndices[order[i]];
+
+	emit(0, 0, nodes, indices);
+
+	// Nodes left over after collapsing are never referenced
+	for (int i = nodeCursor; i < firstNode + capacity; ++i) {
+		nodes[i].boundsMin = glm::vec3(0);
+		nodes[i].boundsMax = glm::vec3(0);
+		nodes[i].setLeaf(firstIndex, 0);
+	}
+	return firstNode;
+}
+
+inline void LBVHBuilder::computeCodes(const std::vector<std::unique_ptr<Shape>>& shapes, const std::vector<int>& shapeIndices)
+{
+	int n = shapeCount;
+	shapeMin.resize(n);
+	shapeMax.resize(n);
+	codes.resize(n);
+	order.resize(n);
+
+	parallelChunks(n, [&](int begin, int end, int) {
+		for (int i = begin; i < end; ++i) {
+			BoundingBox box;
+			box.growToInclude(shapes[shapeIndices[i]]);
+			shapeMin[i] = box.Min;
+			shapeMax[i] = box.Max;
+		}
+	});
+
+	// Centroid bounds, shapes without bounds sit at the origin like in the SAH builder
+	BoundingBox centroidBox;
+	for (int i = 0; i < n; ++i) {
+		bool empty = shapeMax[i].x < shapeMin[i].x;
+		centroidBox.growToInclude(empty ? glm::vec3(0) : (shapeMin[i] + shapeMax[i]) * 0.5f);
+	}
+
+	int axisBits = lbvhParams.mortonBits / 3;
+	float cells = float((1 << axisBits) - 1);
+	glm::vec3 extent = centroidBox.Max - centroidBox.Min;
+	glm::vec3 scale;
+	for (int axis = 0; axis < 3; ++axis)
+		scale[axis] = extent[axis] > 0.f ? cells / extent[axis] : 0.f;
+
+	parallelChunks(n, [&](int begin, int end, int) {
+		for (int i = begin; i < end; ++i) {
+			bool empty = shapeMax[i].x < shapeMin[i].x;
+			glm::vec3 centroid = empty ? glm::vec3(0) : (shapeMin[i] + shapeMax[i]) * 0.5f;
+			glm::vec3 cell = glm::clamp((centroid - centroidBox.Min) * scale, glm::vec3(0), glm::vec3(cells));
+			codes[i] = mortonSpread(uint64_t(cell.x)) << 2 | mortonSpread(uint64_t(cell.y)) << 1 | mortonSpread(uint64_t(cell.z));
+			order[i] = i;
+		}
+	});
+}
+
+inline void LBVHBuilder::sortCodes()
+{
+	// LSD radix sort by 8 bit digits, stable so equal codes keep the shape order.
+	// Every chunk counts its digits, the chunk offsets per digit follow from the counts in chunk order
+	int n = shapeCount;
+	sortedCodes.resize(n);
+	sortedOrder.resize(n);
+
+	int chunks = (pool && n >= LBVH_PARALLEL_MIN_SHAPES) ? glm::min(pool->size() * 4, glm::max(n / 4096, 1)) : 1;
+	histograms.resize(chunks * 256);
+
+	for (int shift = 0; shift < lbvhParams.mortonBits; shift += 8) {
+		std::fill(histograms.begin(), histograms.end(), 0);
+		parallelChunks(n, [&](int begin, int end, int chunk) {
+			int* histogram = &histograms[chunk * 256];
+			for (int i = begin; i < end; ++i)
+				histogram[(codes[i] >> shift) & 0xFF]++;
+		});
+
+		// All codes share this digit, nothing moves
+		bool single = false;
+		for (int digit = 0; digit < 256 && !single; ++digit) {
+			int total = 0;
+			for (int chunk = 0; chunk < chunks; ++chunk)
+				total += histograms[chunk * 256 + digit];
+			single = total == n;
+		}
+		if (single) continue;
+
+		int offset = 0;
+		for (int digit = 0; digit < 256; ++digit) {
+			for (int chunk = 0; chunk < chunks; ++chunk) {
+				int count = histograms[chunk * 256 + digit];
+				histograms[chunk * 256 + digit] = offset;
+				offset += count;
+			}
+		}
+
+		parallelChunks(n, [&](int begin, int end, int chunk) {
+			int* next = &histograms[chunk * 256];
+			for (int i = begin; i < end; ++i) {
+				int dst = next[(codes[i] >> shift) & 0xFF]++;
+				sortedCodes[dst] = codes[i];
+				sortedOrder[dst] = order[i];
+			}
+		});
+		codes.swap(sortedCodes);
+		order.swap(sortedOrder);
+	}
+}
+
+// Length of the common prefix of sorted codes i and j, -1 outside the array.
+// Equal codes are told apart by their position
+inline int LBVHBuilder::delta(int i, int j) const
+{
+	if (j < 0 || j >= shapeCount)
+		return -1;
+	uint64_t a = codes[i], b = codes[j];
+	if (a == b)
+		return 32 + leadingZeros64(uint64_t(i ^ j));
+	return leadingZeros64(a ^ b);
+}
+
+inline bool LBVHBuilder::isLeaf(int node) const
+{
+	return node >= shapeCount - 1;
+}
+
+inline void LBVHBuilder::buildHierarchy()
+{
+	int n = shapeCount;
+	int innerCount = n - 1;
+	left.resize(glm::max(innerCount, 0));
+	right.resize(glm::max(innerCount, 0));
+
+	// Karras 2012: the range of inner node i starts or ends at i, the split is where the common prefix changes
+	parallelChunks(innerCount, [&](int begin, int end, int) {
+		for (int i = begin; i < end; ++i) {
+			int d = delta(i, i + 1) - delta(i, i - 1) >= 0 ? 1 : -1;
+
+			// Upper bound of the range length, then binary search of the other end
+			int deltaMin = delta(i, i - d);
+			int lengthMax = 2;
+			while (delta(i, i + lengthMax * d) > deltaMin)
+				lengthMax *= 2;
+			int length = 0;
+			for (int t = lengthMax / 2; t >= 1; t /= 2) {
+				if (delta(i, i + (length + t) * d) > deltaMin)
+					length += t;
+			}
+			int j = i + length * d;
+
+			// Split position, last shape with the longer prefix
+			int deltaNode = delta(i, j);
+			int split = 0;
+			int t = length;
+			do {
+				t = (t + 1) / 2;
+				if (delta(i, i + (split + t) * d) > deltaNode)
+					split += t;
+			} while (t > 1);
+			int gamma = i + split * d + glm::min(d, 0);
+
+			left[i] = glm::min(i, j) == gamma ? innerCount + gamma : gamma;
+			right[i] = glm::max(i, j) == gamma + 1 ? innerCount + gamma + 1 : gamma + 1;
+		}
+	});
+}
+
+inline float LBVHBuilder::area(int node) const
+{
+	glm::vec3 size = boxMax[node] - boxMin[node];
+	if (size.x < 0.f || size.y < 0.f || size.z < 0.f) return 0.f;
+	return 2.f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+// Cheaper of an inner node and one leaf with all shapes of the subtree, both weighted by area
+inline void LBVHBuilder::setCost(int node)
+{
+	float nodeArea = area(node);
+	costs[node] = params.traversalCost * nodeArea + costs[left[node]] + costs[right[node]];
+	collapse[node] = 0;
+	if (counts[node] <= params.maxLeafSize) {
+		float leafCost = nodeArea * sahIntersectionCost(params, counts[node]);
+		if (leafCost <= costs[node]) {
+			costs[node] = leafCost;
+			collapse[node] = 1;
+		}
+	}
+}
+
+inline void LBVHBuilder::computeBounds()
+{
+	int n = shapeCount;
+	int innerCount = n - 1;
+	boxMin.resize(2 * n - 1);
+	boxMax.resize(2 * n - 1);
+	counts.resize(2 * n - 1);
+	costs.resize(2 * n - 1);
+	collapse.resize(2 * n - 1);
+
+	for (int i = 0; i < n; ++i) {
+		int leaf = innerCount + i;
+		boxMin[leaf] = shapeMin[order[i]];
+		boxMax[leaf] = shapeMax[order[i]];
+		counts[leaf] = 1;
+		costs[leaf] = area(leaf) * sahIntersectionCost(params, 1);
+		collapse[leaf] = 1;
+	}
+
+	computePreorder();
+	for (int i = static_cast<int>(preorder.size()) - 1; i >= 0; --i) {
+		int node = preorder[i];
+		if (isLeaf(node)) continue;
+
+		int l = left[node], r = right[node];
+		boxMin[node] = glm::min(boxMin[l], boxMin[r]);
+		boxMax[node] = glm::max(boxMax[l], boxMax[r]);
+		counts[node] = counts[l] + counts[r];
+		setCost(node);
+	}
+}
+
+inline void LBVHBuilder::computePreorder()
+{
+	// Pre-order from the root, reversed it visits children before parents
+	preorder.clear();
+	stack.clear();
+	stack.push_back(0);
+	while (!stack.empty()) {
+		int node = stack.back();
+		stack.pop_back();
+		preorder.push_back(node);
+		if (!isLeaf(node)) {
+			stack.push_back(right[node]);
+			stack.push_back(left[node]);
+		}
+	}
+}
+
+inline void LBVHBuilder::restructureTreelet(int root)
+{
+	// Treelet leaves: open the biggest inner node until there are enough (Karras and Aila 2013)
+	int leaves[LBVH_TREELET_LEAVES];
+	int inner[LBVH_TREELET_LEAVES];	// Inner nodes below the root, reused for the new topology
+	int leafCount = 2, innerCount = 0;
+	leaves[0] = left[root];
+	leaves[1] = right[root];
+	while (leafCount < LBVH_TREELET_LEAVES) {
+		int best = -1;
+		float bestArea = -1.f;
+		for (int i = 0; i < leafCount; ++i) {
+			if (isLeaf(leaves[i])) continue;
+			float leafArea = area(leaves[i]);
+			if (leafArea > bestArea) {
+				bestArea = leafArea;
+				best = i;
+			}
+		}
+		if (best == -1) break;
+
+		int opened = leaves[best];
+		inner[innerCount++] = opened;
+		leaves[best] = left[opened];
+		leaves[leafCount++] = right[opened];
+	}
+	if (leafCount < 3) return;
+
+	// Optimal topology of every subset of treelet leaves, smaller subsets first
+	const int subsetCount = 1 << LBVH_TREELET_LEAVES;
+	glm::vec3 subsetMin[subsetCount], subsetMax[subsetCount];
+	float subsetCost[subsetCount];
+	int subsetShapes[subsetCount];
+	int subsetSplit[subsetCount];
+	int full = (1 << leafCount) - 1;
+
+	for (int s = 1; s <= full; ++s) {
+		int low = s & -s;
+		int bit = 0;
+		while ((1 << bit) != low) ++bit;
+		if (s == low) {
+			subsetMin[s] = boxMin[leaves[bit]];
+			subsetMax[s] = boxMax[leaves[bit]];
+			subsetShapes[s] = counts[leaves[bit]];
+			subsetCost[s] = costs[leaves[bit]];
+			continue;
+		}
+		subsetMin[s] = glm::min(subsetMin[s ^ low], subsetMin[low]);
+		subsetMax[s] = glm::max(subsetMax[s ^ low], subsetMax[low]);
+		subsetShapes[s] = subsetShapes[s ^ low] + subsetShapes[low];
+	}
+
+	for (int size = 2; size <= leafCount; ++size) {
+		for (int s = 1; s <= full; ++s) {
+			int bits = 0;
+			for (int b = s; b; b &= b - 1) ++bits;
+			if (bits != size) continue;
+
+			// Partitions with the lowest leaf on the left, each split once
+			int low = s & -s;
+			float best = INFINITY;
+			int bestSplit = low;
+			for (int p = (s - 1) & s; p; p = (p - 1) & s) {
+				if (!(p & low)) continue;
+				float cost = subsetCost[p] + subsetCost[s ^ p];
+				if (cost < best) {
+					best = cost;
+					bestSplit = p;
+				}
+			}
+
+			glm::vec3 size3 = subsetMax[s] - subsetMin[s];
+			float subsetArea = (size3.x < 0.f || size3.y < 0.f || size3.z < 0.f) ? 0.f
+				: 2.f * (size3.x * size3.y + size3.y * size3.z + size3.z * size3.x);
+			float cost = params.traversalCost * subsetArea + best;
+			if (subsetShapes[s] <= params.maxLeafSize)
+				cost = glm::min(cost, subsetArea * sahIntersectionCost(params, subsetShapes[s]));
+			subsetCost[s] = cost;
+			subsetSplit[s] = bestSplit;
+		}
+	}
+
+	if (subsetCost[full] >= costs[root] * 0.999f)
+		return;
+
+	// Rebuild the treelet top-down with the same inner nodes
+	int subsets[LBVH_TREELET_LEAVES], nodesOf[LBVH_TREELET_LEAVES];
+	int pending = 0, nextInner = 0;
+	subsets[pending] = full;
+	nodesOf[pending++] = root;
+	int created[LBVH_TREELET_LEAVES];
+	int createdCount = 0;
+	while (pending > 0) {
+		--pending;
+		int s = subsets[pending], node = nodesOf[pending];
+		created[createdCount++] = node;
+
+		int parts[2] = { subsetSplit[s], s ^ subsetSplit[s] };
+		int children[2];
+		for (int c = 0; c < 2; ++c) {
+			int part = parts[c];
+			if ((part & (part - 1)) == 0) {
+				int bit = 0;
+				while ((1 << bit) != part) ++bit;
+				children[c] = leaves[bit];
+			}
+			else {
+				children[c] = inner[nextInner++];
+				subsets[pending] = part;
+				nodesOf[pending++] = children[c];
+			}
+		}
+		left[node] = children[0];
+		right[node] = children[1];
+		boxMin[node] = subsetMin[s];
+		boxMax[node] = subsetMax[s];
+		counts[node] = subsetShapes[s];
+	}
+
+	// Costs and collapse flags of the new nodes, children first
+	for (int i = createdCount - 1; i >= 0; --i)
+		setCost(created[i]);
+}
+
+inline int LBVHBuilder::emit(int node, int depth, std::vector<FlatNode>& nodes, std::vector<int>& indices)
+{
+	// Depth-first like the other builders, the left child directly follows its parent. Returns the flat node index
+	int flatIdx = nodeCursor++;
+	if (isLeaf(node) || collapse[node] || depth >= params.maxDepth) {
+		// Shapes of the subtree, left to right
+		int first = indexCursor;
+		stack.clear();
+		stack.push_back(node);
+		while (!stack.empty()) {
+			int current = stack.back();
+			stack.pop_back();
+			if (isLeaf(current)) {
+				indices[indexCursor++] = sortedOrder[current - (shapeCount - 1)];
+			}
+			else {
+				stack.push_back(right[current]);
+				stack.push_back(left[current]);
+			}
+		}
+
+		nodes[flatIdx].setLeaf(first, indexCursor - first);
+	}
+	else {
+		int l = emit(left[node], depth + 1, nodes, indices);
+		int r = emit(right[node], depth + 1, nodes, indices);
+		nodes[flatIdx].setInner(l, r);
+	}
+
+	nodes[flatIdx].boundsMin = boxMin[node];
+	nodes[flatIdx].boundsMax = boxMax[node];
+	return flatIdx;
+}
+
+#endif // !LBVH_H
@@ -23,7 +23,21 @@
 #include "flatStructures.hpp"
 #include "model.hpp"
 #include "BoundingBox.hpp"
-#include <random>
+#include "threadPool.hpp"
+#include "bvh.hpp"
+#include "tlas.hpp"
+#include "wideBvh.hpp"
+#include "rayPacket.hpp"
+#include "uploadRing.hpp"
+#include "bvhCache.hpp"
+#include "lbvh.hpp"
+#include "sbvh.hpp"
+#include "bvhLayout.hpp"
+#include "embreeScene.hpp"
+#include "benchmark.hpp"
+#include "random.hpp"
+#include <chrono>
+#include <fstream>
 #include <embree4/rtcore.h>
 #include <embree4/rtcore_ray.h>
 
@@ -43,14 +57,46 @@ glm::vec3 phong(const glm::vec3& point, const glm::vec3& normal, const glm::vec3
 void generateScene1();	// Generate scene with monkeys
 void generateScene2();	// A scene with the car
 void generateScene3();	// Triangle
+void generateSceneFile(const std::string& path);	// Meshes of a model file
+void generateScene();	// Scene selected by SCENE or sceneFile
 int SCENE = 3;			// 1 - monkeys | 2 - car | 3 - Triangle
+std::string sceneFile;	// Model file to render instead (--scene path)
 
 // Animate objects
 void bounceSphere(Sphere* sphere, float elapsedTime, float amplitude, float frequency);
 void updateWheelAnimations(float elapsedTime);
+void animateScene(float elapsedTime);	// Animated objects of the current scene at given time
 
 // Simpler and slower ray-tracing on CPU
 void cpuRayTracer(std::vector<float>& pixelData);
+glm::vec3 cpuTracePixel(float x, float y);						// Pixel coordinates, fraction is the offset inside the pixel
+Ray cpuPrimaryRay(float x, float y);
+glm::vec2 cpuSampleOffset(int x, int y, int sample);			// Offset inside the pixel of a sample
+void cpuTracePacket(int startX, int startY, int endX, int endY, std::vector<float>& pixelData);
+glm::vec3 cpuTraceRay(Ray ray, const BVHHit* primaryHit = nullptr);	// primaryHit: first hit already found (packets)
+bool cpuIntersect(Ray ray, BVHHit& hit);						// Closest hit, hit point in world space
+void cpuIntersectPacket(RayPacket& packet);						// Closest hits of a packet of primary rays
+bool cpuOccluded(Ray ray, float maxDist);						// Any hit closer than maxDist (shadow rays)
+glm::vec3 cpuHitNormal(const BVHHit& hit);						// World space normal at the hit point
+void benchmarkCpuRayTracer(int frames);
+
+// Offline CPU rendering without window and OpenGL context (render farm)
+struct HeadlessOptions {
+	std::string output;				// Image path (binary PPM)
+	bool setCamera = false;
+	glm::vec3 cameraPosition = glm::vec3(0);
+	glm::vec3 cameraTarget = glm::vec3(0);
+	float fov = 0;					// Degrees, 0 keeps the scene camera
+};
+int renderHeadless(const HeadlessOptions& options);
+bool writePPM(const std::string& path, const std::vector<float>& pixelData, int width, int height);
+
+// Reproducible measurements of BVH build, refit, serialization and CPU ray throughput, written as JSON
+int runBenchmarks(const std::string& output);
+void benchmarkScene(BenchmarkScene& result, int buildRepeats);
+void benchmarkRays(BenchmarkScene& result, int frames);	// Primary, shadow and reflection rays along a fixed camera orbit
+void generateSyntheticScene(int triangles);				// Random triangles and bouncing spheres, fixed by the seed
+void clearScene();										// Remove all shapes, instances and animations
 
 // Debugging functions
 void printMaterial(Material mat);
@@ -60,34 +106,61 @@ void printPoint(glm::vec3 point);
 // Utility functions
 float randomFloat(float min, float max);
 float randomFloat01();
+void seedRandom(unsigned seed);	// Random scenes are the same for the same seed (--seed n)
+Pcg32 sceneRandom;				// Scene generation only, samplers hash their own seeds (pcgHash)
 FlatCamera serializeCamera(Camera cam);
 FlatLight serializeLight(Light light);
 void serializeScene(FlatScene& flatScene);
 void serializeBVH(std::vector<FlatNode>& nodes, std::vector<int>& indices);
-FlatShape serializeShape(const std::unique_ptr<Shape>& shape);
+FlatMaterial serializeMaterial(const Material& material);
+int addMaterial(FlatScene& flatScene, const Material& material, bool shared = true);	// Returns material id
+int serializeShape(const std::unique_ptr<Shape>& shape, int materialId, FlatScene& flatScene, int ref = -1); // Returns primitive reference
+void serializePrimitives(FlatScene& flatScene, Instance& instance, bool append); // Shapes of an instance in the leaf order of its BVH
 
 // Serialize animated shapes every frame
-void updateScene(FlatScene& flatScene, GLuint ssbo);
+void updateScene(FlatScene& flatScene, UploadRing& uploadRing, GLuint ssboTriangles, GLuint ssboSpheres, GLuint ssboWalls, GLuint ssboMaterials);
+// Upload elements with given indices (sorted in place), consecutive indices as one range
+template<typename T>
+void uploadElements(UploadRing& uploadRing, GLuint ssbo, const std::vector<T>& elements, std::vector<int>& indices);
 
 
 // BVH
-class Node
+enum BVH_builder
 {
-public:
-
-	BoundingBox box;
-
-	int leftChild;
-	int rightChild;
-
-	std::vector < int > shapesIndices;
-
-private:
-
+	MIDPOINT,	// Split longest axis in the middle up to a fixed depth
+	BINNED_SAH,	// Surface area heuristic (sahParams)
+	LBVH,		// Morton code order (lbvhParams), instances with animated shapes are rebuilt every frame
+	SBVH		// Binned SAH with spatial splits (sahParams, sbvhParams), a shape can be in several leaves
 };
-void updateBVH();												// Enlarge nodes on animation
-void split(std::unique_ptr<Node>& parentNode, int depth = 15);	// Divide volume of node into two if possible
-int buildBVH(int maxDepth = 15);								// Build BVH
+BVH_builder bvhBuilder = BINNED_SAH;
+SAHBuildParams sahParams;
+bool parallelBVHBuild = true;									// Binned SAH builds use the CPU thread pool
+BVHRefitter bvhRefitter;										// Nodes above animated shapes
+LBVHParams lbvhParams;
+LBVHBuilder lbvhBuilder;										// Keeps its scratch between the per-frame rebuilds
+SBVHParams sbvhParams;
+BVHLayout bvhLayout = BVH_LAYOUT_TREELET;						// Node order of the instance BVHs, applied after every build
+BVHReorderer bvhReorderer;
+
+void refitBVH();												// Recompute bounds of nodes above animated shapes
+void rebuildLBVH();												// Rebuild BVHs of instances with animated shapes in place (LBVH)
+void repackLBVH();												// Triangle blocks and wide BVH of the rebuilt instances follow their new leaves
+void split(std::vector<FlatNode>& nodes, std::vector<int>& indices, int nodeIdx, int depth = 15);	// Divide volume of leaf node into two if possible
+int buildBVH(int maxDepth = 15, const std::string& cachePath = "");	// Build BVH (maxDepth is used by MIDPOINT only), or load it from cachePath
+void buildLBVH();												// Instance BVHs with fixed ranges (not cached, fast enough to rebuild)
+uint64_t bvhInputHash(int maxDepth);							// Hash of everything the BVH build depends on
+std::string sceneBVHCachePath();								// BVH cache file of the current scene, empty if it is not cached
+bool useBVHCache = true;										// Load prebuilt BVHs of static scenes (--no-bvh-cache)
+void benchmarkBVHBuilders();
+const char* bvhBuilderName(BVH_builder builder);
+void benchmarkGPULayout();										// Bytes fetched per primary ray, legacy vs packed GPU layout, cache misses per node order
+
+// Instances (two-level BVH)
+int addMeshInstance(int firstShapeIdx, int numShapes);			// Mesh shapes become one instance with its own BVH
+void addWorldInstance();										// Instances with all shapes not owned by a mesh, one per primitive type (after all shapes are added)
+void setInstanceTransform(int instanceIdx, const glm::mat4& transform);
+void updateInstances();											// Rebuild top level BVH, serialize instances
+void serializeInstances(std::vector<FlatInstance>& instances);
 
 // Logical structure of the scene (not sent to GPU)
 struct Scene
@@ -96,27 +169,56 @@ struct Scene
 	Light light;
 	std::vector < std::unique_ptr< Shape >> shapes;
 	
-	std::vector<std::unique_ptr<Node>> bvhNodes;
+	std::vector<FlatNode> bvhNodes;		// Instance BVHs built straight into the flat layout, copied by serializeBVH
+	std::vector<int> bvhIndices;
+
+	std::vector<LBVHRange> lbvhRanges;	// Per instance, the same after every rebuild
+	std::vector<int> lbvhRebuilt;		// Instances with animated shapes
+	std::vector<glm::ivec2> lbvhNodeRanges;	// Node ranges (first, count) of lbvhRebuilt, repacked for the CPU tracer
+	bool lbvhCPUStale = false;			// Rebuilt while the GPU traced, blocks and wide BVH are repacked before the next CPU frame
+
+	std::vector<Instance> instances;
+	TLAS tlas;
+
+	ShapeStore store;	// Per-type copy of the shape geometry for CPU tracing, built with the BVH
+	WideBVH wideBvh;	// Wide form of the instance BVHs for CPU tracing, collapsed when the BVH is serialized
+
+	BVHCache bvhCache;				// Prebuilt BVH loaded instead of bvhNodes, copied by serializeBVH
+	std::string bvhCacheSavePath;	// Built BVH to be written by serializeBVH
+	uint64_t bvhCacheHash = 0;
 
 } scene;
 
 // Arbitrary structure for animation of scene 2 with car
 struct Wheel {
-	std::vector<int> shapeIndices;
+	int instanceIdx = -1;
 	glm::vec3 rotationAxis;
 	float rotationAngle = 0;
 	glm::vec3 center;
 } wheels[4];
 
 
-// Window size
-const int WIDTH = 800;
-const int HEIGHT = 600;
+// Window size (render resolution, --resolution WxH)
+int WIDTH = 800;
+int HEIGHT = 600;
 
 bool rtxon = false;					// Use GPU (true) or CPU ray-tracing
 bool animate = false;				// Animate certain objects
 bool useMollerTrumbore = false;		// For triangle intersection checks
 
+// GPU workgroup tile (compute shader local size), selectable at runtime
+const glm::ivec2 GPU_TILES[] = { glm::ivec2(8, 8), glm::ivec2(16, 8), glm::ivec2(16, 16), glm::ivec2(32, 8), glm::ivec2(8, 4) };
+int gpuTile = 0;
+std::string gpuTileDefines(glm::ivec2 tile);
+
+// CPU ray tracing is split into square tiles distributed over the thread pool
+const int TILE_SIZE = 16;
+ThreadPool threadPool;
+int cpuThreads = ThreadPool::hardwareThreads();
+int cpuSamples = 1;					// Rays per pixel, averaged
+int cpuBounces = 1;					// Reflection bounces of the CPU ray tracer (1 = no reflections)
+int cpuPacketSize = 4;				// Primary rays traced in packets of NxN pixels with the BVH (1 = single rays, at most 8)
+
 std::vector<int> animatedIndices;
 
 
@@ -135,17 +237,97 @@ float lastFrame = 0.0f; // Time of last frame
 int maxBounces = 3;
 bool useFresnel = false;
 bool useBVH = true;
+bool useWideBVH = true;	// CPU traverses the wide BVH (useBVH only)
 Intersect_alg intersectionAlgorithm = EMBREE; // Intersection algorithm (BARYCENTRIC, MT, EMBREE)
 
-// Embree device and scene
+// Embree device and scene (triangles only)
 RTCDevice g_embreeDevice = nullptr;
-RTCScene g_embreeScene = nullptr;
+EmbreeScene embreeScene;
 void initEmbree(); 
 void cleanupEmbree(); 
 
 
-int main(void)
+int main(int argc, char** argv)
 {
+	// Command line
+	int benchmarkFrames = 0;
+	bool benchmarkBVH = false;
+	bool benchmarkLayout = false;
+	HeadlessOptions headless;
+	std::string benchmarkOutput;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--bench-cpu")
+			benchmarkFrames = (i + 1 < argc && isdigit(argv[i + 1][0])) ? std::max(1, atoi(argv[++i])) : 10;
+		else if (arg == "--no-bvh")
+			useBVH = false;
+		else if (arg == "--binary-bvh")
+			useWideBVH = false;
+		else if (arg == "--no-mesh-cache")
+			Model::useCache = false;
+		else if (arg == "--no-bvh-cache")
+			useBVHCache = false;
+		else if (arg == "--bvh" && i + 1 < argc) { // midpoint, sah, lbvh or sbvh
+			std::string value = argv[++i];
+			bvhBuilder = value == "midpoint" ? MIDPOINT : value == "lbvh" ? LBVH : value == "sbvh" ? SBVH : BINNED_SAH;
+		}
+		else if (arg == "--bvh-layout" && i + 1 < argc) // dfs or treelet
+			bvhLayout = std::string(argv[++i]) == "treelet" ? BVH_LAYOUT_TREELET : BVH_LAYOUT_DEPTH_FIRST;
+		else if (arg == "--lbvh-bits" && i + 1 < argc)
+			lbvhParams.mortonBits = atoi(argv[++i]);
+		else if (arg == "--lbvh-treelets" && i + 1 < argc)
+			lbvhParams.treeletPasses = std::max(0, atoi(argv[++i]));
+		else if (arg == "--sbvh-budget" && i + 1 < argc) // Extra shape references, e.g. 0.3 for 30%
+			sbvhParams.duplicationBudget = std::max(0.f, static_cast<float>(atof(argv[++i])));
+		else if (arg == "--bench-bvh")
+			benchmarkBVH = true;
+		else if (arg == "--bench-layout")
+			benchmarkLayout = true;
+		else if (arg == "--tile" && i + 1 < argc) { // e.g. --tile 16x8
+			int x = 0, y = 0;
+			sscanf(argv[++i], "%dx%d", &x, &y);
+			for (int t = 0; t < IM_ARRAYSIZE(GPU_TILES); ++t)
+				if (GPU_TILES[t] == glm::ivec2(x, y)) gpuTile = t;
+		}
+		else if (arg == "--scene" && i + 1 < argc) { // Scene id or model file
+			std::string value = argv[++i];
+			if (isdigit(value[0])) SCENE = atoi(value.c_str());
+			else sceneFile = value;
+		}
+		else if (arg == "--resolution" && i + 1 < argc) { // e.g. --resolution 1920x1080
+			int x = 0, y = 0;
+			if (sscanf(argv[++i], "%dx%d", &x, &y) == 2 && x > 0 && y > 0) {
+				WIDTH = x;
+				HEIGHT = y;
+			}
+		}
+		else if (arg == "--headless" && i + 1 < argc)
+			headless.output = argv[++i];
+		else if (arg == "--camera" && i + 1 < argc) { // position and target, e.g. --camera 0,-10,40,0,0,0
+			glm::vec3& p = headless.cameraPosition;
+			glm::vec3& t = headless.cameraTarget;
+			headless.setCamera = sscanf(argv[++i], "%f,%f,%f,%f,%f,%f", &p.x, &p.y, &p.z, &t.x, &t.y, &t.z) == 6;
+		}
+		else if (arg == "--fov" && i + 1 < argc)
+			headless.fov = static_cast<float>(atof(argv[++i]));
+		else if (arg == "--samples" && i + 1 < argc)
+			cpuSamples = std::max(1, atoi(argv[++i]));
+		else if (arg == "--bounces" && i + 1 < argc)
+			cpuBounces = std::max(1, atoi(argv[++i]));
+		else if (arg == "--packet" && i + 1 < argc)
+			cpuPacketSize = glm::clamp(atoi(argv[++i]), 1, 8);
+		else if (arg == "--benchmark" && i + 1 < argc)
+			benchmarkOutput = argv[++i];
+		else if (arg == "--seed" && i + 1 < argc)
+			seedRandom(static_cast<unsigned>(atoi(argv[++i])));
+	}
+
+	// Render on the CPU and quit before any window, OpenGL or ImGui setup
+	if (!headless.output.empty())
+		return renderHeadless(headless);
+	if (!benchmarkOutput.empty())
+		return runBenchmarks(benchmarkOutput);
+
 	// Init glfw
 	glfwInit();
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
@@ -191,8 +373,8 @@ int main(void)
 	glBindImageTexture(0, texture, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
 
 	// Compute shader (cannot be used with others)
-	ComputeShader computeShader("src/shaders/cpu_shader.comp");
-	ComputeShader computeShaderGPU("src/shaders/gpu_shader.comp");
+	ComputeShader computeShader("src/shaders/cpu_shader.comp", gpuTileDefines(GPU_TILES[gpuTile]));
+	ComputeShader computeShaderGPU("src/shaders/gpu_shader.comp", gpuTileDefines(GPU_TILES[gpuTile]));
 
 	// Texture buffer
 	std::vector<float> pixelData(WIDTH * HEIGHT * 4, 0.0f); // Initialize to 0
@@ -204,21 +386,22 @@ int main(void)
 	initEmbree();
 
 	/* Scene */
-	switch (SCENE)
-	{
-	case 1: generateScene1(); break;
-	case 2: generateScene2(); break;
-	case 3: generateScene3(); break;
-	default:
-		generateScene1();
-		break;
+	generateScene();
+
+	// Measure CPU ray tracer or BVH builders only and quit
+	if (benchmarkFrames > 0 || benchmarkBVH || benchmarkLayout) {
+		serializeBVH(flatNodes, bvhIndices);
+		if (benchmarkFrames > 0) benchmarkCpuRayTracer(benchmarkFrames);
+		if (benchmarkBVH) benchmarkBVHBuilders();
+		if (benchmarkLayout) benchmarkGPULayout();
+		cleanupEmbree();
+		glfwTerminate();
+		return 0;
 	}
 
-	
-
 	/* SSBO (Shader Storage Buffer Object */
 	FlatScene flatScene;
-	serializeScene(flatScene); // Serialize scene
+	serializeScene(flatScene); // Serialize scene (flat BVH is used by the CPU ray tracer too)
 
 	std::cout << "BVH Indices (" << bvhIndices.size() << "):" << std::endl;
 	/*for (auto idx : bvhIndices)
@@ -231,8 +414,8 @@ int main(void)
 		printPoint(flatNodes[i].boundsMin);
 		std::cout << "Max:" << std::endl;
 		printPoint(flatNodes[i].boundsMax);
-		std::cout << "L child: " << flatNodes[i].leftChild << " R child: " << flatNodes[i].rightChild << std::endl;
-		std::cout << "Start shape idx: " << flatNodes[i].startShapeIdx << " NumShapes: " << flatNodes[i].numShapes << std::endl << std::endl;
+		std::cout << "L child: " << flatNodes[i].leftChild() << " R child: " << flatNodes[i].rightChild() << std::endl;
+		std::cout << "Start shape idx: " << flatNodes[i].startShapeIdx() << " NumShapes: " << flatNodes[i].numShapes() << std::endl << std::endl;
 	}*/
 
 	// send light
@@ -251,12 +434,33 @@ int main(void)
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, ssbocamera);
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0); // unbind
 
-	// send shapes
-	GLuint ssboshapes;
-	glGenBuffers(1, &ssboshapes);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssboshapes);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(FlatShape) * flatScene.shapes.size(), flatScene.shapes.data(), GL_DYNAMIC_COPY);
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, ssboshapes);
+	// send materials and shapes (one buffer per type)
+	GLuint ssbomaterials;
+	glGenBuffers(1, &ssbomaterials);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbomaterials);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(FlatMaterial) * flatScene.materials.size(), flatScene.materials.data(), GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, ssbomaterials);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0); // unbind
+
+	GLuint ssbotriangles;
+	glGenBuffers(1, &ssbotriangles);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbotriangles);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(FlatTriangle) * flatScene.triangles.size(), flatScene.triangles.data(), GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, ssbotriangles);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0); // unbind
+
+	GLuint ssbospheres;
+	glGenBuffers(1, &ssbospheres);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbospheres);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(FlatSphere) * flatScene.spheres.size(), flatScene.spheres.data(), GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, ssbospheres);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0); // unbind
+
+	GLuint ssbowalls;
+	glGenBuffers(1, &ssbowalls);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbowalls);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(FlatWall) * flatScene.walls.size(), flatScene.walls.data(), GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, ssbowalls);
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0); // unbind
 
 	// send BVH
@@ -267,13 +471,34 @@ int main(void)
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, ssbobvhboxes);
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0); // unbind
 
-	GLuint ssbobvhindices;
-	glGenBuffers(1, &ssbobvhindices);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbobvhindices);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(int) * bvhIndices.size(), bvhIndices.data(), GL_STATIC_DRAW);
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, ssbobvhindices);
+	// send instances and top level BVH
+	GLuint ssboinstances;
+	glGenBuffers(1, &ssboinstances);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssboinstances);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(FlatInstance) * flatInstances.size(), flatInstances.data(), GL_DYNAMIC_DRAW);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, ssboinstances);
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0); // unbind
 
+	GLuint ssbotlas;
+	glGenBuffers(1, &ssbotlas);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbotlas);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(FlatNode) * scene.tlas.getNodes().size(), scene.tlas.getNodes().data(), GL_DYNAMIC_DRAW);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, ssbotlas);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0); // unbind
+
+	// Staging ring for the per-frame updates, sized for camera, light, animated shapes and refitted nodes
+	// (grows if a frame does not fit)
+	size_t frameBytes = sizeof(FlatCamera) + sizeof(FlatLight)
+		+ animatedIndices.size() * (std::max({ sizeof(FlatSphere), sizeof(FlatWall), sizeof(FlatTriangle) }) + sizeof(FlatMaterial))
+		+ sizeof(FlatInstance) * flatInstances.size() + sizeof(FlatNode) * scene.tlas.getNodes().size();
+	for (const glm::ivec2& range : bvhRefitter.dirtyRanges())
+		frameBytes += sizeof(FlatNode) * range.y;
+	for (int instanceIdx : scene.lbvhRebuilt)
+		frameBytes += sizeof(FlatNode) * scene.lbvhRanges[instanceIdx].nodeCount
+			+ std::max({ sizeof(FlatSphere), sizeof(FlatWall), sizeof(FlatTriangle) }) * scene.lbvhRanges[instanceIdx].indexCount;
+	UploadRing uploadRing;
+	uploadRing.init(frameBytes);
+
 
 	/* GUI */
 	// imgui
@@ -302,14 +527,26 @@ int main(void)
 		// Input
 		processInput(window);
 
+		// Animated shapes and instances moved, update BVH (used by both CPU and GPU)
+		if (animate) {
+			refitBVH();
+			updateInstances();
+
+			embreeScene.updateTriangles(scene.shapes, animatedIndices);
+			embreeScene.commit();
+		}
+
 		if (!rtxon) { // CPU ray tracing
-			// No fresnel, shadows... Just laggy ray tracing with diffuse colors
+			// No fresnel, reflections... Just laggy ray tracing with diffuse colors and shadows
 			/***********************************************************************************************/
+			if (scene.lbvhCPUStale)
+				repackLBVH();
 			cpuRayTracer(pixelData);
 
 			// Compute shader dispatch
+			glm::ivec2 tile = GPU_TILES[gpuTile];
 			computeShader.use();
-			glDispatchCompute((unsigned)WIDTH, (unsigned)HEIGHT, 1);
+			glDispatchCompute((WIDTH + tile.x - 1) / tile.x, (HEIGHT + tile.y - 1) / tile.y, 1);
 			glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
 
 			// Render image to quad
@@ -325,41 +562,73 @@ int main(void)
 		else { // GPU ray tracing
 			/***********************************************************************************************/
 			// Update scene
+			// All dirty ranges go through the upload ring, copied into the SSBOs before the dispatch
+			uploadRing.beginFrame();
+
 			flatScene.camera = serializeCamera(scene.camera);
-			glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbocamera);
-			glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(FlatCamera), &flatScene.camera);
+			uploadRing.upload(ssbocamera, 0, &flatScene.camera, sizeof(FlatCamera));
 
 			flatScene.light = serializeLight(scene.light);
-			glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbolight);
-			glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(FlatLight), &flatScene.light);
+			uploadRing.upload(ssbolight, 0, &flatScene.light, sizeof(FlatLight));
 
 			if (animate) {
+				// Rebuilt BVHs have a new leaf order, their whole node range and primitives in the new order are uploaded
+				// (before the animated shapes, which are written at their new primitives)
+				if (bvhBuilder == LBVH) {
+					for (int instanceIdx : scene.lbvhRebuilt) {
+						Instance& instance = scene.instances[instanceIdx];
+						const LBVHRange& range = scene.lbvhRanges[instanceIdx];
+						serializePrimitives(flatScene, instance, false);
+
+						uploadRing.upload(ssbobvhboxes, sizeof(FlatNode) * range.firstNode, &flatNodes[range.firstNode], sizeof(FlatNode) * range.nodeCount);
+						int start = range.firstIndex + instance.primitiveOffset;
+						switch (instance.primitiveType) {
+						case FLAT_SPHERE:
+							uploadRing.upload(ssbospheres, sizeof(FlatSphere) * start, &flatScene.spheres[start], sizeof(FlatSphere) * range.indexCount);
+							break;
+						case FLAT_WALL:
+							uploadRing.upload(ssbowalls, sizeof(FlatWall) * start, &flatScene.walls[start], sizeof(FlatWall) * range.indexCount);
+							break;
+						case FLAT_TRIANGLE:
+							uploadRing.upload(ssbotriangles, sizeof(FlatTriangle) * start, &flatScene.triangles[start], sizeof(FlatTriangle) * range.indexCount);
+							break;
+						}
+					}
+				}
+
 				// Only update animated shapes (spheres)
-				updateScene(flatScene, ssboshapes);
+				updateScene(flatScene, uploadRing, ssbotriangles, ssbospheres, ssbowalls, ssbomaterials);
+
+				// Upload refitted BVH nodes only
+				if (bvhBuilder != LBVH) {
+					for (const glm::ivec2& range : bvhRefitter.dirtyRanges())
+						uploadRing.upload(ssbobvhboxes, sizeof(FlatNode) * range.x, &flatNodes[range.x], sizeof(FlatNode) * range.y);
+				}
 
-				// Update BVH
-				updateBVH();
-				serializeBVH(flatNodes, bvhIndices);
-				glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbobvhboxes);
-				glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(FlatNode) * flatNodes.size(), flatNodes.data());
+				// Upload instance transforms and top level BVH (few nodes)
+				uploadRing.upload(ssboinstances, 0, flatInstances.data(), sizeof(FlatInstance) * flatInstances.size());
+				uploadRing.upload(ssbotlas, 0, scene.tlas.getNodes().data(), sizeof(FlatNode) * scene.tlas.getNodes().size());
 
 			}
-			
+
+			uploadRing.endFrame();
 			glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0); // unbind
 
 			
 			// Compute shader dispatch
 			computeShaderGPU.use();
-			glDispatchCompute((unsigned)WIDTH, (unsigned)HEIGHT, 1);
-			glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
 
-			// Set window resolution in shader
+			// Set window resolution in shader (before the dispatch, the program may have just been recompiled)
 			computeShaderGPU.setVec2("screenRes", glm::vec2(WIDTH, HEIGHT));
 			computeShaderGPU.setInt("maxBounces", maxBounces);
 			computeShaderGPU.setBool("useBVH", useBVH);
 			computeShaderGPU.setBool("useFresnel", useFresnel);
 			computeShaderGPU.setBool("useMollerTrumbore", useMollerTrumbore);
 
+			glm::ivec2 tile = GPU_TILES[gpuTile];
+			glDispatchCompute((WIDTH + tile.x - 1) / tile.x, (HEIGHT + tile.y - 1) / tile.y, 1);
+			glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
 			// Render image to quad
 			glClearColor(0, 0, 0, 1.f);
 			screenQuad.use();
@@ -377,9 +646,13 @@ int main(void)
 		ImGui::Checkbox("RTX ON", &rtxon);
 		ImGui::SliderInt("Max bounces", &maxBounces, 1, 10);
 		ImGui::Checkbox("Use BVH", &useBVH);
+		ImGui::Checkbox("Wide BVH (CPU)", &useWideBVH);
+		ImGui::SliderInt("CPU ray packet", &cpuPacketSize, 1, 8);
 		ImGui::Checkbox("Fresnel", &useFresnel);
 		ImGui::Checkbox("Animate", &animate);
 		ImGui::Checkbox("Moller-Trumbore", &useMollerTrumbore);
+		if (ImGui::SliderInt("CPU threads", &cpuThreads, 1, ThreadPool::hardwareThreads()))
+			threadPool.resize(cpuThreads);
 
 		ImGui::Text("Main ball material");
 		auto ballColorV = scene.shapes[0]->material.color;
@@ -409,6 +682,13 @@ int main(void)
 			ImGui::EndCombo();
 		}
 
+		// Workgroup size is compiled into the shaders
+		const char* tiles[] = { "8x8", "16x8", "16x16", "32x8", "8x4" };
+		if (ImGui::Combo("GPU tile", &gpuTile, tiles, IM_ARRAYSIZE(tiles))) {
+			computeShader.compile(gpuTileDefines(GPU_TILES[gpuTile]));
+			computeShaderGPU.compile(gpuTileDefines(GPU_TILES[gpuTile]));
+		}
+
 		ImGui::Text("Light");
 		float lightColor[4] = { scene.light.color.r, scene.light.color.g, scene.light.color.b, 1.f };
 		ImGui::ColorEdit4("Color", lightColor);
@@ -435,26 +715,8 @@ int main(void)
 		ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 
 		// Animate objects
-		if (animate) {
-			// Scene 1
-			if (SCENE == 1) {
-				if (auto* sphere = dynamic_cast<Sphere*>(scene.shapes[0].get()))
-					bounceSphere(sphere, currentFrame, 10, 1);
-				if (auto* sphere = dynamic_cast<Sphere*>(scene.shapes[1].get()))
-					bounceSphere(sphere, currentFrame, 7, 0.8);
-				if (auto* sphere = dynamic_cast<Sphere*>(scene.shapes[2].get()))
-					bounceSphere(sphere, currentFrame, 15, 1.5);
-			}
-			// Scene 2
-			else if (SCENE == 2) {
-				updateWheelAnimations(currentFrame);
-			}
-			// Scene 3
-			else {
-
-			}
-			
-		}
+		if (animate)
+			animateScene(currentFrame);
 	
 		// swap buffers and poll io events
 		glfwSwapBuffers(window);
@@ -465,6 +727,7 @@ int main(void)
 	ImGui_ImplGlfw_Shutdown();
 	ImGui::DestroyContext();
 
+	uploadRing.release(); // GL objects, before the context is gone
 	glfwTerminate();
 	return 0;
 }
@@ -580,6 +843,24 @@ glm::vec3 phong(const glm::vec3& point, const glm::vec3& normal, const glm::vec3
 	return result;
 }
 
+void generateScene()
+{
+	if (!sceneFile.empty()) {
+		generateSceneFile(sceneFile);
+		return;
+	}
+
+	switch (SCENE)
+	{
+	case 1: generateScene1(); break;
+	case 2: generateScene2(); break;
+	case 3: generateScene3(); break;
+	default:
+		generateScene1();
+		break;
+	}
+}
+
 void generateScene1()
 {
 	// Camera 
@@ -636,6 +917,7 @@ void generateScene1()
 	auto triangle = Triangle(p1, p2, p3);
 	triangle.invert_normal();
 	scene.shapes.push_back(std::make_unique<Triangle>(triangle));
+	embreeScene.addTriangle(triangle, scene.shapes.size() - 1);
 	scene.shapes[scene.shapes.size() - 1]->material.color = glm::vec3(0.19f, 0.66f, 0.32f);
 	scene.shapes[scene.shapes.size() - 1]->material.fresnelStrength = 1;
 	scene.shapes[scene.shapes.size() - 1]->material.ambientStrength = 0.06f;
@@ -649,6 +931,8 @@ void generateScene1()
 	auto mesh = model.meshes[0];
 	mesh.origin = glm::vec3(0, 0, -30);
 	auto meshTriangles = mesh.mesh2triangles();
+	embreeScene.addMesh(mesh, scene.shapes.size());
+	addMeshInstance(scene.shapes.size(), meshTriangles.size());
 	for (int i = 0; i < meshTriangles.size(); ++i) {
 		auto triangle = meshTriangles[i];
 		scene.shapes.push_back(std::make_unique<Triangle>(triangle.a, triangle.b, triangle.c));
@@ -666,6 +950,8 @@ void generateScene1()
 	{
 		mesh.origin = glm::vec3(50, 0, -30);
 		auto meshTriangles = mesh.mesh2triangles();
+		embreeScene.addMesh(mesh, scene.shapes.size());
+		addMeshInstance(scene.shapes.size(), meshTriangles.size());
 		for (int i = 0; i < meshTriangles.size(); ++i) {
 			auto triangle = meshTriangles[i];
 			scene.shapes.push_back(std::make_unique<Triangle>(triangle.a, triangle.b, triangle.c));
@@ -706,10 +992,14 @@ void generateScene1()
 	for (int i : animatedIndices) {
 		scene.shapes[i]->animated = true;
 	}
+	addWorldInstance();
+
+	// Upload triangles to Embree
+	embreeScene.commit();
 
 
 	// BVH
-	int i = buildBVH(15);
+	int i = buildBVH(15, sceneBVHCachePath());
 	std::cout << "result: " << i << std::endl;
 
 	std::cout << "shapes: " << scene.shapes.size() << std::endl;
@@ -757,6 +1047,8 @@ void generateScene2() {
 		glm::vec3 wheelCenter(0);
 
 		auto meshTriangles = mesh.mesh2triangles();
+		embreeScene.addMesh(mesh, scene.shapes.size());
+		int instanceIdx = addMeshInstance(scene.shapes.size(), meshTriangles.size());
 		for (int j = 0; j < meshTriangles.size(); ++j) {
 			int idx = scene.shapes.size();
 			auto triangle = meshTriangles[j];
@@ -764,10 +1056,6 @@ void generateScene2() {
 			scene.shapes[idx]->material = material;
 
 			if (i >= 1 && i <= 4) {
-				wheels[i-1].shapeIndices.push_back(idx);
-				scene.shapes[idx]->animated = true;
-				animatedIndices.push_back(idx);
-
 				wheelCenter += triangle.a;
 				wheelCenter += triangle.b;
 				wheelCenter += triangle.c;
@@ -776,6 +1064,7 @@ void generateScene2() {
 		std::cout << "Triangles added: " << meshTriangles.size() << std::endl;
 		
 		if (i >= 1 && i <= 4) {
+			wheels[i-1].instanceIdx = instanceIdx;
 			wheels[i-1].rotationAxis = glm::vec3(0, 0, 1);
 			wheelCenter /= static_cast<float>(meshTriangles.size()*3);
 			wheels[i-1].center = wheelCenter;
@@ -795,9 +1084,13 @@ void generateScene2() {
 	}
 
 	scene.camera.LookAt(origin);
+	addWorldInstance();
+
+	// Upload triangles to Embree
+	embreeScene.commit();
 
 	// BVH
-	int i = buildBVH(25);
+	int i = buildBVH(25, sceneBVHCachePath());
 	std::cout << "result: " << i << std::endl;
 
 	std::cout << "shapes: " << scene.shapes.size() << std::endl;
@@ -830,57 +1123,84 @@ void serializeScene(FlatScene& flatScene) {
 	// Serialize light
 	flatScene.light = serializeLight(scene.light);
 
-	// Serialize shapes
-	std::vector<FlatShape> flatShapes;
-	for (const auto& shape : scene.shapes) {
-		
-		FlatShape flatShape = serializeShape(shape);
+	// Serialize materials (animated shapes get their own material, it can be edited at runtime)
+	flatScene.materials.clear();
+	flatScene.shapeMaterials.clear();
+	for (const auto& shape : scene.shapes)
+		flatScene.shapeMaterials.push_back(addMaterial(flatScene, shape->material, !shape->animated));
 
-		flatShapes.push_back(flatShape);
-	}
+	serializeBVH(flatNodes, bvhIndices);
 
-	flatScene.shapes = flatShapes;
+	// Serialize shapes in BVH leaf order, GPU leaves read their primitives straight from the buffer of the instance type
+	// instead of through bvhIndices. scene.shapes keeps its order, shapeRefs maps a shape to its primitive.
+	flatScene.triangles.clear();
+	flatScene.spheres.clear();
+	flatScene.walls.clear();
+	flatScene.shapeRefs.assign(scene.shapes.size(), -1);
+	for (Instance& instance : scene.instances)
+		serializePrimitives(flatScene, instance, true);
 
-	serializeBVH(flatNodes, bvhIndices);
+	// Shapes outside every BVH are still traced without one
+	for (int i = 0; i < scene.shapes.size(); ++i) {
+		if (flatScene.shapeRefs[i] == -1)
+			flatScene.shapeRefs[i] = serializeShape(scene.shapes[i], flatScene.shapeMaterials[i], flatScene);
+	}
 
+	serializeInstances(flatInstances);
+}
+
+void serializePrimitives(FlatScene& flatScene, Instance& instance, bool append) {
+	glm::ivec2 range = bvhIndexRange(flatNodes, instance.blasRoot);
+	if (range.y == 0) return;
+	int first = range.x;
+
+	// Appended or written over the range of the previous serialization (same size, e.g. after an LBVH rebuild).
+	// A shape in several SBVH leaves gets a primitive per leaf, shapeRefs keeps the last (split shapes are static)
+	for (int i = first; i < first + range.y; ++i) {
+		int shapeIdx = bvhIndices[i];
+		int ref = append ? -1 : makePrimitiveRef(i + instance.primitiveOffset, instance.primitiveType);
+		ref = serializeShape(scene.shapes[shapeIdx], flatScene.shapeMaterials[shapeIdx], flatScene, ref);
+		flatScene.shapeRefs[shapeIdx] = ref;
+
+		// The instance holds one shape type, its primitives are appended in a row
+		if (append && i == first) {
+			instance.primitiveType = ref & 3;
+			instance.primitiveOffset = (ref >> 2) - first;
+		}
+	}
 }
 
 void cpuRayTracer(std::vector<float>& pixelData) {
-	// Calculate ray hits
-	for (int y = 0; y < HEIGHT; ++y) {
-		for (int x = 0; x < WIDTH; ++x) {
-			Ray ray = scene.camera.GetRay(2.f * x / WIDTH - 1, 1.f - 2.f * y / HEIGHT); // flip y-axis
-
-			glm::vec3 color = glm::vec3(); // BG color
-			float closestDist = std::numeric_limits<float>::max();
-
-			for (const auto& shape : scene.shapes) {
-				// Set intersection algorithm for triangles
-				if (auto triangle = dynamic_cast<Triangle*>(shape.get())) {
-					triangle->int_alg = intersectionAlgorithm;
-				}
+	// Set intersection algorithm for triangles (before the workers start reading it)
+	scene.store.triangleAlgorithm = intersectionAlgorithm;
+
+	int tilesX = (WIDTH + TILE_SIZE - 1) / TILE_SIZE;
+	int tilesY = (HEIGHT + TILE_SIZE - 1) / TILE_SIZE;
+
+	// Every tile writes its own pixels only, so no synchronization is needed
+	threadPool.parallelFor(tilesX * tilesY, [&](int tile, int threadIdx) {
+		int startX = (tile % tilesX) * TILE_SIZE;
+		int startY = (tile / tilesX) * TILE_SIZE;
+		int endX = std::min(startX + TILE_SIZE, WIDTH);
+		int endY = std::min(startY + TILE_SIZE, HEIGHT);
+
+		// Coherent primary rays in packets, the rest of the path ray by ray
+		if (useBVH && cpuPacketSize > 1) {
+			for (int y = startY; y < endY; y += cpuPacketSize) {
+				for (int x = startX; x < endX; x += cpuPacketSize)
+					cpuTracePacket(x, y, std::min(x + cpuPacketSize, endX), std::min(y + cpuPacketSize, endY), pixelData);
+			}
+			return;
+		}
 
-				// Trace ray
-				Intersection s_hit = shape->get_intersection(ray);
-				if (s_hit.intersect_type == INNER) { // Hit!
-					float dist = glm::distance(ray.get_start(), s_hit.hit_point);
-					if (dist < closestDist) {
-						closestDist = dist;
-
-						auto point = s_hit.hit_point;
-						auto normal = shape->get_normal(point);
-
-						// Calculate lighting (Phong)
-						color = phong(
-							point,
-							normal,
-							ray.get_dir(),
-							shape->material.color,
-							scene.light.position,
-							scene.light.color,
-							shape->material);
-					}
+		for (int y = startY; y < endY; ++y) {
+			for (int x = startX; x < endX; ++x) {
+				glm::vec3 color(0);
+				for (int s = 0; s < cpuSamples; ++s) {
+					glm::vec2 offset = cpuSampleOffset(x, y, s);
+					color += cpuTracePixel(x + offset.x, y + offset.y);
 				}
+				color /= float(cpuSamples);
 
 				// Set color pixel in fragment shader
 				int idx = (y * WIDTH + x) * 4;
@@ -890,9 +1210,660 @@ void cpuRayTracer(std::vector<float>& pixelData) {
 				pixelData[idx + 3] = 1.f;
 			}
 		}
+	});
+}
+
+glm::vec2 cpuSampleOffset(int x, int y, int sample) {
+	if (cpuSamples == 1)
+		return glm::vec2(0);
+
+	// Offsets inside the pixel from the R2 sequence (deterministic, evenly spread for any sample count),
+	// shifted by a hash of the pixel so neighbouring pixels do not share the pattern
+	uint32_t pixelHash = pcgHash(static_cast<uint32_t>(y * WIDTH + x));
+	glm::vec2 shift(hashToFloat(pixelHash), hashToFloat(pcgHash(pixelHash)));
+	return glm::vec2(glm::fract(shift.x + sample * 0.754877666f), glm::fract(shift.y + sample * 0.569840291f));
+}
+
+Ray cpuPrimaryRay(float x, float y) {
+	return scene.camera.GetRay(2.f * x / WIDTH - 1, 1.f - 2.f * y / HEIGHT); // flip y-axis
+}
+
+glm::vec3 cpuTracePixel(float x, float y) {
+	return cpuTraceRay(cpuPrimaryRay(x, y));
+}
+
+void cpuTracePacket(int startX, int startY, int endX, int endY, std::vector<float>& pixelData) {
+	glm::vec3 colors[MAX_PACKET_RAYS] = {};
+
+	// One packet per sample, same pixel offsets as single rays
+	for (int s = 0; s < cpuSamples; ++s) {
+		RayPacket packet;
+		for (int y = startY; y < endY; ++y) {
+			for (int x = startX; x < endX; ++x) {
+				glm::vec2 offset = cpuSampleOffset(x, y, s);
+				packet.add(cpuPrimaryRay(x + offset.x, y + offset.y));
+			}
+		}
+		packet.finish();
+		cpuIntersectPacket(packet);
+
+		for (int i = 0; i < packet.count; ++i)
+			colors[i] += cpuTraceRay(packet.ray(i), &packet.hits[i]);
+	}
+
+	int i = 0;
+	for (int y = startY; y < endY; ++y) {
+		for (int x = startX; x < endX; ++x, ++i) {
+			glm::vec3 color = colors[i] / float(cpuSamples);
+
+			int idx = (y * WIDTH + x) * 4;
+			pixelData[idx + 0] = color.r;
+			pixelData[idx + 1] = color.g;
+			pixelData[idx + 2] = color.b;
+			pixelData[idx + 3] = 1.f;
+		}
+	}
+}
+
+glm::vec3 cpuTraceRay(Ray ray, const BVHHit* primaryHit) {
+	glm::vec3 color = glm::vec3(); // BG color
+	glm::vec3 attenuation = glm::vec3(1);
+
+	// Same bounce loop as the compute shader, one hit with a shadow ray per bounce
+	for (int depth = 0; depth < cpuBounces; ++depth) {
+		BVHHit hit;
+		if (depth == 0 && primaryHit)
+			hit = *primaryHit;
+		else
+			cpuIntersect(ray, hit);
+		if (hit.shapeIdx == -1)
+			break;
+
+		const auto& shape = scene.shapes[hit.shapeIdx];
+		glm::vec3 normal = cpuHitNormal(hit);
+
+		// Calculate lighting (Phong)
+		glm::vec3 phongColor = phong(
+			hit.point,
+			normal,
+			ray.get_dir(),
+			shape->material.color,
+			scene.light.position,
+			scene.light.color,
+			shape->material);
+
+		// Shadow ray, anything between the point and the light
+		Ray shadowRay(hit.point + normal * 1e-3f, glm::normalize(scene.light.position - hit.point));
+		if (cpuOccluded(shadowRay, glm::distance(scene.light.position, shadowRay.get_start())))
+			phongColor *= 0.3f;
+
+		color += attenuation * phongColor;
+
+		if (shape->material.specularStrength <= 0)
+			break;
+
+		// Reflection ray
+		ray = Ray(hit.point + normal * 1e-3f, glm::reflect(ray.get_dir(), normal));
+		if (useFresnel) {
+			float fresnel = glm::pow(1.f - glm::max(glm::dot(-ray.get_dir(), normal), 0.f), 5.f);
+			fresnel = glm::clamp(fresnel, 0.f, 0.8f);
+
+			// Blend attenuation
+			float reflectionWeight = shape->material.fresnelStrength * fresnel;
+			float materialWeight = 1.f - reflectionWeight;
+
+			attenuation *= glm::mix(shape->material.color, glm::vec3(1), reflectionWeight);
+			color += materialWeight * shape->material.color * phongColor;
+		}
+		else
+			attenuation *= shape->material.specularStrength;
+	}
+
+	return color;
+}
+
+glm::vec3 cpuHitNormal(const BVHHit& hit) {
+	const auto& shape = scene.shapes[hit.shapeIdx];
+	if (shape->instance == -1)
+		return shape->get_normal(hit.point);
+
+	const Instance& instance = scene.instances[shape->instance];
+	return instance.normalToWorld(shape->get_normal(instance.pointToObject(hit.point)));
+}
+
+bool cpuIntersect(Ray ray, BVHHit& hit) {
+	if (useBVH) {
+		// Traverse top level BVH, then BVHs of the hit instances
+		intersectTLAS(scene.tlas.getNodes(), scene.instances, flatNodes, bvhIndices, scene.store, useWideBVH ? &scene.wideBvh : nullptr, ray, hit);
+	}
+	else {
+		// Test every shape
+		for (int i = 0; i < scene.store.size(); ++i) {
+			int instance = scene.shapes[i]->instance;
+			Ray shapeRay = instance == -1 ? ray : scene.instances[instance].toObject(ray);
+
+			float dist; // Same in object space, instance transforms are rigid
+			if (scene.store.intersect(i, shapeRay.get_start(), shapeRay.get_dir(), dist) && dist < hit.dist) { // Hit!
+				hit.dist = dist;
+				hit.point = ray.get_point(dist);
+				hit.shapeIdx = i;
+			}
+		}
+	}
+
+	// Triangles are traced by Embree as a whole
+	if (intersectionAlgorithm == EMBREE) {
+		float dist;
+		int shapeIdx = embreeScene.intersect(ray, dist);
+		if (shapeIdx != -1 && dist < hit.dist) {
+			hit.dist = dist;
+			hit.point = ray.get_point(dist);
+			hit.shapeIdx = shapeIdx;
+		}
+	}
+
+	return hit.shapeIdx != -1;
+}
+
+void cpuIntersectPacket(RayPacket& packet) {
+	intersectPacketTLAS(scene.tlas.getNodes(), scene.instances, flatNodes, bvhIndices, scene.store, useWideBVH ? &scene.wideBvh : nullptr, packet);
+
+	// Embree triangles ray by ray
+	if (intersectionAlgorithm == EMBREE) {
+		for (int i = 0; i < packet.count; ++i) {
+			Ray ray = packet.ray(i);
+			BVHHit& hit = packet.hits[i];
+
+			float dist;
+			int shapeIdx = embreeScene.intersect(ray, dist);
+			if (shapeIdx != -1 && dist < hit.dist) {
+				hit.dist = dist;
+				hit.point = ray.get_point(dist);
+				hit.shapeIdx = shapeIdx;
+			}
+		}
+	}
+}
+
+bool cpuOccluded(Ray ray, float maxDist) {
+	// Triangles are traced by Embree as a whole
+	if (intersectionAlgorithm == EMBREE && embreeScene.occluded(ray, maxDist))
+		return true;
+
+	if (useBVH)
+		return occludedTLAS(scene.tlas.getNodes(), scene.instances, flatNodes, bvhIndices, scene.store, useWideBVH ? &scene.wideBvh : nullptr, ray, maxDist);
+
+	// Test every shape until the first hit
+	for (int i = 0; i < scene.store.size(); ++i) {
+		int instance = scene.shapes[i]->instance;
+		Ray shapeRay = instance == -1 ? ray : scene.instances[instance].toObject(ray);
+
+		float dist;
+		if (scene.store.intersect(i, shapeRay.get_start(), shapeRay.get_dir(), dist) && dist < maxDist)
+			return true;
+	}
+	return false;
+}
+
+void benchmarkCpuRayTracer(int frames) {
+	std::vector<float> reference(WIDTH * HEIGHT * 4, 0.0f);
+	std::vector<float> pixelData(WIDTH * HEIGHT * 4, 0.0f);
+
+	// Single threaded frame as the reference image
+	threadPool.resize(1);
+	cpuRayTracer(reference);
+
+	// Thread counts 1, 2, 4, ... and all hardware threads
+	std::vector<int> threadCounts;
+	for (int n = 1; n < ThreadPool::hardwareThreads(); n *= 2)
+		threadCounts.push_back(n);
+	threadCounts.push_back(ThreadPool::hardwareThreads());
+
+	std::cout << "CPU ray tracer " << WIDTH << "x" << HEIGHT << ", " << scene.shapes.size() << " shapes, "
+		<< (useBVH ? "BVH" : "no BVH") << ", " << frames << " frames" << std::endl;
+	std::cout << "threads\tms/frame\tMrays/s\tspeedup\tsame image" << std::endl;
+
+	double singleThreadTime = 0;
+	for (int n : threadCounts) {
+		threadPool.resize(n);
+		cpuRayTracer(pixelData); // warm up
+
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < frames; ++i)
+			cpuRayTracer(pixelData);
+		double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		if (n == 1) singleThreadTime = seconds;
+		double mrays = double(WIDTH) * HEIGHT * frames / seconds / 1e6;
+
+		std::cout << n << "\t" << seconds * 1000 / frames << "\t" << mrays << "\t"
+			<< singleThreadTime / seconds << "\t" << (pixelData == reference ? "yes" : "NO") << std::endl;
+	}
+
+	threadPool.resize(cpuThreads);
+}
+
+void benchmarkBVHBuilders() {
+	const int frames = 3;
+	std::vector<float> pixelData(WIDTH * HEIGHT * 4, 0.0f);
+
+	std::cout << "BVH builders, " << scene.shapes.size() << " shapes, " << threadPool.size() << " threads" << std::endl;
+	std::cout << "builder\tbuild ms\tnodes\tindices\tSAH cost\tms/frame" << std::endl;
+
+	BVH_builder selected = bvhBuilder;
+	bool selectedUseBVH = useBVH;
+	useBVH = true;
+
+	for (BVH_builder builder : { MIDPOINT, BINNED_SAH, SBVH, LBVH }) {
+		bvhBuilder = builder;
+
+		auto start = std::chrono::high_resolution_clock::now();
+		buildBVH(SCENE == 2 ? 25 : 15);
+		serializeBVH(flatNodes, bvhIndices);
+		double buildSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < frames; ++i)
+			cpuRayTracer(pixelData);
+		double traceSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		// Sum over the instance BVHs
+		float sahCost = 0.f;
+		for (const Instance& instance : scene.instances)
+			sahCost += bvhSAHCost(flatNodes, instance.blasRoot, sahParams);
+
+		std::cout << bvhBuilderName(builder) << "\t" << buildSeconds * 1000 << "\t" << flatNodes.size() << "\t"
+			<< bvhIndices.size() << "\t" << sahCost << "\t" << traceSeconds * 1000 / frames << std::endl;
+	}
+
+	// Restore the scene BVH
+	bvhBuilder = selected;
+	useBVH = selectedUseBVH;
+	buildBVH(SCENE == 2 ? 25 : 15);
+	serializeBVH(flatNodes, bvhIndices);
+}
+
+void benchmarkGPULayout() {
+	// Legacy layout: 48 byte nodes, every shape one FlatShape with its material inlined.
+	// Frozen copy of the struct as the GPU read it, so later changes to FlatShape do not move the baseline
+	struct LegacyFlatShape {
+		int type;
+		alignas(16) glm::vec3 padding;
+		FlatMaterial material;
+		alignas(16) glm::vec3 sphereCenter;
+		float sphereRadius;
+		alignas(16) glm::vec3 planeNormal;
+		float planeD;
+		alignas(16) glm::vec3 wallStart;
+		float wallWidth;
+		float wallHeight;
+		alignas(16) glm::vec3 padding1;
+		alignas(16) glm::vec3 triP1;
+		float padding2;
+		alignas(16) glm::vec3 triP2;
+		float padding3;
+		alignas(16) glm::vec3 triP3;
+		float padding4;
+	};
+	const size_t legacyNodeSize = 48;
+	const size_t legacyShapeSize = sizeof(LegacyFlatShape);
+
+	FlatScene flatScene;
+	serializeScene(flatScene);
+
+	// Trace primary rays, count fetched nodes and tested shapes
+	auto tracePrimaryRays = [](BVHStats& stats) {
+		stats.shapeTests.assign(scene.shapes.size(), 0);
+		long long hits = 0;
+		for (int y = 0; y < HEIGHT; ++y) {
+			for (int x = 0; x < WIDTH; ++x) {
+				Ray ray = scene.camera.GetRay(2.f * x / WIDTH - 1, 1.f - 2.f * y / HEIGHT);
+				BVHHit hit;
+				if (intersectTLAS(scene.tlas.getNodes(), scene.instances, flatNodes, bvhIndices, scene.store, nullptr, ray, hit, &stats)) // Binary BVH, as on the GPU
+					hits++;
+			}
+		}
+		return hits;
+	};
+	BVHStats stats;
+	long long hits = tracePrimaryRays(stats);
+
+	long long shapeTests = 0;
+	double legacyBytes = 0, packedBytes = 0;
+	for (int i = 0; i < scene.shapes.size(); ++i) {
+		shapeTests += stats.shapeTests[i];
+
+		size_t packedSize = sizeof(FlatWall);
+		switch (flatScene.shapeRefs[i] & 3) {
+		case FLAT_SPHERE: packedSize = sizeof(FlatSphere); break;
+		case FLAT_TRIANGLE: packedSize = sizeof(FlatTriangle); break;
+		}
+		legacyBytes += double(stats.shapeTests[i]) * legacyShapeSize;
+		packedBytes += double(stats.shapeTests[i]) * packedSize;
+	}
+	legacyBytes += double(stats.nodeVisits) * legacyNodeSize;
+	packedBytes += double(stats.nodeVisits) * sizeof(FlatNode) + double(hits) * sizeof(FlatMaterial); // Material is looked up once per hit
+
+	size_t legacyBuffers = legacyNodeSize * flatNodes.size() + legacyShapeSize * scene.shapes.size();
+	size_t packedBuffers = sizeof(FlatNode) * flatNodes.size() + sizeof(FlatMaterial) * flatScene.materials.size() +
+		sizeof(FlatTriangle) * flatScene.triangles.size() + sizeof(FlatSphere) * flatScene.spheres.size() + sizeof(FlatWall) * flatScene.walls.size();
+
+	const double rays = double(WIDTH) * HEIGHT;
+	std::cout << "GPU layout, " << scene.shapes.size() << " shapes, " << flatScene.materials.size() << " materials, "
+		<< stats.nodeVisits / rays << " nodes and " << shapeTests / rays << " shapes per ray" << std::endl;
+	std::cout << "layout	node B	bytes/ray	buffers KB" << std::endl;
+	std::cout << "legacy	" << legacyNodeSize << "	" << legacyBytes / rays << "	" << legacyBuffers / 1024.0 << std::endl;
+	std::cout << "packed	" << sizeof(FlatNode) << "	" << packedBytes / rays << "	" << packedBuffers / 1024.0 << std::endl;
+
+	// Node order: simulated misses of the node and index fetches in a 32 KB L1 and a 1 MB L2 cache (64 byte lines)
+	BVHLayout selected = bvhLayout;
+	std::cout << "node order	lines/ray	L1 misses/ray	L2 misses/ray" << std::endl;
+	for (BVHLayout layout : { BVH_LAYOUT_DEPTH_FIRST, BVH_LAYOUT_TREELET }) {
+		bvhLayout = layout;
+		buildBVH(SCENE == 2 ? 25 : 15);
+		serializeBVH(flatNodes, bvhIndices);
+
+		CacheSim l2(1 << 20, 16);
+		CacheSim l1(32 << 10, 8, 64, &l2);
+		BVHStats cacheStats;
+		cacheStats.cache = &l1;
+		tracePrimaryRays(cacheStats);
+
+		std::cout << (layout == BVH_LAYOUT_TREELET ? "treelet" : "depth-first") << "	" << l1.accesses() / rays << "	"
+			<< l1.misses() / rays << "	" << l2.misses() / rays << std::endl;
+	}
+
+	// Restore the scene BVH
+	bvhLayout = selected;
+	buildBVH(SCENE == 2 ? 25 : 15);
+	serializeBVH(flatNodes, bvhIndices);
+}
+
+int renderHeadless(const HeadlessOptions& options) {
+	initEmbree();
+	generateScene();
+	if (scene.shapes.empty()) {
+		std::cout << "Nothing to render" << std::endl;
+		cleanupEmbree();
+		return -1;
+	}
+	serializeBVH(flatNodes, bvhIndices);
+
+	// Camera
+	scene.camera.aspectRatio = float(WIDTH) / HEIGHT;
+	if (options.fov > 0) scene.camera.fov = options.fov;
+	if (options.setCamera) {
+		scene.camera.Position = options.cameraPosition;
+		scene.camera.LookAt(options.cameraTarget);
+	}
+
+	std::vector<float> pixelData(WIDTH * HEIGHT * 4, 0.0f);
+	auto start = std::chrono::high_resolution_clock::now();
+	cpuRayTracer(pixelData);
+	double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+	std::cout << "Rendered " << WIDTH << "x" << HEIGHT << ", " << cpuSamples << " samples, " << cpuBounces << " bounces, "
+		<< threadPool.size() << " threads in " << seconds * 1000 << " ms" << std::endl;
+
+	bool written = writePPM(options.output, pixelData, WIDTH, HEIGHT);
+	cleanupEmbree();
+	return written ? 0 : -1;
+}
+
+bool writePPM(const std::string& path, const std::vector<float>& pixelData, int width, int height) {
+	std::ofstream file(path, std::ios::binary);
+	if (!file) {
+		std::cout << "Failed to write " << path << std::endl;
+		return false;
+	}
+
+	// Binary RGB, first row is the top of the image
+	file << "P6\n" << width << " " << height << "\n255\n";
+	std::vector<unsigned char> row(width * 3);
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			for (int c = 0; c < 3; ++c)
+				row[x * 3 + c] = static_cast<unsigned char>(glm::clamp(pixelData[(y * width + x) * 4 + c], 0.f, 1.f) * 255.f + 0.5f);
+		}
+		file.write(reinterpret_cast<const char*>(row.data()), row.size());
+	}
+
+	std::cout << "Image written to " << path << std::endl;
+	return true;
+}
+
+int runBenchmarks(const std::string& output) {
+	const unsigned seed = 1234;
+	const int syntheticTriangles[] = { 10000, 100000, 1000000 };
+
+	BenchmarkReport report;
+	report.setInfo("resolution", std::to_string(WIDTH) + "x" + std::to_string(HEIGHT));
+	report.setInfo("threads", std::to_string(threadPool.size()));
+	report.setInfo("seed", std::to_string(seed));
+	report.setInfo("intersection", intersectionAlgorithm == EMBREE ? "embree" : intersectionAlgorithm == MT ? "moller-trumbore" : "barycentric");
+	report.setInfo("bvh", !useBVH ? "none" : bvhBuilderName(bvhBuilder));
+	report.setInfo("bvh layout", bvhLayout == BVH_LAYOUT_TREELET ? "treelet" : "depth-first");
+	report.setInfo("cpu bvh width", std::to_string(useWideBVH ? BVH_WIDTH : 2));
+	report.setInfo("cpu packet", std::to_string(cpuPacketSize) + "x" + std::to_string(cpuPacketSize));
+
+	initEmbree();
+
+	// Scenes of the application, then synthetic scenes of growing size, all generated from the same seed
+	for (int i = 0; i < 5; ++i) {
+		clearScene();
+		seedRandom(seed);
+		sceneFile.clear();
+
+		std::string name;
+		int buildRepeats = 5;
+		if (i < 2) {
+			SCENE = i + 1;
+			name = "scene" + std::to_string(SCENE);
+
+			// Built-in scenes expect their models to exist
+			const char* model = SCENE == 1 ? "models/monkey.obj" : "models/car.obj";
+			if (!std::ifstream(model)) {
+				report.addScene(name).skipped = std::string(model) + " not found";
+				continue;
+			}
+			generateScene();
+		}
+		else {
+			SCENE = 0;
+			int triangles = syntheticTriangles[i - 2];
+			generateSyntheticScene(triangles);
+			name = "synthetic " + std::to_string(triangles / 1000) + "k";
+			if (triangles >= 1000000) buildRepeats = 3;
+		}
+
+		std::cout << "Benchmark " << name << std::endl;
+		benchmarkScene(report.addScene(name), buildRepeats);
+	}
+
+	clearScene();
+	cleanupEmbree();
+
+	report.print();
+	return report.write(output) ? 0 : -1;
+}
+
+void benchmarkScene(BenchmarkScene& result, int buildRepeats) {
+	const int refitFrames = 30;
+	const int rayFrames = 8;
+
+	if (scene.shapes.empty()) {
+		result.skipped = "no shapes";
+		return;
+	}
+
+	// Per-instance BVHs, top level BVH and their flat copy
+	BenchmarkMetric& build = result.metric("build", "ms");
+	for (int i = 0; i < buildRepeats; ++i) {
+		BenchmarkTimer timer;
+		buildBVH(SCENE == 2 ? 25 : 15);
+		serializeBVH(flatNodes, bvhIndices);
+		build.add(timer.elapsedMs());
+	}
+
+	// The same build on one thread, shows how the parallel build scales
+	if (threadPool.size() > 1) {
+		BenchmarkMetric& buildSerial = result.metric("build 1 thread", "ms");
+		parallelBVHBuild = false;
+		for (int i = 0; i < buildRepeats; ++i) {
+			BenchmarkTimer timer;
+			buildBVH(SCENE == 2 ? 25 : 15);
+			serializeBVH(flatNodes, bvhIndices);
+			buildSerial.add(timer.elapsedMs());
+		}
+		parallelBVHBuild = true;
+	}
+
+	// Full LBVH build for comparison (animated instances are rebuilt in the refit below when it is selected)
+	if (bvhBuilder != LBVH) {
+		BenchmarkMetric& buildLinear = result.metric("build lbvh", "ms");
+		BVH_builder selected = bvhBuilder;
+		bvhBuilder = LBVH;
+		for (int i = 0; i < buildRepeats; ++i) {
+			BenchmarkTimer timer;
+			buildBVH();
+			serializeBVH(flatNodes, bvhIndices);
+			buildLinear.add(timer.elapsedMs());
+		}
+		bvhBuilder = selected;
+		buildBVH(SCENE == 2 ? 25 : 15);
+		serializeBVH(flatNodes, bvhIndices);
+	}
+
+	// All GPU buffers
+	BenchmarkMetric& serialize = result.metric("serialize", "ms");
+	for (int i = 0; i < buildRepeats; ++i) {
+		FlatScene flatScene;
+		BenchmarkTimer timer;
+		serializeScene(flatScene);
+		serialize.add(timer.elapsedMs());
+	}
+
+	// Animation at a fixed 30 fps, the same frames on every run
+	BenchmarkMetric& refit = result.metric(bvhBuilder == LBVH ? "rebuild" : "refit", "ms");
+	deltaTime = 1.f / 30;
+	for (int frame = 0; frame < refitFrames; ++frame) {
+		animateScene(frame * deltaTime);
+
+		BenchmarkTimer timer;
+		refitBVH();
+		updateInstances();
+		refit.add(timer.elapsedMs());
+	}
+	embreeScene.updateTriangles(scene.shapes, animatedIndices);
+	embreeScene.commit();
+
+	result.info.push_back(std::make_pair("shapes", double(scene.shapes.size())));
+	result.info.push_back(std::make_pair("triangles", double(scene.store.triangles.size())));
+	result.info.push_back(std::make_pair("instances", double(scene.instances.size())));
+	result.info.push_back(std::make_pair("nodes", double(flatNodes.size())));
+
+	benchmarkRays(result, rayFrames);
+}
+
+void benchmarkRays(BenchmarkScene& result, int frames) {
+	scene.store.triangleAlgorithm = intersectionAlgorithm;
+
+	// Camera orbits the scene bounds slightly from above (-y is up)
+	BoundingBox bounds;
+	for (const Instance& instance : scene.instances)
+		bounds.growToInclude(instance.worldBounds());
+	glm::vec3 center = bounds.center();
+	float radius = glm::length(bounds.Max - bounds.Min) * 0.5f;
+
+	const int pixels = WIDTH * HEIGHT;
+	std::vector<BVHHit> hits(pixels);
+	std::vector<glm::vec3> normals(pixels);
+	std::vector<glm::vec3> directions(pixels);
+	std::vector<char> results(pixels);	// Keeps the traced rays from being optimized away
+
+	BenchmarkMetric& primary = result.metric("primary", "Mrays/s");
+	BenchmarkMetric& shadow = result.metric("shadow", "Mrays/s");
+	BenchmarkMetric& reflection = result.metric("reflection", "Mrays/s");
+
+	for (int frame = 0; frame < frames; ++frame) {
+		float angle = glm::two_pi<float>() * frame / frames;
+		scene.camera.Position = center + radius * glm::vec3(1.5f * std::sin(angle), -0.5f, 1.5f * std::cos(angle));
+		scene.camera.aspectRatio = float(WIDTH) / HEIGHT;
+		scene.camera.LookAt(center);
+
+		// Primary rays
+		BenchmarkTimer timer;
+		threadPool.parallelFor(HEIGHT, [&](int y, int threadIdx) {
+			for (int x = 0; x < WIDTH; ++x) {
+				int idx = y * WIDTH + x;
+				Ray ray = scene.camera.GetRay(2.f * x / WIDTH - 1, 1.f - 2.f * y / HEIGHT);
+				hits[idx] = BVHHit();
+				cpuIntersect(ray, hits[idx]);
+				directions[idx] = ray.get_dir();
+			}
+		});
+		primary.add(pixels / timer.elapsedMs() / 1000);
+
+		// Same primary rays in packets (hits are not kept, they match the single rays)
+		if (useBVH && cpuPacketSize > 1) {
+			int bands = (HEIGHT + cpuPacketSize - 1) / cpuPacketSize;
+			timer.restart();
+			threadPool.parallelFor(bands, [&](int band, int threadIdx) {
+				int startY = band * cpuPacketSize;
+				int endY = std::min(startY + cpuPacketSize, HEIGHT);
+				for (int startX = 0; startX < WIDTH; startX += cpuPacketSize) {
+					RayPacket packet;
+					for (int y = startY; y < endY; ++y) {
+						for (int x = startX; x < std::min(startX + cpuPacketSize, WIDTH); ++x)
+							packet.add(scene.camera.GetRay(2.f * x / WIDTH - 1, 1.f - 2.f * y / HEIGHT));
+					}
+					packet.finish();
+					cpuIntersectPacket(packet);
+					results[startY * WIDTH + startX] = packet.hits[0].shapeIdx != -1;
+				}
+			});
+			result.metric("primary packets", "Mrays/s").add(pixels / timer.elapsedMs() / 1000);
+		}
+
+		// Secondary rays start at the primary hits (not timed)
+		int hitCount = 0;
+		for (int idx = 0; idx < pixels; ++idx) {
+			if (hits[idx].shapeIdx == -1) continue;
+			normals[idx] = cpuHitNormal(hits[idx]);
+			hitCount++;
+		}
+		if (hitCount == 0) continue;
+
+		// Shadow rays, any hit towards the light
+		timer.restart();
+		threadPool.parallelFor(HEIGHT, [&](int y, int threadIdx) {
+			for (int idx = y * WIDTH; idx < (y + 1) * WIDTH; ++idx) {
+				if (hits[idx].shapeIdx == -1) continue;
+				const glm::vec3& point = hits[idx].point;
+				Ray shadowRay(point + normals[idx] * 1e-3f, glm::normalize(scene.light.position - point));
+				results[idx] = cpuOccluded(shadowRay, glm::distance(scene.light.position, shadowRay.get_start()));
+			}
+		});
+		shadow.add(hitCount / timer.elapsedMs() / 1000);
+
+		// Reflection rays, closest hit
+		timer.restart();
+		threadPool.parallelFor(HEIGHT, [&](int y, int threadIdx) {
+			for (int idx = y * WIDTH; idx < (y + 1) * WIDTH; ++idx) {
+				if (hits[idx].shapeIdx == -1) continue;
+				Ray reflectionRay(hits[idx].point + normals[idx] * 1e-3f, glm::reflect(directions[idx], normals[idx]));
+				BVHHit hit;
+				results[idx] = cpuIntersect(reflectionRay, hit);
+			}
+		});
+		reflection.add(hitCount / timer.elapsedMs() / 1000);
 	}
 }
 
+std::string gpuTileDefines(glm::ivec2 tile) {
+	return "#define TILE_X " + std::to_string(tile.x) + "\n#define TILE_Y " + std::to_string(tile.y) + "\n";
+}
+
 void printMaterial(Material mat) {
 	std::cout << "Color " << mat.color.r << " " << mat.color.g << " " << mat.color.b << std::endl;
 	std::cout << "Fresnel " << mat.fresnelStrength << std::endl;
@@ -930,150 +1901,306 @@ void printPoint(glm::vec3 point) {
 }
 
 float randomFloat(float min, float max) {
-	// Create a random device and seed the generator
-	std::random_device rd;
-	std::mt19937 gen(rd());
-
-	// Create a uniform real distribution between min and max
-	std::uniform_real_distribution<float> dis(min, max);
-
-	// Generate and return a random float
-	return dis(gen);
+	return sceneRandom.nextFloat(min, max);
 }
 float randomFloat01() {
-	// Create a random device and seed the generator
-	static std::random_device rd;
-	static std::mt19937 gen(rd());
-
-	// Create a uniform real distribution between 0.0 and 1.0
-	std::uniform_real_distribution<float> dis(0.0f, 1.0f);
-
-	// Generate and return a random float
-	return dis(gen);
+	return sceneRandom.nextFloat();
+}
+void seedRandom(unsigned seed) {
+	sceneRandom.seed(seed);
 }
 
 void serializeBVH(std::vector<FlatNode>& nodes, std::vector<int>& indices) {
 
-	nodes.clear();
-	indices.clear();
+	// Prebuilt BVH, one copy straight from the mapped file, otherwise the builders already wrote the flat layout
+	if (scene.bvhCache.isOpen()) {
+		nodes.assign(scene.bvhCache.nodes(), scene.bvhCache.nodes() + scene.bvhCache.nodeCount());
+		indices.assign(scene.bvhCache.indices(), scene.bvhCache.indices() + scene.bvhCache.indexCount());
+	}
+	else {
+		nodes = scene.bvhNodes;
+		indices = scene.bvhIndices;
+	}
 
-	for (auto& node : scene.bvhNodes) {
-		FlatNode flatNode;
+	std::vector<int> roots;
+	for (const Instance& instance : scene.instances)
+		roots.push_back(instance.blasRoot);
+	bvhRefitter.init(nodes, indices, roots, animatedIndices);
 
-		flatNode.boundsMin = node->box.Min;
-		flatNode.boundsMax = node->box.Max;
-		flatNode.leftChild = node->leftChild;
-		flatNode.rightChild = node->rightChild;
-		flatNode.startShapeIdx = indices.size();
-		flatNode.numShapes = node->shapesIndices.size();
+	// First serialization after a build with a cache path
+	if (!scene.bvhCacheSavePath.empty()) {
+		if (!saveBVHCache(scene.bvhCacheSavePath, scene.bvhCacheHash, nodes, indices, roots))
+			std::cout << "Could not write BVH cache " << scene.bvhCacheSavePath << std::endl;
+		scene.bvhCacheSavePath.clear();
+	}
 
-		nodes.push_back(flatNode);
+	// SIMD leaf blocks and the wide BVH follow the new tree
+	scene.store.buildBlocks(nodes, indices, scene.lbvhNodeRanges);
+	scene.wideBvh.build(nodes, roots, scene.lbvhNodeRanges);
+	scene.lbvhCPUStale = false;
+}
 
-		if (node->leftChild == -1) {
-			for (int idx : node->shapesIndices) {
-				indices.push_back(idx);
-			}
-		}
+void serializeInstances(std::vector<FlatInstance>& instances) {
+	instances.clear();
 
+	for (const Instance& instance : scene.instances) {
+		FlatInstance flatInstance;
+		flatInstance.worldToObject = instance.invTransform;
+		flatInstance.objectToWorld = instance.transform;
+		flatInstance.blasRoot = instance.blasRoot;
+		flatInstance.primitiveType = instance.primitiveType;
+		flatInstance.primitiveOffset = instance.primitiveOffset;
+		flatInstance.padding = 0;
+
+		instances.push_back(flatInstance);
 	}
 }
 
-void updateScene(FlatScene& flatScene, GLuint ssbo)
-{
-	for (int i : animatedIndices) {
-		flatScene.shapes[i] = serializeShape(scene.shapes[i]);
+int addMeshInstance(int firstShapeIdx, int numShapes) {
+	// GPU shapes keep instance + 1 in 16 bits (packMaterialInstance), world space shapes take 0
+	if (scene.instances.size() == 0xFFFF)
+		std::cout << "Warning: more than 65535 mesh instances, instance ids will wrap" << std::endl;
 
-		glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
-		glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(FlatShape) * i, sizeof(FlatShape), &flatScene.shapes[i]);
+	Instance instance;
+	for (int i = 0; i < numShapes; ++i)
+		instance.shapeIndices.push_back(firstShapeIdx + i);
 
+	scene.instances.push_back(instance);
+	return scene.instances.size() - 1;
+}
+
+void addWorldInstance() {
+	for (int i = 0; i < scene.instances.size(); ++i) {
+		for (int idx : scene.instances[i].shapeIndices)
+			scene.shapes[idx]->instance = i;
 	}
 
-	
+	// Shapes of the world instances stay in world space. One instance per GPU primitive buffer (spheres, walls and
+	// planes, triangles), so the leaves of every BVH read a single buffer
+	Instance world[3];
+	for (int i = 0; i < scene.shapes.size(); ++i) {
+		if (scene.shapes[i]->instance != -1) continue;
+		ShapeType type = scene.shapes[i]->type;
+		world[type == SHAPE_SPHERE ? 0 : type == SHAPE_TRIANGLE ? 2 : 1].shapeIndices.push_back(i);
+	}
+
+	for (const Instance& instance : world) {
+		if (!instance.shapeIndices.empty())
+			scene.instances.push_back(instance);
+	}
 }
 
-FlatShape serializeShape(const std::unique_ptr<Shape>& shape)
-{
-	FlatShape flatShape;
+void setInstanceTransform(int instanceIdx, const glm::mat4& transform) {
+	Instance& instance = scene.instances[instanceIdx];
+	instance.setTransform(transform);
 
-	if (auto* sphere = dynamic_cast<Sphere*>(shape.get())) {
-		flatShape.type = 0; // Sphere
+	// Embree places the whole mesh too
+	if (!instance.shapeIndices.empty())
+		embreeScene.setMeshTransform(instance.shapeIndices[0], transform);
+}
 
-		flatShape.material.color = sphere->material.color;
-		flatShape.material.fresnelStrength = sphere->material.fresnelStrength;
+void updateInstances() {
+	scene.tlas.build(scene.instances);
+	serializeInstances(flatInstances);
+}
 
-		flatShape.material.ambientStrength = sphere->material.ambientStrength;
-		flatShape.material.diffuseStrength = sphere->material.diffuseStrength;
-		flatShape.material.specularStrength = sphere->material.specularStrength;
-		flatShape.material.shininess = sphere->material.shininess;
+void updateScene(FlatScene& flatScene, UploadRing& uploadRing, GLuint ssboTriangles, GLuint ssboSpheres, GLuint ssboWalls, GLuint ssboMaterials)
+{
+	// Dirty elements per buffer, uploaded as ranges of consecutive elements
+	static std::vector<int> spheres, walls, triangles, materials;
+	spheres.clear();
+	walls.clear();
+	triangles.clear();
+	materials.clear();
 
-		flatShape.sphereCenter = sphere->m_center;
-		flatShape.sphereRadius = sphere->m_radius;
+	for (int i : animatedIndices) {
+		int ref = flatScene.shapeRefs[i];
+		int materialId = flatScene.shapeMaterials[i];
+		serializeShape(scene.shapes[i], materialId, flatScene, ref);
+		flatScene.materials[materialId] = serializeMaterial(scene.shapes[i]->material);
+
+		int idx = ref >> 2;
+		switch (ref & 3) {
+		case FLAT_SPHERE:
+			spheres.push_back(idx);
+			break;
+		case FLAT_WALL:
+			walls.push_back(idx);
+			break;
+		case FLAT_TRIANGLE:
+			triangles.push_back(idx);
+			break;
+		}
+		materials.push_back(materialId);
 	}
-	else if (auto* wall = dynamic_cast<Wall*>(shape.get())) {
-		flatShape.type = 2; // Wall
-
-		flatShape.material.color = wall->material.color;
-		flatShape.material.fresnelStrength = wall->material.fresnelStrength;
 
-		flatShape.material.ambientStrength = wall->material.ambientStrength;
-		flatShape.material.diffuseStrength = wall->material.diffuseStrength;
-		flatShape.material.specularStrength = wall->material.specularStrength;
-		flatShape.material.shininess = wall->material.shininess;
+	uploadElements(uploadRing, ssboSpheres, flatScene.spheres, spheres);
+	uploadElements(uploadRing, ssboWalls, flatScene.walls, walls);
+	uploadElements(uploadRing, ssboTriangles, flatScene.triangles, triangles);
+	uploadElements(uploadRing, ssboMaterials, flatScene.materials, materials);
+}
 
-		flatShape.planeNormal = wall->m_normal;
-		flatShape.planeD = wall->d;
+template<typename T>
+void uploadElements(UploadRing& uploadRing, GLuint ssbo, const std::vector<T>& elements, std::vector<int>& indices)
+{
+	std::sort(indices.begin(), indices.end());
+	indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
 
-		flatShape.wallStart = wall->start;
-		flatShape.wallWidth = wall->width;
-		flatShape.wallHeight = wall->height;
+	for (size_t i = 0; i < indices.size();) {
+		size_t end = i + 1;
+		while (end < indices.size() && indices[end] == indices[end - 1] + 1)
+			++end;
 
+		int count = static_cast<int>(end - i);
+		uploadRing.upload(ssbo, sizeof(T) * indices[i], &elements[indices[i]], sizeof(T) * count);
+		i = end;
 	}
-	else if (auto* triangle = dynamic_cast<Triangle*>(shape.get())) {
-		flatShape.type = 3; // Triangle
+}
+
+FlatMaterial serializeMaterial(const Material& material)
+{
+	FlatMaterial flatMaterial;
+	flatMaterial.color = material.color;
+	flatMaterial.fresnelStrength = material.fresnelStrength;
+
+	flatMaterial.ambientStrength = material.ambientStrength;
+	flatMaterial.diffuseStrength = material.diffuseStrength;
+	flatMaterial.specularStrength = material.specularStrength;
+	flatMaterial.shininess = material.shininess;
 
-		flatShape.material.color = triangle->material.color;
-		flatShape.material.fresnelStrength = triangle->material.fresnelStrength;
+	return flatMaterial;
+}
 
-		flatShape.material.ambientStrength = triangle->material.ambientStrength;
-		flatShape.material.diffuseStrength = triangle->material.diffuseStrength;
-		flatShape.material.specularStrength = triangle->material.specularStrength;
-		flatShape.material.shininess = triangle->material.shininess;
+int addMaterial(FlatScene& flatScene, const Material& material, bool shared)
+{
+	FlatMaterial flatMaterial = serializeMaterial(material);
+
+	// Shapes of a mesh come in a row, so the last material is the most likely match
+	if (shared) {
+		for (int i = static_cast<int>(flatScene.materials.size()) - 1; i >= 0; --i) {
+			const FlatMaterial& other = flatScene.materials[i];
+			if (other.color == flatMaterial.color && other.fresnelStrength == flatMaterial.fresnelStrength &&
+				other.ambientStrength == flatMaterial.ambientStrength && other.diffuseStrength == flatMaterial.diffuseStrength &&
+				other.specularStrength == flatMaterial.specularStrength && other.shininess == flatMaterial.shininess)
+				return i;
+		}
+	}
 
-		flatShape.planeNormal = triangle->m_normal;
-		flatShape.planeD = triangle->d;
+	if (flatScene.materials.size() == 0x10000)
+		std::cout << "Warning: more than 65536 materials, material ids will wrap" << std::endl;
 
-		flatShape.triP1 = triangle->a;
-		flatShape.triP2 = triangle->b;
-		flatShape.triP3 = triangle->c;
+	flatScene.materials.push_back(flatMaterial);
+	return static_cast<int>(flatScene.materials.size()) - 1;
+}
+
+int serializeShape(const std::unique_ptr<Shape>& shape, int materialId, FlatScene& flatScene, int ref)
+{
+	unsigned materialInstance = packMaterialInstance(materialId, shape->instance);
+
+	switch (shape->type) {
+	case SHAPE_SPHERE: {
+		const Sphere* sphere = static_cast<const Sphere*>(shape.get());
+		FlatSphere flatSphere = {};
+		flatSphere.center = sphere->m_center;
+		flatSphere.radius = sphere->m_radius;
+		flatSphere.materialInstance = materialInstance;
+
+		if (ref == -1) {
+			ref = makePrimitiveRef(static_cast<int>(flatScene.spheres.size()), FLAT_SPHERE);
+			flatScene.spheres.push_back(flatSphere);
+		}
+		else flatScene.spheres[ref >> 2] = flatSphere;
+		break;
+	}
+	case SHAPE_TRIANGLE: {
+		const Triangle* triangle = static_cast<const Triangle*>(shape.get());
+		FlatTriangle flatTriangle = {};
+		flatTriangle.v0 = triangle->a;
+		flatTriangle.edge1 = triangle->b - triangle->a;
+		flatTriangle.edge2 = triangle->c - triangle->a;
+		// Normal is not stored, keep the winding consistent with it
+		if (glm::dot(triangle->m_normal, glm::cross(flatTriangle.edge1, flatTriangle.edge2)) < 0)
+			std::swap(flatTriangle.edge1, flatTriangle.edge2);
+		flatTriangle.materialInstance = materialInstance;
+
+		if (ref == -1) {
+			ref = makePrimitiveRef(static_cast<int>(flatScene.triangles.size()), FLAT_TRIANGLE);
+			flatScene.triangles.push_back(flatTriangle);
+		}
+		else flatScene.triangles[ref >> 2] = flatTriangle;
+		break;
+	}
+	case SHAPE_PLANE:
+	case SHAPE_WALL: {
+		const Plane* plane = static_cast<const Plane*>(shape.get());
+		FlatWall flatWall = {};
+		flatWall.normal = plane->m_normal;
+		flatWall.d = plane->d;
+		flatWall.width = -1; // Plane without boundaries
+		if (shape->type == SHAPE_WALL) {
+			const Wall* wall = static_cast<const Wall*>(shape.get());
+			flatWall.start = wall->start;
+			flatWall.width = wall->width;
+			flatWall.height = wall->height;
+		}
+		flatWall.materialInstance = materialInstance;
 
+		if (ref == -1) {
+			ref = makePrimitiveRef(static_cast<int>(flatScene.walls.size()), FLAT_WALL);
+			flatScene.walls.push_back(flatWall);
+		}
+		else flatScene.walls[ref >> 2] = flatWall;
+		break;
+	}
 	}
-	else if (auto* plane = dynamic_cast<Plane*>(shape.get())) {
-		flatShape.type = 1; // Plane
 
-		flatShape.material.color = plane->material.color;
-		flatShape.material.fresnelStrength = plane->material.fresnelStrength;
+	return ref;
+}
 
-		flatShape.material.ambientStrength = plane->material.ambientStrength;
-		flatShape.material.diffuseStrength = plane->material.diffuseStrength;
-		flatShape.material.specularStrength = plane->material.specularStrength;
-		flatShape.material.shininess = plane->material.shininess;
+void refitBVH() {
+	scene.store.update(scene.shapes, animatedIndices);
 
-		flatShape.planeNormal = plane->m_normal;
-		flatShape.planeD = plane->d;
+	// Flat nodes are refitted (or rebuilt by LBVH) in place, scene.bvhNodes keep the bounds from the build
+	if (bvhBuilder == LBVH) {
+		rebuildLBVH();
+	}
+	else {
+		bvhRefitter.refit(flatNodes, bvhIndices, scene.shapes);
+		scene.wideBvh.refit(flatNodes);
+	}
 
+	// Instance bounds follow their BVH roots (top level BVH is rebuilt by updateInstances)
+	for (Instance& instance : scene.instances) {
+		if (instance.blasRoot == -1) continue;
+		instance.bounds.Min = flatNodes[instance.blasRoot].boundsMin;
+		instance.bounds.Max = flatNodes[instance.blasRoot].boundsMax;
 	}
-	return flatShape;
 }
 
-void updateBVH() {
-	for (auto& node : scene.bvhNodes) {
-		for (int idx : node->shapesIndices)
-		{
-			if (scene.shapes[idx]->animated) {
-				node->box.growToInclude(scene.shapes[idx]);
-			}
-		}
+void rebuildLBVH() {
+	if (scene.lbvhRebuilt.empty()) return;
+
+	// Same node and index ranges as the first build, the roots stay at the start of their ranges
+	lbvhBuilder.init(sahParams, lbvhParams, parallelBVHBuild ? &threadPool : nullptr);
+	for (int instanceIdx : scene.lbvhRebuilt) {
+		Instance& instance = scene.instances[instanceIdx];
+		const LBVHRange& range = scene.lbvhRanges[instanceIdx];
+		instance.blasRoot = lbvhBuilder.build(scene.shapes, instance.shapeIndices, flatNodes, range.firstNode, bvhIndices, range.firstIndex);
+		bvhReorderer.apply(flatNodes, bvhIndices, instance.blasRoot, bvhLayout);
 	}
+
+	// Triangle blocks and the wide BVH are only read by the CPU tracer
+	if (rtxon)
+		scene.lbvhCPUStale = true;
+	else
+		repackLBVH();
+}
+
+void repackLBVH() {
+	// Only the rebuilt node ranges, blocks and wide nodes of the other instances stay
+	scene.store.repackBlocks(flatNodes, bvhIndices, scene.lbvhNodeRanges);
+	scene.wideBvh.rebuild(flatNodes, scene.lbvhNodeRanges);
+	scene.lbvhCPUStale = false;
 }
 
 void bounceSphere(Sphere* sphere, float elapsedTime, float amplitude = 2, float frequency = 1) {
@@ -1081,115 +2208,304 @@ void bounceSphere(Sphere* sphere, float elapsedTime, float amplitude = 2, float
 	sphere->m_center.y = sphere->origin.y + amplitude * std::sin(frequency * elapsedTime);
 }
 
+void animateScene(float elapsedTime) {
+	// Scene 1
+	if (SCENE == 1) {
+		const float amplitudes[] = { 10, 7, 15 };
+		const float frequencies[] = { 1, 0.8f, 1.5f };
+		for (int i = 0; i < 3; ++i) {
+			if (scene.shapes[i]->type == SHAPE_SPHERE)
+				bounceSphere(static_cast<Sphere*>(scene.shapes[i].get()), elapsedTime, amplitudes[i], frequencies[i]);
+		}
+	}
+	// Scene 2
+	else if (SCENE == 2) {
+		updateWheelAnimations(elapsedTime);
+	}
+	// Other scenes, animated spheres bounce in place
+	else {
+		for (int i : animatedIndices) {
+			if (scene.shapes[i]->type == SHAPE_SPHERE)
+				bounceSphere(static_cast<Sphere*>(scene.shapes[i].get()), elapsedTime, 5, 1 + 0.1f * (i % 8));
+		}
+	}
+}
+
 void updateWheelAnimations(float elapsedTime) {
 	float rotationSpeed = 1;
 
 
 	for (auto& wheel : wheels) {
+		if (wheel.instanceIdx == -1) continue;
+
 		// Update rotation angle
-		wheel.rotationAngle = rotationSpeed * deltaTime;
-		//wheel.rotationAngle = fmod(wheel.rotationAngle, glm::two_pi<float>());
+		wheel.rotationAngle += rotationSpeed * deltaTime;
+		wheel.rotationAngle = fmod(wheel.rotationAngle, glm::two_pi<float>());
 
 		glm::vec3 center = wheel.center;
 		glm::mat4 translateToOrigin = glm::translate(glm::mat4(1.0f), -center);
 		glm::mat4 translateBack = glm::translate(glm::mat4(1.0f), center);
 
-		// Apply rotation to each triangle
+		// Rotate the wheel instance, triangles stay untouched
 		glm::mat4 rotationMatrix = glm::rotate(glm::mat4(1.0f), wheel.rotationAngle, wheel.rotationAxis);
-		glm::mat4 transform = translateBack * rotationMatrix * translateToOrigin;
-
-		for (int idx : wheel.shapeIndices) {
-			if (auto triangle = dynamic_cast<Triangle*>(scene.shapes[idx].get())) {
-				triangle->a = glm::vec3(transform * glm::vec4(triangle->a, 1.0f));
-				triangle->b = glm::vec3(transform * glm::vec4(triangle->b, 1.0f));
-				triangle->c = glm::vec3(transform * glm::vec4(triangle->c, 1.0f));
-			}
-		}
+		setInstanceTransform(wheel.instanceIdx, translateBack * rotationMatrix * translateToOrigin);
 	}
 }
 
-void split(std::unique_ptr<Node>& parentNode, int depth) {
+void split(std::vector<FlatNode>& nodes, std::vector<int>& indices, int nodeIdx, int depth) {
 
 	// child case
-	if (depth <= 0) {
-		parentNode->leftChild = -1;
-		parentNode->rightChild = -1;
+	if (depth <= 0)
 		return;
-	}
 
-	glm::vec3 size = parentNode->box.Max - parentNode->box.Min;
+	glm::vec3 size = nodes[nodeIdx].boundsMax - nodes[nodeIdx].boundsMin;
 	int splitAxis = size.x > glm::max(size.y, size.z) ? 0 : size.y > size.z ? 1 : 2;
-	float splitPos = parentNode->box.center()[splitAxis];
+	float splitPos = (nodes[nodeIdx].boundsMin[splitAxis] + nodes[nodeIdx].boundsMax[splitAxis]) * 0.5f;
 
-	auto leftNode = std::make_unique<Node>();
-	auto rightNode = std::make_unique<Node>();
+	// Shapes of the left child are swapped to the front of the node range
+	int begin = nodes[nodeIdx].startShapeIdx();
+	int end = begin + nodes[nodeIdx].numShapes();
+	int middle = begin;
+	BoundingBox leftBox, rightBox;
 
-	for (auto idx : parentNode->shapesIndices) {
-		bool inA = false;
+	for (int i = begin; i < end; ++i) {
+		int idx = indices[i];
 		glm::vec3 center;
 
-		if (auto sphere = dynamic_cast<Sphere*>(scene.shapes[idx].get()))
-			center = sphere->m_center;
-
-		else if (auto wall = dynamic_cast<Wall*>(scene.shapes[idx].get()))
-		{
-			center = (wall->start + wall->end()) * 0.5f;
+		const Shape* shape = scene.shapes[idx].get();
+		switch (shape->type) {
+		case SHAPE_SPHERE: center = static_cast<const Sphere*>(shape)->m_center; break;
+		case SHAPE_WALL: center = (static_cast<const Wall*>(shape)->start + static_cast<const Wall*>(shape)->end()) * 0.5f; break;
+		case SHAPE_TRIANGLE: center = static_cast<const Triangle*>(shape)->center(); break;
+		default: break;
 		}
 
-		else if (auto triangle = dynamic_cast<Triangle*>(scene.shapes[idx].get()))
-			center = triangle->center();
-
-		inA = center[splitAxis] < splitPos;
-		if (inA) {
-			leftNode->box.growToInclude(scene.shapes[idx]);
-			leftNode->shapesIndices.push_back(idx);
+		if (center[splitAxis] < splitPos) {
+			leftBox.growToInclude(scene.shapes[idx]);
+			std::swap(indices[i], indices[middle++]);
 		}
 		else
 		{
-			rightNode->box.growToInclude(scene.shapes[idx]);
-			rightNode->shapesIndices.push_back(idx);
+			rightBox.growToInclude(scene.shapes[idx]);
 		}
 
 	}
 
 	// If one of the child would be empty, no reason to split anymore
-	if (leftNode->shapesIndices.empty() || rightNode->shapesIndices.empty()) {
-		parentNode->leftChild = -1;
-		parentNode->rightChild = -1;
-
+	if (middle == begin || middle == end)
 		return;
+
+	// Depth-first, the left child directly follows its parent
+	FlatNode leftNode;
+	leftNode.boundsMin = leftBox.Min;
+	leftNode.boundsMax = leftBox.Max;
+	leftNode.setLeaf(begin, middle - begin);
+	int leftIdx = static_cast<int>(nodes.size());
+	nodes.push_back(leftNode);
+	split(nodes, indices, leftIdx, depth - 1);
+
+	FlatNode rightNode;
+	rightNode.boundsMin = rightBox.Min;
+	rightNode.boundsMax = rightBox.Max;
+	rightNode.setLeaf(middle, end - middle);
+	int rightIdx = static_cast<int>(nodes.size());
+	nodes.push_back(rightNode);
+	split(nodes, indices, rightIdx, depth - 1);
+
+	nodes[nodeIdx].setInner(leftIdx, rightIdx);
+}
+
+int buildBVH(int maxDepth, const std::string& cachePath) {
+	scene.bvhNodes.clear();
+	scene.bvhIndices.clear();
+	scene.lbvhRanges.clear();
+	scene.lbvhRebuilt.clear();
+	scene.lbvhNodeRanges.clear();
+	scene.bvhCache.close();
+	scene.bvhCacheSavePath.clear();
+	scene.store.build(scene.shapes);
+
+	if (bvhBuilder == LBVH) {
+		buildLBVH();
+		scene.tlas.build(scene.instances);
+		return 0;
+	}
+
+	// Prebuilt BVH for the same input, only the top level BVH is built
+	uint64_t inputHash = 0;
+	if (!cachePath.empty()) {
+		inputHash = bvhInputHash(maxDepth);
+		if (scene.bvhCache.open(cachePath, inputHash, static_cast<int>(scene.shapes.size()), static_cast<int>(scene.instances.size()))) {
+			for (int i = 0; i < scene.instances.size(); ++i) {
+				Instance& instance = scene.instances[i];
+				instance.blasRoot = scene.bvhCache.roots()[i];
+				instance.bounds = BoundingBox();
+				if (instance.blasRoot >= 0) {
+					instance.bounds.Min = scene.bvhCache.nodes()[instance.blasRoot].boundsMin;
+					instance.bounds.Max = scene.bvhCache.nodes()[instance.blasRoot].boundsMax;
+				}
+			}
+			scene.tlas.build(scene.instances);
+			std::cout << "BVH loaded from " << cachePath << std::endl;
+			return 0;
+		}
+		scene.bvhCacheSavePath = cachePath;
+		scene.bvhCacheHash = inputHash;
 	}
 
-	split(leftNode, depth - 1);
-	split(rightNode, depth - 1);
+	// One BVH per instance, all in scene.bvhNodes (root first). Reserved for the largest possible trees,
+	// shapes are partitioned in place and nodes are appended without reallocating
+	size_t maxNodes = 0, maxIndices = 0;
+	for (const Instance& instance : scene.instances) {
+		int count = static_cast<int>(instance.shapeIndices.size());
+		maxNodes += (bvhBuilder == SBVH ? SBVHBuilder::nodeCapacity(count, sbvhParams) : LBVHBuilder::nodeCapacity(count)) + 1;	// + alignment of the root
+		maxIndices += bvhBuilder == SBVH ? SBVHBuilder::indexCapacity(count, sbvhParams) : count;
+	}
+	scene.bvhNodes.reserve(maxNodes);
+	scene.bvhIndices.reserve(maxIndices);
 
-	scene.bvhNodes.push_back(std::move(leftNode));
-	parentNode->leftChild = scene.bvhNodes.size() - 1;
+	SAHBuilder builder(scene.shapes, sahParams, parallelBVHBuild ? &threadPool : nullptr);
+	SBVHBuilder spatialBuilder(scene.shapes, sahParams, sbvhParams);
+	for (Instance& instance : scene.instances) {
+		instance.blasRoot = alignedBVHRoot(static_cast<int>(scene.bvhNodes.size()), bvhLayout);
+		scene.bvhNodes.resize(instance.blasRoot, unusedBVHNode());
 
-	scene.bvhNodes.push_back(std::move(rightNode));
-	parentNode->rightChild = scene.bvhNodes.size() - 1;
+		if (bvhBuilder == BINNED_SAH) {
+			builder.build(scene.bvhNodes, scene.bvhIndices, instance.shapeIndices);
+		}
+		else if (bvhBuilder == SBVH) {
+			spatialBuilder.build(scene.bvhNodes, scene.bvhIndices, instance.shapeIndices);
+		}
+		else {
+			// Create root node
+			BoundingBox bb = BoundingBox();
+			for (int i : instance.shapeIndices)
+				bb.growToInclude(scene.shapes[i]);
+
+			FlatNode root;
+			root.boundsMin = bb.Min;
+			root.boundsMax = bb.Max;
+			root.setLeaf(static_cast<int>(scene.bvhIndices.size()), static_cast<int>(instance.shapeIndices.size()));
+			scene.bvhIndices.insert(scene.bvhIndices.end(), instance.shapeIndices.begin(), instance.shapeIndices.end());
+			scene.bvhNodes.push_back(root);
+
+			split(scene.bvhNodes, scene.bvhIndices, instance.blasRoot, maxDepth);
+		}
+		bvhReorderer.apply(scene.bvhNodes, scene.bvhIndices, instance.blasRoot, bvhLayout);
 
+		instance.bounds = BoundingBox();
+		instance.bounds.Min = scene.bvhNodes[instance.blasRoot].boundsMin;
+		instance.bounds.Max = scene.bvhNodes[instance.blasRoot].boundsMax;
+	}
+
+	scene.tlas.build(scene.instances);
 
+	return 0;
 }
 
-int buildBVH(int maxDepth) {
-	scene.bvhNodes.clear();
+void buildLBVH() {
+	// Fixed ranges per instance, a rebuild of one instance never moves the others
+	std::vector<bool> animated(scene.shapes.size(), false);
+	for (int idx : animatedIndices)
+		animated[idx] = true;
+
+	int nodeCount = 0, indexCount = 0;
+	for (int i = 0; i < scene.instances.size(); ++i) {
+		const Instance& instance = scene.instances[i];
+		LBVHRange range;
+		range.firstNode = alignedBVHRoot(nodeCount, bvhLayout);
+		range.nodeCount = LBVHBuilder::nodeCapacity(static_cast<int>(instance.shapeIndices.size()));
+		range.firstIndex = indexCount;
+		range.indexCount = static_cast<int>(instance.shapeIndices.size());
+		nodeCount = range.firstNode + range.nodeCount;
+		indexCount += range.indexCount;
+		scene.lbvhRanges.push_back(range);
+
+		for (int idx : instance.shapeIndices) {
+			if (animated[idx]) {
+				scene.lbvhRebuilt.push_back(i);
+				scene.lbvhNodeRanges.push_back(glm::ivec2(range.firstNode, range.nodeCount));
+				break;
+			}
+		}
+	}
+
+	scene.bvhNodes.assign(nodeCount, unusedBVHNode());
+	scene.bvhIndices.resize(indexCount);
+	lbvhBuilder.init(sahParams, lbvhParams, parallelBVHBuild ? &threadPool : nullptr);
+	for (int i = 0; i < scene.instances.size(); ++i) {
+		Instance& instance = scene.instances[i];
+		const LBVHRange& range = scene.lbvhRanges[i];
+		instance.blasRoot = lbvhBuilder.build(scene.shapes, instance.shapeIndices, scene.bvhNodes, range.firstNode, scene.bvhIndices, range.firstIndex);
+		bvhReorderer.apply(scene.bvhNodes, scene.bvhIndices, instance.blasRoot, bvhLayout);
+		instance.bounds = BoundingBox();
+		instance.bounds.Min = scene.bvhNodes[instance.blasRoot].boundsMin;
+		instance.bounds.Max = scene.bvhNodes[instance.blasRoot].boundsMax;
+	}
+}
 
-	// Create root node
-	auto root = std::make_unique<Node>();
+const char* bvhBuilderName(BVH_builder builder) {
+	switch (builder) {
+	case MIDPOINT: return "midpoint";
+	case LBVH: return lbvhParams.treeletPasses > 0 ? "LBVH + treelets" : "LBVH";
+	case SBVH: return "SBVH";
+	default: return "binned SAH";
+	}
+}
 
-	BoundingBox bb = BoundingBox();
-	for (int i = 0; i < scene.shapes.size(); ++i) {
-		bb.growToInclude(scene.shapes[i]);
-		root->shapesIndices.push_back(i);
+uint64_t bvhInputHash(int maxDepth) {
+	uint64_t hash = hashBytes(&bvhBuilder, sizeof(bvhBuilder));
+	hash = hashBytes(&bvhLayout, sizeof(bvhLayout), hash);
+	if (bvhBuilder == MIDPOINT) {
+		hash = hashBytes(&maxDepth, sizeof(maxDepth), hash);
+	}
+	else {
+		int params[] = { sahParams.binCount, sahParams.maxLeafSize, sahParams.maxDepth, sahParams.leafBlockSize };
+		float costs[] = { sahParams.traversalCost, sahParams.intersectionCost };
+		hash = hashBytes(params, sizeof(params), hash);
+		hash = hashBytes(costs, sizeof(costs), hash);
+	}
+	if (bvhBuilder == SBVH) {
+		float params[] = { sbvhParams.duplicationBudget, sbvhParams.overlapThreshold, static_cast<float>(sbvhParams.spatialBinCount) };
+		hash = hashBytes(params, sizeof(params), hash);
 	}
 
-	root->box = bb;
+	// The SAH builder sees shape bounds only. The midpoint split partitions triangles by their vertex centroid and the
+	// SBVH clips them by their vertices, so both also depend on the vertices
+	bool triangleVertices = bvhBuilder == MIDPOINT || bvhBuilder == SBVH;
+	for (const auto& shape : scene.shapes) {
+		BoundingBox box;
+		box.growToInclude(shape);
+		float bounds[] = { box.Min.x, box.Min.y, box.Min.z, box.Max.x, box.Max.y, box.Max.z };
+		int type = shape->type;
+		hash = hashBytes(&type, sizeof(type), hash);
+		hash = hashBytes(bounds, sizeof(bounds), hash);
+		if (bvhBuilder == SBVH)
+			hash = hashBytes(&shape->animated, sizeof(shape->animated), hash);	// Animated shapes are not split
+		if (triangleVertices && shape->type == SHAPE_TRIANGLE) {
+			const Triangle& triangle = static_cast<const Triangle&>(*shape);
+			glm::vec3 vertices[] = { triangle.a, triangle.b, triangle.c };
+			hash = hashBytes(vertices, sizeof(vertices), hash);
+		}
+	}
+
+	for (const Instance& instance : scene.instances) {
+		int count = static_cast<int>(instance.shapeIndices.size());
+		hash = hashBytes(&count, sizeof(count), hash);
+		hash = hashBytes(instance.shapeIndices.data(), count * sizeof(int), hash);
+	}
 
-	split(root, maxDepth);
-	scene.bvhNodes.push_back(std::move(root));
+	return hash;
+}
 
-	return 0;
+std::string sceneBVHCachePath() {
+	if (!useBVHCache)
+		return "";
+	if (!sceneFile.empty())
+		return sceneFile + ".bvhcache";
+	if (SCENE == 1 || SCENE == 2)
+		return "models/scene" + std::to_string(SCENE) + ".bvhcache";
+	return "";
 }
 
 
@@ -1207,34 +2523,135 @@ void generateScene3() {
 	auto t = Triangle(origin, origin + glm::vec3(5, 0, 0), origin + glm::vec3(2.5f, -5, 0));
 	scene.shapes.push_back(std::make_unique<Triangle>(t));
 
-	//// Add geometry to embree
-	//RTCGeometry geom = rtcNewGeometry(g_embreeDevice, RTC_GEOMETRY_TYPE_TRIANGLE);
-	//
-	//float* vertices = (float*)rtcSetNewGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, 3 * sizeof(float), 3);
-	//vertices[0] = t.a.x; vertices[1] = t.a.y; vertices[2] = t.a.z;
-	//vertices[3] = t.b.x; vertices[4] = t.b.y; vertices[5] = t.b.z;
-	//vertices[6] = t.c.x; vertices[7] = t.c.y; vertices[8] = t.c.z;
+	scene.camera.LookAt(origin);
+	addWorldInstance();
 
-	//unsigned* indices = (unsigned*)rtcSetNewGeometryBuffer(geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, 3 * sizeof(unsigned), 1);
-	//indices[0] = 0; indices[1] = 1; indices[2] = 2;
+	// Add geometry to embree
+	embreeScene.addTriangle(t, 0);
+	embreeScene.commit();
 
-	/*rtcCommitGeometry(geom);
-	rtcAttachGeometryByID(g_embreeScene, geom, 0);
-	rtcReleaseGeometry(geom);*/
-	rtcCommitScene(g_embreeScene);
+	// BVH traversal finds nothing without an instance, even for a single triangle
+	buildBVH(15);
+}
 
+void generateSyntheticScene(int triangles) {
+	// Camera 
+	scene.camera = Camera();
+	scene.camera.Position = glm::vec3(0, -10.0f, 80);
+	scene.camera.aspectRatio = float(WIDTH) / HEIGHT;
 
-	scene.camera.LookAt(origin);
+	// add light
+	scene.light = Light(glm::vec3(20, -60, 40), glm::vec3(1), 50);
+
+	// Few materials shared by all triangles, like the meshes of the other scenes
+	glm::vec3 palette[8];
+	for (glm::vec3& color : palette)
+		color = glm::vec3(randomFloat01(), randomFloat01(), randomFloat01());
+
+	// Triangles in a cube, their size follows the spacing so the occupancy is similar for any count
+	const float extent = 40;
+	float size = 3 * extent / std::cbrt(float(triangles));
+	for (int i = 0; i < triangles; ++i) {
+		glm::vec3 a(randomFloat(-extent, extent), randomFloat(-extent, extent), randomFloat(-extent, extent));
+		glm::vec3 b = a + size * glm::vec3(randomFloat(-1, 1), randomFloat(-1, 1), randomFloat(-1, 1));
+		glm::vec3 c = a + size * glm::vec3(randomFloat(-1, 1), randomFloat(-1, 1), randomFloat(-1, 1));
+
+		Triangle triangle(a, b, c);
+		embreeScene.addTriangle(triangle, scene.shapes.size());
+		scene.shapes.push_back(std::make_unique<Triangle>(triangle));
+		scene.shapes[scene.shapes.size() - 1]->material.color = palette[i % 8];
+		scene.shapes[scene.shapes.size() - 1]->material.specularStrength = 0.2f;
+	}
+
+	// Bouncing spheres, refitted every frame
+	for (int i = 0; i < 16; ++i) {
+		glm::vec3 center(randomFloat(-extent, extent), randomFloat(-extent, extent), randomFloat(-extent, extent));
+		scene.shapes.push_back(std::make_unique<Sphere>(center, 3.f));
+		scene.shapes[scene.shapes.size() - 1]->material.color = glm::vec3(randomFloat01(), randomFloat01(), randomFloat01());
+		scene.shapes[scene.shapes.size() - 1]->animated = true;
+		animatedIndices.push_back(scene.shapes.size() - 1);
+	}
+
+	scene.camera.LookAt(glm::vec3(0));
+	addWorldInstance();
+
+	// Upload triangles to Embree
+	embreeScene.commit();
 
+	buildBVH(15);
+	std::cout << "shapes: " << scene.shapes.size() << std::endl;
+}
+
+void clearScene() {
+	scene.shapes.clear();
+	scene.bvhNodes.clear();
+	scene.bvhIndices.clear();
+	scene.lbvhRanges.clear();
+	scene.lbvhRebuilt.clear();
+	scene.lbvhNodeRanges.clear();
+	scene.bvhCache.close();
+	scene.bvhCacheSavePath.clear();
+	scene.instances.clear();
+	scene.tlas.build(scene.instances);
+
+	animatedIndices.clear();
+	for (Wheel& wheel : wheels)
+		wheel = Wheel();
+
+	// New Embree scene on the same device
+	embreeScene.init(g_embreeDevice);
+}
+
+void generateSceneFile(const std::string& path) {
+	auto model = Model(path);
+	if (model.meshes.empty()) {
+		std::cout << "No meshes loaded from " << path << std::endl;
+		return;
+	}
+
+	BoundingBox bounds;
+	for (auto& mesh : model.meshes) {
+		auto meshTriangles = mesh.mesh2triangles();
+		embreeScene.addMesh(mesh, scene.shapes.size());
+		addMeshInstance(scene.shapes.size(), meshTriangles.size());
+		for (int i = 0; i < meshTriangles.size(); ++i) {
+			auto triangle = meshTriangles[i];
+			scene.shapes.push_back(std::make_unique<Triangle>(triangle.a, triangle.b, triangle.c));
+			scene.shapes[scene.shapes.size() - 1]->material.color = glm::vec3(0.8f);
+			scene.shapes[scene.shapes.size() - 1]->material.specularStrength = 0;
+		}
+		if (!mesh.vertices.empty()) {
+			bounds.growToInclude(mesh.origin + mesh.boundsMin);
+			bounds.growToInclude(mesh.origin + mesh.boundsMax);
+		}
+		std::cout << "Triangles added: " << meshTriangles.size() << std::endl;
+	}
+
+	// Camera in front of the model, light at the camera
+	glm::vec3 center = (bounds.Min + bounds.Max) * 0.5f;
+	float radius = glm::length(bounds.Max - bounds.Min) * 0.5f;
+
+	scene.camera = Camera();
+	scene.camera.Position = center + glm::vec3(0, 0, 2.f * radius);
+	scene.camera.aspectRatio = float(WIDTH) / HEIGHT;
+	scene.camera.LookAt(center);
+
+	scene.light = Light(scene.camera.Position, glm::vec3(1), 26);
+
+	addWorldInstance();
+	embreeScene.commit();
+
+	buildBVH(15, sceneBVHCachePath());
+	std::cout << "shapes: " << scene.shapes.size() << std::endl;
 }
 
 void initEmbree() {
 	g_embreeDevice = rtcNewDevice(nullptr);
-	g_embreeScene = rtcNewScene(g_embreeDevice);
-	Triangle::setTriangleScene(&g_embreeScene);
+	embreeScene.init(g_embreeDevice);
 }
 
 void cleanupEmbree() {
-	if (g_embreeScene) rtcReleaseScene(g_embreeScene);
+	embreeScene.release();
 	if (g_embreeDevice) rtcReleaseDevice(g_embreeDevice);
+	g_embreeDevice = nullptr;
 }
\ No newline at end of file
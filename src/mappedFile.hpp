@@ -0,0 +1,168 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Read-only memory mapped file, the pages are loaded by the OS on first access
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	// False if the file does not exist, is empty or cannot be mapped
+	bool open(const std::string& path);
+	void close();
+
+	const char* data() const;
+	size_t size() const;
+
+private:
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#else
+	int fd = -1;
+#endif
+	const char* view = nullptr;
+	size_t length = 0;
+};
+
+MappedFile::MappedFile()
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+inline bool MappedFile::open(const std::string& path)
+{
+	close();
+
+#ifdef _WIN32
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+		close();
+		return false;
+	}
+	length = static_cast<size_t>(fileSize.QuadPart);
+
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping)
+		view = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+	fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0) {
+		close();
+		return false;
+	}
+	length = static_cast<size_t>(info.st_size);
+
+	void* address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (address != MAP_FAILED)
+		view = static_cast<const char*>(address);
+#endif
+
+	if (!view) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+inline void MappedFile::close()
+{
+#ifdef _WIN32
+	if (view) UnmapViewOfFile(view);
+	if (mapping) CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+	mapping = NULL;
+	file = INVALID_HANDLE_VALUE;
+#else
+	if (view) munmap(const_cast<char*>(view), length);
+	if (fd >= 0) ::close(fd);
+	fd = -1;
+#endif
+	view = nullptr;
+	length = 0;
+}
+
+inline const char* MappedFile::data() const
+{
+	return view;
+}
+
+inline size_t MappedFile::size() const
+{
+	return length;
+}
+
+// Size and modification time (seconds) of a file, false if it does not exist
+inline bool fileStamp(const std::string& path, uint64_t& size, int64_t& mtime)
+{
+#ifdef _WIN32
+	struct _stat64 info;
+	if (_stat64(path.c_str(), &info) != 0)
+		return false;
+#else
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0)
+		return false;
+#endif
+	size = static_cast<uint64_t>(info.st_size);
+	mtime = static_cast<int64_t>(info.st_mtime);
+	return true;
+}
+
+// 64-bit FNV-1a, pass the previous hash to continue over more data
+inline uint64_t hashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+// Hash of the whole file content, false if it cannot be read
+inline bool hashFile(const std::string& path, uint64_t& hash)
+{
+	MappedFile file;
+	if (!file.open(path))
+		return false;
+	hash = hashBytes(file.data(), file.size());
+	return true;
+}
+
+#endif // !MAPPED_FILE_H
@@ -7,6 +7,7 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include <string>
+#include <utility>
 #include <vector>
 #include "shader.hpp"
 using namespace std;
@@ -41,6 +42,9 @@ public:
     vector<Triangle> mesh2triangles();
 
     glm::vec3 origin = glm::vec3(0);
+    // bounds of the vertex positions (without origin), set by Model
+    glm::vec3 boundsMin = glm::vec3(0);
+    glm::vec3 boundsMax = glm::vec3(0);
 
     // mesh Data
     vector<Vertex>       vertices;
@@ -64,9 +68,9 @@ public:
     Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures)
     {
 
-        this->vertices = vertices;
-        this->indices = indices;
-        this->textures = textures;
+        this->vertices = std::move(vertices);
+        this->indices = std::move(indices);
+        this->textures = std::move(textures);
 
         // now that we have all the required data, set the vertex buffers and its attribute pointers.
         setupMesh();
@@ -164,6 +168,7 @@ inline vector<Triangle> Mesh::mesh2triangles() {
     glm::vec3 center = this->center();
 
     vector<Triangle> triangles;
+    triangles.reserve(indices.size() / 3);
     for (int i = 0; i < indices.size(); i += 3) {
         auto idx = indices[i];
         auto idx2 = indices[i + 1];
@@ -0,0 +1,196 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "mesh.hpp"
+#include "mappedFile.hpp"
+
+// Binary cache of the meshes imported from a model file, stored next to it (models/car.obj -> models/car.obj.meshcache).
+// Holds what the ray tracer uses: positions, normals, indices and bounds of every mesh. The cache is used while size
+// and modification time of the source match; if only the time differs (e.g. a fresh checkout), the content hash decides.
+// Layout: header, one record per mesh, then the arrays (4 byte aligned) at the offsets given by the records.
+
+const char MESH_CACHE_MAGIC[8] = { 'R', 'T', 'M', 'E', 'S', 'H', 0, 0 };
+const uint32_t MESH_CACHE_VERSION = 1;
+
+struct MeshCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t meshCount;
+	uint32_t importFlags;	// Assimp post-processing flags the meshes were imported with
+	uint32_t padding;
+	uint64_t sourceSize;
+	int64_t sourceMtime;
+	uint64_t sourceHash;	// FNV-1a of the source file
+	uint64_t fileSize;		// Whole cache file, catches truncated writes
+};
+
+struct MeshCacheRecord
+{
+	uint32_t vertexCount;
+	uint32_t indexCount;
+	float boundsMin[3];
+	float boundsMax[3];
+	uint64_t positionsOffset;	// vec3 per vertex
+	uint64_t normalsOffset;		// vec3 per vertex
+	uint64_t indicesOffset;		// uint32 per index
+};
+
+inline std::string meshCachePath(const std::string& sourcePath)
+{
+	return sourcePath + ".meshcache";
+}
+
+// Meshes from the cache of given model file, false if there is no valid cache
+inline bool loadMeshCache(const std::string& sourcePath, uint32_t importFlags, std::vector<Mesh>& meshes)
+{
+	uint64_t sourceSize;
+	int64_t sourceMtime;
+	if (!fileStamp(sourcePath, sourceSize, sourceMtime))
+		return false;
+
+	MappedFile file;
+	if (!file.open(meshCachePath(sourcePath)) || file.size() < sizeof(MeshCacheHeader))
+		return false;
+
+	MeshCacheHeader header;
+	std::memcpy(&header, file.data(), sizeof(header));
+	if (std::memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != MESH_CACHE_VERSION
+		|| header.importFlags != importFlags || header.fileSize != file.size() || header.sourceSize != sourceSize)
+		return false;
+
+	if (header.sourceMtime != sourceMtime) {
+		uint64_t hash;
+		if (!hashFile(sourcePath, hash) || hash != header.sourceHash)
+			return false;
+	}
+
+	uint64_t recordsEnd = sizeof(MeshCacheHeader) + uint64_t(header.meshCount) * sizeof(MeshCacheRecord);
+	if (recordsEnd > file.size())
+		return false;
+
+	// Validate all records before creating any mesh
+	std::vector<MeshCacheRecord> records(header.meshCount);
+	if (header.meshCount > 0)
+		std::memcpy(records.data(), file.data() + sizeof(MeshCacheHeader), records.size() * sizeof(MeshCacheRecord));
+	for (const MeshCacheRecord& record : records) {
+		uint64_t vec3Bytes = uint64_t(record.vertexCount) * sizeof(glm::vec3);
+		if (record.positionsOffset + vec3Bytes > file.size() || record.normalsOffset + vec3Bytes > file.size()
+			|| record.indicesOffset + uint64_t(record.indexCount) * sizeof(uint32_t) > file.size())
+			return false;
+	}
+
+	std::vector<Mesh> loaded;
+	loaded.reserve(records.size());
+	for (const MeshCacheRecord& record : records) {
+		const char* positions = file.data() + record.positionsOffset;
+		const char* normals = file.data() + record.normalsOffset;
+
+		vector<Vertex> vertices(record.vertexCount, Vertex());
+		for (uint32_t i = 0; i < record.vertexCount; ++i) {
+			std::memcpy(&vertices[i].Position, positions + i * sizeof(glm::vec3), sizeof(glm::vec3));
+			std::memcpy(&vertices[i].Normal, normals + i * sizeof(glm::vec3), sizeof(glm::vec3));
+		}
+
+		vector<unsigned int> indices(record.indexCount);
+		if (record.indexCount > 0)
+			std::memcpy(indices.data(), file.data() + record.indicesOffset, indices.size() * sizeof(uint32_t));
+		for (unsigned int index : indices) {
+			if (index >= record.vertexCount)
+				return false;
+		}
+
+		loaded.emplace_back(std::move(vertices), std::move(indices), vector<Texture>());
+		loaded.back().boundsMin = glm::vec3(record.boundsMin[0], record.boundsMin[1], record.boundsMin[2]);
+		loaded.back().boundsMax = glm::vec3(record.boundsMax[0], record.boundsMax[1], record.boundsMax[2]);
+	}
+
+	meshes = std::move(loaded);
+	return true;
+}
+
+// Write the cache of given model file, false if it cannot be written (the model is still usable)
+inline bool saveMeshCache(const std::string& sourcePath, uint32_t importFlags, const std::vector<Mesh>& meshes)
+{
+	MeshCacheHeader header;
+	std::memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+	header.version = MESH_CACHE_VERSION;
+	header.meshCount = static_cast<uint32_t>(meshes.size());
+	header.importFlags = importFlags;
+	header.padding = 0;
+	if (!fileStamp(sourcePath, header.sourceSize, header.sourceMtime) || !hashFile(sourcePath, header.sourceHash))
+		return false;
+	// Modified within the timestamp resolution, a later edit could keep the same time, let the hash decide
+	if (static_cast<int64_t>(std::time(nullptr)) - header.sourceMtime < 2)
+		header.sourceMtime = -1;
+
+	// Array offsets after the records, every array size is a multiple of 4 bytes
+	std::vector<MeshCacheRecord> records(meshes.size());
+	uint64_t offset = sizeof(MeshCacheHeader) + records.size() * sizeof(MeshCacheRecord);
+	for (size_t i = 0; i < meshes.size(); ++i) {
+		const Mesh& mesh = meshes[i];
+		MeshCacheRecord& record = records[i];
+		record.vertexCount = static_cast<uint32_t>(mesh.vertices.size());
+		record.indexCount = static_cast<uint32_t>(mesh.indices.size());
+		for (int axis = 0; axis < 3; ++axis) {
+			record.boundsMin[axis] = mesh.boundsMin[axis];
+			record.boundsMax[axis] = mesh.boundsMax[axis];
+		}
+		record.positionsOffset = offset;
+		offset += record.vertexCount * sizeof(glm::vec3);
+		record.normalsOffset = offset;
+		offset += record.vertexCount * sizeof(glm::vec3);
+		record.indicesOffset = offset;
+		offset += record.indexCount * sizeof(uint32_t);
+	}
+	header.fileSize = offset;
+
+	// Written to a temporary file first, a reader never sees a partial cache under the final name
+	std::string path = meshCachePath(sourcePath);
+	std::string tempPath = path + ".tmp";
+	{
+		std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+		if (!out)
+			return false;
+
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		if (!records.empty())
+			out.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(MeshCacheRecord));
+
+		std::vector<glm::vec3> column;
+		for (const Mesh& mesh : meshes) {
+			column.resize(mesh.vertices.size());
+			for (size_t i = 0; i < mesh.vertices.size(); ++i)
+				column[i] = mesh.vertices[i].Position;
+			out.write(reinterpret_cast<const char*>(column.data()), column.size() * sizeof(glm::vec3));
+			for (size_t i = 0; i < mesh.vertices.size(); ++i)
+				column[i] = mesh.vertices[i].Normal;
+			out.write(reinterpret_cast<const char*>(column.data()), column.size() * sizeof(glm::vec3));
+			out.write(reinterpret_cast<const char*>(mesh.indices.data()), mesh.indices.size() * sizeof(uint32_t));
+		}
+
+		if (!out) {
+			out.close();
+			std::remove(tempPath.c_str());
+			return false;
+		}
+	}
+
+	std::remove(path.c_str());	// rename does not replace on Windows
+	if (std::rename(tempPath.c_str(), path.c_str()) != 0) {
+		std::remove(tempPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+#endif // !MESH_CACHE_H
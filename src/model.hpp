@@ -10,6 +10,7 @@
 #include <assimp/postprocess.h>
 
 #include "mesh.hpp"
+#include "meshCache.hpp"
 #include "shader.hpp"
 
 #include <string>
@@ -31,6 +32,11 @@ public:
     string directory;
     bool gammaCorrection;
 
+    // load meshes from the binary cache next to the model file when it is valid, write it after an import (--no-mesh-cache)
+    static bool useCache;
+    // assimp post-processing of the import, part of the cache validation
+    static const unsigned int importFlags = aiProcess_Triangulate | aiProcess_GenSmoothNormals | aiProcess_FlipUVs | aiProcess_CalcTangentSpace | aiProcess_GenBoundingBoxes;
+
     // constructor, expects a filepath to a 3D model.
     Model(string const& path, bool gamma = false) : gammaCorrection(gamma)
     {
@@ -48,20 +54,27 @@ private:
     // loads a model with supported ASSIMP extensions from file and stores the resulting meshes in the meshes vector.
     void loadModel(string const& path)
     {
+        // retrieve the directory path of the filepath
+        directory = path.substr(0, path.find_last_of('/'));
+
+        // cached meshes skip the import
+        if (useCache && loadMeshCache(path, importFlags, meshes))
+            return;
+
         // read file via ASSIMP
         Assimp::Importer importer;
-        const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_GenSmoothNormals | aiProcess_FlipUVs | aiProcess_CalcTangentSpace);
+        const aiScene* scene = importer.ReadFile(path, importFlags);
         // check for errors
         if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) // if is Not Zero
         {
             cout << "ERROR::ASSIMP:: " << importer.GetErrorString() << endl;
             return;
         }
-        // retrieve the directory path of the filepath
-        directory = path.substr(0, path.find_last_of('/'));
-
         // process ASSIMP's root node recursively
         processNode(scene->mRootNode, scene);
+
+        if (useCache && !saveMeshCache(path, importFlags, meshes))
+            cout << "ERROR::MESH_CACHE:: could not write " << meshCachePath(path) << endl;
     }
 
     // processes a node in a recursive fashion. Processes each individual mesh located at the node and repeats this process on its children nodes (if any).
@@ -164,7 +177,10 @@ private:
         textures.insert(textures.end(), heightMaps.begin(), heightMaps.end());
 
         // return a mesh object created from the extracted mesh data
-        return Mesh(vertices, indices, textures);
+        Mesh result(std::move(vertices), std::move(indices), std::move(textures));
+        result.boundsMin = glm::vec3(mesh->mAABB.mMin.x, mesh->mAABB.mMin.y, mesh->mAABB.mMin.z);
+        result.boundsMax = glm::vec3(mesh->mAABB.mMax.x, mesh->mAABB.mMax.y, mesh->mAABB.mMax.z);
+        return result;
     }
 
     // checks all material textures of a given type and loads the textures if they're not loaded yet.
@@ -201,6 +217,6 @@ private:
     }
 };
 
-
+bool Model::useCache = true;
 
 #endif
\ No newline at end of file
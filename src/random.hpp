@@ -0,0 +1,76 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <cstdint>
+
+// PCG32 (XSH RR variant), small state and the same sequence for the same seed on every platform.
+// Generators are cheap to create, every thread or pixel uses its own instead of sharing one.
+class Pcg32
+{
+public:
+	Pcg32(uint64_t seed = 0x853c49e6748fea9bULL, uint64_t stream = 0xda3e39cb94b95bdbULL);
+
+	// Different streams give independent sequences for the same seed
+	void seed(uint64_t seed, uint64_t stream = 0xda3e39cb94b95bdbULL);
+
+	uint32_t nextUint();
+	float nextFloat();						// [0, 1)
+	float nextFloat(float min, float max);	// [min, max)
+
+private:
+	uint64_t state = 0;
+	uint64_t inc = 1;
+};
+
+// Stateless hash (PCG RXS-M-XS), seeds from pixel and sample indices. Same as pcgHash in the compute shader.
+uint32_t pcgHash(uint32_t value);
+float hashToFloat(uint32_t hash);			// [0, 1)
+
+Pcg32::Pcg32(uint64_t seedValue, uint64_t stream)
+{
+	seed(seedValue, stream);
+}
+
+inline void Pcg32::seed(uint64_t seedValue, uint64_t stream)
+{
+	state = 0;
+	inc = (stream << 1) | 1;
+	nextUint();
+	state += seedValue;
+	nextUint();
+}
+
+inline uint32_t Pcg32::nextUint()
+{
+	uint64_t old = state;
+	state = old * 6364136223846793005ULL + inc;
+
+	uint32_t xorShifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+	uint32_t rotation = static_cast<uint32_t>(old >> 59);
+	return (xorShifted >> rotation) | (xorShifted << ((32 - rotation) & 31));
+}
+
+inline float Pcg32::nextFloat()
+{
+	return hashToFloat(nextUint());
+}
+
+inline float Pcg32::nextFloat(float min, float max)
+{
+	return min + (max - min) * nextFloat();
+}
+
+inline uint32_t pcgHash(uint32_t value)
+{
+	uint32_t state = value * 747796405u + 2891336453u;
+	uint32_t word = ((state >> ((state >> 28) + 4)) ^ state) * 277803737u;
+	return (word >> 22) ^ word;
+}
+
+inline float hashToFloat(uint32_t hash)
+{
+	// Top 24 bits, exactly representable, never 1
+	return (hash >> 8) * (1.f / 16777216.f);
+}
+
+#endif // !RANDOM_H
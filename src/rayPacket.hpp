@@ -0,0 +1,281 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "flatStructures.hpp"
+#include "ray.hpp"
+#include "simd.hpp"
+#include "shapeStore.hpp"
+#include "bvh.hpp"
+#include "tlas.hpp"
+
+// Packets of coherent rays (primary rays of neighbouring pixels) traced through the binary BVH together.
+// Every node is fetched once per packet: a conservative interval test over the whole packet culls it first,
+// then the boxes are tested for all rays with SIMD, and a 64 bit lane mask carries the rays that entered the node.
+// Leaves are tested ray by ray (with the triangle blocks). Once only a few rays are left in a node, the packet
+// is no longer coherent there and the rays continue alone through the subtree (wide BVH if available).
+// Results are the same closest hits as intersectTLAS.
+
+const int MAX_PACKET_RAYS = 64;	// 8x8 pixels
+const int MIN_PACKET_RAYS = 4;	// Fewer active rays in a node continue as single rays
+
+struct RayPacket
+{
+	int count = 0;
+
+	// Rays in SoA form, padded to whole SIMD vectors
+	float ox[MAX_PACKET_RAYS], oy[MAX_PACKET_RAYS], oz[MAX_PACKET_RAYS];
+	float dx[MAX_PACKET_RAYS], dy[MAX_PACKET_RAYS], dz[MAX_PACKET_RAYS];
+	float ix[MAX_PACKET_RAYS], iy[MAX_PACKET_RAYS], iz[MAX_PACKET_RAYS];	// 1 / direction
+	float dist[MAX_PACKET_RAYS];	// Closest hit so far, negative for padding (never enters a node)
+
+	BVHHit hits[MAX_PACKET_RAYS];
+
+	// Bounds of origins and inverse directions, valid for the interval test if coherent
+	bool coherent = false;
+	glm::vec3 originMin, originMax;
+	glm::vec3 invDirMin, invDirMax;
+
+	void add(Ray ray, const BVHHit& hit = BVHHit());
+	void finish();	// After the last add, pads the packet and computes the bounds
+	uint64_t allRays() const;
+
+	Ray ray(int i) const;
+};
+
+inline void RayPacket::add(Ray ray, const BVHHit& hit)
+{
+	glm::vec3 start = ray.get_start();
+	glm::vec3 dir = ray.get_dir();
+	glm::vec3 invDir = 1.f / dir;
+
+	ox[count] = start.x; oy[count] = start.y; oz[count] = start.z;
+	dx[count] = dir.x; dy[count] = dir.y; dz[count] = dir.z;
+	ix[count] = invDir.x; iy[count] = invDir.y; iz[count] = invDir.z;
+	hits[count] = hit;
+	dist[count] = hit.dist;
+	count++;
+}
+
+inline void RayPacket::finish()
+{
+	originMin = invDirMin = glm::vec3(std::numeric_limits<float>::max());
+	originMax = invDirMax = glm::vec3(-std::numeric_limits<float>::max());
+	for (int i = 0; i < count; ++i) {
+		originMin = glm::min(originMin, glm::vec3(ox[i], oy[i], oz[i]));
+		originMax = glm::max(originMax, glm::vec3(ox[i], oy[i], oz[i]));
+		invDirMin = glm::min(invDirMin, glm::vec3(ix[i], iy[i], iz[i]));
+		invDirMax = glm::max(invDirMax, glm::vec3(ix[i], iy[i], iz[i]));
+	}
+
+	// Interval test needs finite inverse directions of the same sign on every axis
+	coherent = count > 0;
+	for (int axis = 0; axis < 3; ++axis) {
+		bool sameSign = invDirMin[axis] > 0 || invDirMax[axis] < 0;
+		bool finite = invDirMin[axis] > -std::numeric_limits<float>::max() && invDirMax[axis] < std::numeric_limits<float>::max();
+		coherent = coherent && sameSign && finite;
+	}
+
+	for (int i = count; i < (count + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH; ++i) {
+		ox[i] = oy[i] = oz[i] = 0.f;
+		dx[i] = dy[i] = dz[i] = 1.f;
+		ix[i] = iy[i] = iz[i] = 1.f;
+		dist[i] = -1.f;
+	}
+}
+
+inline uint64_t RayPacket::allRays() const
+{
+	return count >= 64 ? ~0ULL : (1ULL << count) - 1;
+}
+
+inline Ray RayPacket::ray(int i) const
+{
+	return Ray(glm::vec3(ox[i], oy[i], oz[i]), glm::vec3(dx[i], dy[i], dz[i]));
+}
+
+inline int popCount(uint64_t bits)
+{
+	int count = 0;
+	for (; bits; bits &= bits - 1)
+		count++;
+	return count;
+}
+
+// Conservative test of the whole packet, false if no ray of the packet can enter the box
+inline bool packetMayHitBox(const RayPacket& packet, const glm::vec3& boxMin, const glm::vec3& boxMax, float maxDist)
+{
+	if (!packet.coherent) return true;
+
+	float tNear = -std::numeric_limits<float>::max();
+	float tFar = std::numeric_limits<float>::max();
+	for (int axis = 0; axis < 3; ++axis) {
+		// Near and far plane by the shared direction sign, distances as intervals over all origins and directions
+		bool positive = packet.invDirMin[axis] > 0;
+		float nearPlane = positive ? boxMin[axis] : boxMax[axis];
+		float farPlane = positive ? boxMax[axis] : boxMin[axis];
+
+		float n0 = (nearPlane - packet.originMin[axis]) * packet.invDirMin[axis];
+		float n1 = (nearPlane - packet.originMin[axis]) * packet.invDirMax[axis];
+		float n2 = (nearPlane - packet.originMax[axis]) * packet.invDirMin[axis];
+		float n3 = (nearPlane - packet.originMax[axis]) * packet.invDirMax[axis];
+		float f0 = (farPlane - packet.originMin[axis]) * packet.invDirMin[axis];
+		float f1 = (farPlane - packet.originMin[axis]) * packet.invDirMax[axis];
+		float f2 = (farPlane - packet.originMax[axis]) * packet.invDirMin[axis];
+		float f3 = (farPlane - packet.originMax[axis]) * packet.invDirMax[axis];
+
+		tNear = glm::max(tNear, glm::min(glm::min(n0, n1), glm::min(n2, n3)));
+		tFar = glm::min(tFar, glm::max(glm::max(f0, f1), glm::max(f2, f3)));
+	}
+
+	return tNear <= tFar && tFar > 0.f && tNear <= maxDist;
+}
+
+// Rays of mask entering the box before their closest hit, nearest entry distance in tEntry
+inline uint64_t packetHitsBox(const RayPacket& packet, uint64_t mask, const glm::vec3& boxMin, const glm::vec3& boxMax, float& tEntry)
+{
+	const SimdFloat zero = simdSet(0.f);
+	const SimdFloat minX = simdSet(boxMin.x), minY = simdSet(boxMin.y), minZ = simdSet(boxMin.z);
+	const SimdFloat maxX = simdSet(boxMax.x), maxY = simdSet(boxMax.y), maxZ = simdSet(boxMax.z);
+
+	uint64_t hits = 0;
+	SimdFloat nearest = simdSet(std::numeric_limits<float>::max());
+	for (int i = 0; i < packet.count; i += SIMD_WIDTH) {
+		if (!(mask >> i & ((1ULL << SIMD_WIDTH) - 1))) continue;
+
+		SimdFloat ox = simdLoad(packet.ox + i), oy = simdLoad(packet.oy + i), oz = simdLoad(packet.oz + i);
+		SimdFloat ix = simdLoad(packet.ix + i), iy = simdLoad(packet.iy + i), iz = simdLoad(packet.iz + i);
+		SimdFloat tx0 = (minX - ox) * ix, tx1 = (maxX - ox) * ix;
+		SimdFloat ty0 = (minY - oy) * iy, ty1 = (maxY - oy) * iy;
+		SimdFloat tz0 = (minZ - oz) * iz, tz1 = (maxZ - oz) * iz;
+
+		SimdFloat tMin = simdMax(simdMax(simdMin(tx0, tx1), simdMin(ty0, ty1)), simdMin(tz0, tz1));
+		SimdFloat tMax = simdMin(simdMin(simdMax(tx0, tx1), simdMax(ty0, ty1)), simdMax(tz0, tz1));
+		SimdFloat inside = (tMax >= tMin) & (tMax > zero) & (tMin <= simdLoad(packet.dist + i));
+
+		uint64_t laneHits = static_cast<uint64_t>(simdMask(inside)) << i & mask;
+		if (!laneHits) continue;
+		hits |= laneHits;
+
+		// Entry distance of rays that hit, others stay at max
+		SimdFloat far = simdSet(std::numeric_limits<float>::max());
+		nearest = simdMin(nearest, (inside & tMin) | andNot(inside, far));
+	}
+
+	float lanes[SIMD_WIDTH];
+	simdStore(lanes, nearest);
+	tEntry = lanes[0];
+	for (int i = 1; i < SIMD_WIDTH; ++i)
+		tEntry = glm::min(tEntry, lanes[i]);
+	return hits;
+}
+
+// Shared traversal of a binary BVH (BLAS or TLAS). subtree(nodeIdx, mask) is called with the rays that reached
+// a leaf, or an inner node entered by fewer than minRays rays, and traces them through the rest of it.
+template <typename SubtreeFunc>
+inline void traversePacket(const std::vector<FlatNode>& nodes, int root, RayPacket& packet, uint64_t mask, int minRays, SubtreeFunc subtree)
+{
+	if (root < 0 || !mask) return;
+
+	// Farthest closest hit of the packet, nodes entered after it by every ray are skipped
+	auto packetFar = [&packet](uint64_t rays) {
+		float far = -1.f;
+		for (int i = 0; i < packet.count; ++i) {
+			if (rays >> i & 1) far = glm::max(far, packet.dist[i]);
+		}
+		return far;
+	};
+
+	int stack[BVH_STACK_SIZE];
+	uint64_t stackMask[BVH_STACK_SIZE];
+	float stackT[BVH_STACK_SIZE];
+	int stackIdx = 0;
+
+	float tEntry;
+	if (!packetMayHitBox(packet, nodes[root].boundsMin, nodes[root].boundsMax, packetFar(mask)))
+		return;
+	mask = packetHitsBox(packet, mask, nodes[root].boundsMin, nodes[root].boundsMax, tEntry);
+	if (!mask) return;
+	stack[stackIdx] = root;
+	stackMask[stackIdx] = mask;
+	stackT[stackIdx++] = tEntry;
+
+	while (stackIdx > 0) {
+		--stackIdx;
+		uint64_t rays = stackMask[stackIdx];
+		if (stackT[stackIdx] > packetFar(rays))
+			continue;
+		const FlatNode& node = nodes[stack[stackIdx]];
+
+		if (node.isLeaf() || popCount(rays) < minRays) {
+			subtree(stack[stackIdx], rays);
+			continue;
+		}
+
+		// Children entered by some ray, the nearer one is pushed last (visited first)
+		int childIdx[2] = { node.leftChild(), node.rightChild() };
+		uint64_t childMask[2] = { 0, 0 };
+		float childT[2] = { 0.f, 0.f };
+		float far = packetFar(rays);
+		for (int c = 0; c < 2; ++c) {
+			const FlatNode& child = nodes[childIdx[c]];
+			if (packetMayHitBox(packet, child.boundsMin, child.boundsMax, far))
+				childMask[c] = packetHitsBox(packet, rays, child.boundsMin, child.boundsMax, childT[c]);
+		}
+
+		int first = childT[1] < childT[0] ? 1 : 0;
+		for (int c : { 1 - first, first }) {
+			if (!childMask[c]) continue;
+			stack[stackIdx] = childIdx[c];
+			stackMask[stackIdx] = childMask[c];
+			stackT[stackIdx++] = childT[c];
+		}
+	}
+}
+
+// Closest hits of all rays of the packet over all instances, hit points in world space (like intersectTLAS)
+inline void intersectPacketTLAS(const std::vector<FlatNode>& tlasNodes, const std::vector<Instance>& instances,
+	const std::vector<FlatNode>& nodes, const std::vector<int>& indices, const ShapeStore& store, const WideBVH* wide, RayPacket& packet)
+{
+	if (tlasNodes.empty()) return;
+
+	// Instances are few, the whole packet visits every instance leaf it reaches
+	traversePacket(tlasNodes, static_cast<int>(tlasNodes.size()) - 1, packet, packet.allRays(), 0, [&](int tlasIdx, uint64_t rays) {
+		const Instance& instance = instances[tlasNodes[tlasIdx].startShapeIdx()];
+
+		// Rays in object space, hits so far are kept for culling
+		RayPacket local;
+		for (int i = 0; i < packet.count; ++i)
+			local.add(instance.toObject(packet.ray(i)), packet.hits[i]);
+		local.finish();
+
+		traversePacket(nodes, instance.blasRoot, local, rays, MIN_PACKET_RAYS, [&](int nodeIdx, uint64_t nodeRays) {
+			int wideRoot = wide ? wide->rootOf(nodeIdx) : -1;
+			for (int i = 0; i < local.count; ++i) {
+				if (!(nodeRays >> i & 1)) continue;
+
+				Ray ray = local.ray(i);
+				if (nodes[nodeIdx].isLeaf())
+					intersectLeaf(nodes, indices, store, nodeIdx, ray.get_start(), ray.get_dir(), local.hits[i], nullptr);
+				else if (wideRoot >= 0)
+					intersectWideBVH(*wide, nodes, indices, store, ray, local.hits[i], wideRoot);
+				else
+					intersectBVH(nodes, indices, store, ray, local.hits[i], nodeIdx);
+				local.dist[i] = local.hits[i].dist;
+			}
+		});
+
+		for (int i = 0; i < packet.count; ++i) {
+			if (!(rays >> i & 1) || !(local.hits[i].dist < packet.hits[i].dist)) continue;
+
+			packet.hits[i] = local.hits[i];
+			packet.hits[i].point = instance.pointToWorld(local.hits[i].point);
+			packet.dist[i] = packet.hits[i].dist;
+		}
+	});
+}
+
+#endif // !RAY_PACKET_H
@@ -0,0 +1,477 @@
+#ifndef SBVH_H
+#define SBVH_H
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <vector>
+#include "flatStructures.hpp"
+#include "shapes/shape.hpp"
+#include "shapes/triangle.hpp"
+#include "BoundingBox.hpp"
+#include "bvh.hpp"
+
+// Spatial split BVH builder (SBVH) for scenes with large or long thin shapes, whose boxes overlap badly under object
+// splits. Every node is split like the binned SAH builder (object split by centroids), and when the children of that
+// split overlap, a spatial split is binned too: shape references are clipped at the bin planes, a reference crossing
+// the chosen plane goes to both children with its box cut at the plane. References are only duplicated when it pays
+// off (reference unsplitting) and while the duplication budget lasts.
+// The output is the usual flat BVH: nodes in depth-first order, root first, and the shape indices of the leaves.
+// A shape can be referenced by several leaves, so an instance BVH has at least one index per shape.
+
+// Parameters of the spatial splits (leaf sizes, costs and object split bins come from SAHBuildParams)
+struct SBVHParams
+{
+	float duplicationBudget = 0.3f;	// Extra references per shape, 0.3 allows 30% more indices than shapes
+	float overlapThreshold = 1e-5f;	// Spatial splits are tried when the object split children overlap by more than
+									// this part of the root area
+	int spatialBinCount = 32;		// Bins per axis, split candidates are the planes between bins
+};
+
+class SBVHBuilder
+{
+public:
+	SBVHBuilder(const std::vector<std::unique_ptr<Shape>>& shapes, const SAHBuildParams& params, const SBVHParams& sbvhParams);
+	~SBVHBuilder();
+
+	// Build BVH over given shapes, appends nodes (root first) and the shape indices of their leaves.
+	// Animated shapes are never split, a clipped box would not follow the shape when it is refitted.
+	void build(std::vector<FlatNode>& nodes, std::vector<int>& indices, const std::vector<int>& shapeIndices);
+
+	// Most nodes and indices a BVH over count shapes can take
+	static int nodeCapacity(int count, const SBVHParams& sbvhParams);
+	static int indexCapacity(int count, const SBVHParams& sbvhParams);
+
+private:
+	// Shape with the part of its box inside the node
+	struct Reference {
+		int shape = -1;
+		BoundingBox box;
+	};
+
+	struct Bin {
+		BoundingBox box;
+		int count = 0;
+	};
+
+	// References enter the spatial bin of their box minimum and exit the bin of their maximum
+	struct SpatialBin {
+		BoundingBox box;
+		int entries = 0;
+		int exits = 0;
+	};
+
+	// Best split of a node. Object splits have an axis -1 if the references are halved, spatial splits a plane
+	struct SplitChoice {
+		bool spatial = false;
+		int axis = -1;
+		int bin = -1;
+		float cost = std::numeric_limits<float>::max();
+		BoundingBox centroidBox;	// Object split
+		BoundingBox left, right;	// Bounds of the children
+		int leftCount = 0;
+		int rightCount = 0;
+	};
+
+	void split(std::vector<FlatNode>& nodes, std::vector<int>& indices, int nodeIdx, std::vector<Reference>& refs,
+		const BoundingBox& box, int depth);
+	void findObjectSplit(const std::vector<Reference>& refs, const BoundingBox& box, SplitChoice& choice);
+	void findSpatialSplit(const std::vector<Reference>& refs, const BoundingBox& box, SplitChoice& choice);
+	void partitionObject(std::vector<Reference>& refs, const SplitChoice& choice, std::vector<Reference>& left, std::vector<Reference>& right) const;
+	void partitionSpatial(std::vector<Reference>& refs, const BoundingBox& box, SplitChoice choice, std::vector<Reference>& left, std::vector<Reference>& right);
+
+	// Parts of a reference on both sides of the plane at position on axis
+	void splitReference(const Reference& ref, int axis, float position, BoundingBox& left, BoundingBox& right) const;
+	int spatialBinIndex(float coordinate, int axis, const BoundingBox& box) const;
+	float splitCost(const BoundingBox& left, int leftCount, const BoundingBox& right, int rightCount, float parentArea) const;
+
+	const std::vector<std::unique_ptr<Shape>>& shapes;
+	SAHBuildParams params;
+	SBVHParams sbvhParams;
+
+	float rootArea = 0.f;
+	int referenceCount = 0;
+	int referenceLimit = 0;
+
+	std::vector<Bin> bins;
+	std::vector<SpatialBin> spatialBins;
+	std::vector<BoundingBox> rightBoxes;
+	std::vector<int> rightCounts;
+};
+
+SBVHBuilder::SBVHBuilder(const std::vector<std::unique_ptr<Shape>>& shapes, const SAHBuildParams& params, const SBVHParams& sbvhParams)
+	: shapes(shapes), params(params), sbvhParams(sbvhParams)
+{
+	this->params.binCount = glm::max(params.binCount, 2);
+	this->params.maxLeafSize = glm::max(params.maxLeafSize, 1);
+	this->params.leafBlockSize = glm::max(params.leafBlockSize, 1);
+	this->sbvhParams.spatialBinCount = glm::max(sbvhParams.spatialBinCount, 2);
+	this->sbvhParams.duplicationBudget = glm::max(sbvhParams.duplicationBudget, 0.f);
+}
+
+SBVHBuilder::~SBVHBuilder()
+{
+}
+
+inline int SBVHBuilder::indexCapacity(int count, const SBVHParams& sbvhParams)
+{
+	return count + static_cast<int>(count * glm::max(sbvhParams.duplicationBudget, 0.f));
+}
+
+inline int SBVHBuilder::nodeCapacity(int count, const SBVHParams& sbvhParams)
+{
+	return glm::max(2 * indexCapacity(count, sbvhParams) - 1, 1);
+}
+
+inline void SBVHBuilder::build(std::vector<FlatNode>& nodes, std::vector<int>& indices, const std::vector<int>& shapeIndices)
+{
+	int count = static_cast<int>(shapeIndices.size());
+	std::vector<Reference> refs(count);
+	BoundingBox box;
+	for (int i = 0; i < count; ++i) {
+		refs[i].shape = shapeIndices[i];
+		refs[i].box.growToInclude(shapes[shapeIndices[i]]);
+		box.growToInclude(refs[i].box);
+	}
+
+	rootArea = box.area();
+	referenceCount = count;
+	referenceLimit = indexCapacity(count, sbvhParams);
+
+	int rootIdx = static_cast<int>(nodes.size());
+	nodes.push_back(FlatNode());
+	split(nodes, indices, rootIdx, refs, box, 0);
+}
+
+inline void SBVHBuilder::split(std::vector<FlatNode>& nodes, std::vector<int>& indices, int nodeIdx, std::vector<Reference>& refs,
+	const BoundingBox& box, int depth)
+{
+	int count = static_cast<int>(refs.size());
+	nodes[nodeIdx].boundsMin = box.Min;
+	nodes[nodeIdx].boundsMax = box.Max;
+
+	SplitChoice choice;
+	bool leaf = count <= 1 || depth >= params.maxDepth;
+	if (!leaf) {
+		findObjectSplit(refs, box, choice);
+
+		// Spatial splits only where the object split leaves overlapping children (or finds no split at all)
+		BoundingBox overlap;
+		overlap.Min = glm::max(choice.left.Min, choice.right.Min);
+		overlap.Max = glm::min(choice.left.Max, choice.right.Max);
+		bool overlapping = choice.axis == -1 || (rootArea > 0.f && overlap.area() / rootArea > sbvhParams.overlapThreshold);
+		if (overlapping && referenceCount < referenceLimit)
+			findSpatialSplit(refs, box, choice);
+
+		// Keep small nodes as leaves when splitting does not pay off
+		leaf = count <= params.maxLeafSize && (choice.axis == -1 || sahIntersectionCost(params, count) <= choice.cost);
+	}
+
+	if (leaf) {
+		nodes[nodeIdx].setLeaf(static_cast<int>(indices.size()), count);
+		for (const Reference& ref : refs)
+			indices.push_back(ref.shape);
+		std::vector<Reference>().swap(refs);
+		return;
+	}
+
+	std::vector<Reference> left, right;
+	if (choice.spatial) {
+		partitionSpatial(refs, box, choice, left, right);
+
+		// Every reference went to one side (nothing was copied), the object split is taken instead
+		if (left.empty() || right.empty()) {
+			left.clear();
+			right.clear();
+			findObjectSplit(refs, box, choice);
+		}
+	}
+	if (left.empty() && right.empty())
+		partitionObject(refs, choice, left, right);
+	std::vector<Reference>().swap(refs);
+
+	BoundingBox leftBox, rightBox;
+	for (const Reference& ref : left)
+		leftBox.growToInclude(ref.box);
+	for (const Reference& ref : right)
+		rightBox.growToInclude(ref.box);
+
+	// Depth-first, the left child directly follows its parent
+	int leftIdx = static_cast<int>(nodes.size());
+	nodes.push_back(FlatNode());
+	split(nodes, indices, leftIdx, left, leftBox, depth + 1);
+
+	int rightIdx = static_cast<int>(nodes.size());
+	nodes.push_back(FlatNode());
+	split(nodes, indices, rightIdx, right, rightBox, depth + 1);
+
+	nodes[nodeIdx].setInner(leftIdx, rightIdx);
+}
+
+inline float SBVHBuilder::splitCost(const BoundingBox& left, int leftCount, const BoundingBox& right, int rightCount, float parentArea) const
+{
+	return params.traversalCost + (left.area() * sahIntersectionCost(params, leftCount) +
+		right.area() * sahIntersectionCost(params, rightCount)) / parentArea;
+}
+
+inline void SBVHBuilder::findObjectSplit(const std::vector<Reference>& refs, const BoundingBox& box, SplitChoice& choice)
+{
+	// Same binning as SAHBuilder, over the centroids of the (clipped) reference boxes
+	auto centroid = [](const Reference& ref) {
+		return ref.box.isEmpty() ? glm::vec3(0) : ref.box.center();
+	};
+	auto binIndex = [&](const glm::vec3& c, int axis) {
+		float extent = choice.centroidBox.Max[axis] - choice.centroidBox.Min[axis];
+		int bin = static_cast<int>((c[axis] - choice.centroidBox.Min[axis]) / extent * params.binCount);
+		return glm::clamp(bin, 0, params.binCount - 1);
+	};
+
+	choice = SplitChoice();
+	for (const Reference& ref : refs)
+		choice.centroidBox.growToInclude(centroid(ref));
+
+	bins.assign(3 * params.binCount, Bin());
+	rightBoxes.resize(params.binCount);
+	rightCounts.resize(params.binCount);
+	float parentArea = glm::max(box.area(), std::numeric_limits<float>::min());
+
+	for (int axis = 0; axis < 3; ++axis) {
+		if (choice.centroidBox.Max[axis] - choice.centroidBox.Min[axis] <= 0.f)
+			continue;
+
+		Bin* axisBins = &bins[axis * params.binCount];
+		for (const Reference& ref : refs) {
+			Bin& bin = axisBins[binIndex(centroid(ref), axis)];
+			bin.box.growToInclude(ref.box);
+			bin.count++;
+		}
+
+		// Sweep from the right, then from the left evaluating split after bin i
+		BoundingBox rightBox;
+		int n = 0;
+		for (int i = params.binCount - 1; i > 0; --i) {
+			rightBox.growToInclude(axisBins[i].box);
+			n += axisBins[i].count;
+			rightBoxes[i] = rightBox;
+			rightCounts[i] = n;
+		}
+
+		BoundingBox leftBox;
+		n = 0;
+		for (int i = 0; i < params.binCount - 1; ++i) {
+			leftBox.growToInclude(axisBins[i].box);
+			n += axisBins[i].count;
+			if (n == 0 || rightCounts[i + 1] == 0) continue;
+
+			float cost = splitCost(leftBox, n, rightBoxes[i + 1], rightCounts[i + 1], parentArea);
+			if (cost < choice.cost) {
+				choice.cost = cost;
+				choice.axis = axis;
+				choice.bin = i;
+				choice.left = leftBox;
+				choice.right = rightBoxes[i + 1];
+				choice.leftCount = n;
+				choice.rightCount = rightCounts[i + 1];
+			}
+		}
+	}
+}
+
+inline int SBVHBuilder::spatialBinIndex(float coordinate, int axis, const BoundingBox& box) const
+{
+	float extent = box.Max[axis] - box.Min[axis];
+	int bin = static_cast<int>((coordinate - box.Min[axis]) / extent * sbvhParams.spatialBinCount);
+	return glm::clamp(bin, 0, sbvhParams.spatialBinCount - 1);
+}
+
+inline void SBVHBuilder::findSpatialSplit(const std::vector<Reference>& refs, const BoundingBox& box, SplitChoice& choice)
+{
+	int binCount = sbvhParams.spatialBinCount;
+	int count = static_cast<int>(refs.size());
+	spatialBins.assign(3 * binCount, SpatialBin());
+	rightBoxes.resize(binCount);
+	rightCounts.resize(binCount);
+	float parentArea = glm::max(box.area(), std::numeric_limits<float>::min());
+
+	for (int axis = 0; axis < 3; ++axis) {
+		float extent = box.Max[axis] - box.Min[axis];
+		if (extent <= 0.f)
+			continue;
+
+		// Every reference is chopped at the planes of the bins it spans, each piece grows its own bin
+		SpatialBin* axisBins = &spatialBins[axis * binCount];
+		for (const Reference& ref : refs) {
+			if (ref.box.isEmpty()) {
+				axisBins[0].entries++;
+				axisBins[0].exits++;
+				continue;
+			}
+
+			int first = spatialBinIndex(ref.box.Min[axis], axis, box);
+			int last = glm::max(spatialBinIndex(ref.box.Max[axis], axis, box), first);
+			if (shapes[ref.shape]->animated)
+				last = first;	// Never split, binned by its minimum like a whole box
+
+			Reference piece = ref;
+			for (int i = first; i < last; ++i) {
+				BoundingBox leftPart, rightPart;
+				splitReference(piece, axis, box.Min[axis] + extent * (i + 1) / binCount, leftPart, rightPart);
+				axisBins[i].box.growToInclude(leftPart);
+				piece.box = rightPart;
+			}
+			axisBins[last].box.growToInclude(piece.box);
+			axisBins[first].entries++;
+			axisBins[last].exits++;
+		}
+
+		BoundingBox rightBox;
+		int n = 0;
+		for (int i = binCount - 1; i > 0; --i) {
+			rightBox.growToInclude(axisBins[i].box);
+			n += axisBins[i].exits;
+			rightBoxes[i] = rightBox;
+			rightCounts[i] = n;
+		}
+
+		BoundingBox leftBox;
+		n = 0;
+		for (int i = 0; i < binCount - 1; ++i) {
+			leftBox.growToInclude(axisBins[i].box);
+			n += axisBins[i].entries;
+			if (n == 0 || rightCounts[i + 1] == 0) continue;
+
+			// Crossing references are counted on both sides, the budget limits their copies
+			if (referenceCount + n + rightCounts[i + 1] - count > referenceLimit) continue;
+
+			float cost = splitCost(leftBox, n, rightBoxes[i + 1], rightCounts[i + 1], parentArea);
+			if (cost < choice.cost) {
+				choice.spatial = true;
+				choice.cost = cost;
+				choice.axis = axis;
+				choice.bin = i;
+				choice.left = leftBox;
+				choice.right = rightBoxes[i + 1];
+				choice.leftCount = n;
+				choice.rightCount = rightCounts[i + 1];
+			}
+		}
+	}
+}
+
+inline void SBVHBuilder::partitionObject(std::vector<Reference>& refs, const SplitChoice& choice, std::vector<Reference>& left, std::vector<Reference>& right) const
+{
+	int count = static_cast<int>(refs.size());
+	for (int i = 0; i < count; ++i) {
+		bool goesLeft;
+		if (choice.axis != -1) {
+			glm::vec3 c = refs[i].box.isEmpty() ? glm::vec3(0) : refs[i].box.center();
+			float extent = choice.centroidBox.Max[choice.axis] - choice.centroidBox.Min[choice.axis];
+			int bin = static_cast<int>((c[choice.axis] - choice.centroidBox.Min[choice.axis]) / extent * params.binCount);
+			goesLeft = glm::clamp(bin, 0, params.binCount - 1) <= choice.bin;
+		}
+		else {
+			goesLeft = i < count / 2; // All centroids are in one point, split the list in half
+		}
+		(goesLeft ? left : right).push_back(refs[i]);
+	}
+}
+
+inline void SBVHBuilder::partitionSpatial(std::vector<Reference>& refs, const BoundingBox& box, SplitChoice choice,
+	std::vector<Reference>& left, std::vector<Reference>& right)
+{
+	int axis = choice.axis;
+	float position = box.Min[axis] + (box.Max[axis] - box.Min[axis]) * (choice.bin + 1) / sbvhParams.spatialBinCount;
+
+	// Sides are decided by the same bins as the evaluation
+	std::vector<int> crossing;
+	for (int i = 0; i < refs.size(); ++i) {
+		const Reference& ref = refs[i];
+		if (ref.box.isEmpty()) {
+			left.push_back(ref);
+			continue;
+		}
+		int first = spatialBinIndex(ref.box.Min[axis], axis, box);
+		int last = shapes[ref.shape]->animated ? first : glm::max(spatialBinIndex(ref.box.Max[axis], axis, box), first);
+		if (last <= choice.bin)
+			left.push_back(ref);
+		else if (first > choice.bin)
+			right.push_back(ref);
+		else
+			crossing.push_back(i);
+	}
+
+	// A crossing reference is kept whole on one side when that is cheaper than a copy on both (unsplitting).
+	// Costs compare area * count, as the split cost does without the constant terms
+	for (int i : crossing) {
+		const Reference& ref = refs[i];
+		BoundingBox leftPart, rightPart;
+		splitReference(ref, axis, position, leftPart, rightPart);
+
+		BoundingBox leftWhole = choice.left, rightWhole = choice.right;
+		leftWhole.growToInclude(ref.box);
+		rightWhole.growToInclude(ref.box);
+		float splitCost = choice.left.area() * choice.leftCount + choice.right.area() * choice.rightCount;
+		float leftCost = leftWhole.area() * choice.leftCount + choice.right.area() * (choice.rightCount - 1);
+		float rightCost = choice.left.area() * (choice.leftCount - 1) + rightWhole.area() * choice.rightCount;
+
+		if (rightPart.isEmpty() || (leftCost < splitCost && leftCost <= rightCost)) {
+			left.push_back(ref);
+			choice.left = leftWhole;
+			choice.rightCount--;
+		}
+		else if (leftPart.isEmpty() || rightCost < splitCost) {
+			right.push_back(ref);
+			choice.right = rightWhole;
+			choice.leftCount--;
+		}
+		else {
+			Reference leftRef = ref, rightRef = ref;
+			leftRef.box = leftPart;
+			rightRef.box = rightPart;
+			left.push_back(leftRef);
+			right.push_back(rightRef);
+			referenceCount++;
+		}
+	}
+}
+
+inline void SBVHBuilder::splitReference(const Reference& ref, int axis, float position, BoundingBox& left, BoundingBox& right) const
+{
+	left = BoundingBox();
+	right = BoundingBox();
+
+	const Shape& shape = *shapes[ref.shape];
+	if (shape.type == SHAPE_TRIANGLE) {
+		// Vertices and edge crossings of the triangle on each side of the plane
+		const Triangle& triangle = static_cast<const Triangle&>(shape);
+		const glm::vec3 vertices[3] = { triangle.a, triangle.b, triangle.c };
+		for (int i = 0; i < 3; ++i) {
+			const glm::vec3& p = vertices[i];
+			const glm::vec3& q = vertices[(i + 1) % 3];
+			if (p[axis] <= position) left.growToInclude(p);
+			if (p[axis] >= position) right.growToInclude(p);
+			if ((p[axis] < position && q[axis] > position) || (p[axis] > position && q[axis] < position)) {
+				glm::vec3 x = glm::mix(p, q, (position - p[axis]) / (q[axis] - p[axis]));
+				x[axis] = position;
+				left.growToInclude(x);
+				right.growToInclude(x);
+			}
+		}
+	}
+	else {
+		// Box cut at the plane, exact for axis aligned walls
+		left = ref.box;
+		right = ref.box;
+		left.Max[axis] = position;
+		right.Min[axis] = position;
+	}
+
+	// Earlier cuts of the reference still apply
+	left.Min = glm::max(left.Min, ref.box.Min);
+	left.Max = glm::min(left.Max, ref.box.Max);
+	right.Min = glm::max(right.Min, ref.box.Min);
+	right.Max = glm::min(right.Max, ref.box.Max);
+}
+
+#endif // !SBVH_H
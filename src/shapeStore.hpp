@@ -0,0 +1,511 @@
+#ifndef SHAPE_STORE_H
+#define SHAPE_STORE_H
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <vector>
+#include "shapes/shape.hpp"
+#include "shapes/sphere.hpp"
+#include "shapes/plane.hpp"
+#include "shapes/wall.hpp"
+#include "shapes/triangle.hpp"
+#include "flatStructures.hpp"
+#include "simd.hpp"
+
+// Geometry of the scene shapes in contiguous per-type arrays for CPU ray tracing. A shape is found by its handle
+// (index << 2 | ShapeType), intersections are plain switches over the type instead of virtual calls.
+// Shapes stay the editable scene description, the store is rebuilt with the BVH and updated for animated shapes.
+// Tests return the same hits as Shape::get_intersection (front side hits, INNER).
+// Triangles of every BVH leaf are also packed into SoA blocks of SIMD_WIDTH lanes (buildBlocks), so one ray is
+// tested against a whole leaf at once. Unused lanes have a zero normal and never hit.
+
+struct StoreSphere
+{
+	glm::vec3 center;
+	float radius;
+};
+
+struct StorePlane
+{
+	glm::vec3 normal;
+	float d;
+};
+
+struct StoreWall
+{
+	glm::vec3 normal;
+	float d;
+	glm::vec3 start;
+	float width;
+	glm::vec3 u;		// Axes of the rectangle
+	float height;
+	glm::vec3 v;
+};
+
+struct StoreTriangle
+{
+	glm::vec3 normal;
+	float d;
+	glm::vec3 a;
+	float d00;			// Dot products of the edges, constant for barycentric coordinates
+	glm::vec3 edge1;	// b - a
+	float d01;
+	glm::vec3 edge2;	// c - a
+	float d11;
+	float denom;
+};
+
+// SIMD_WIDTH triangles, one per lane
+struct TriangleBlock
+{
+	float nx[SIMD_WIDTH], ny[SIMD_WIDTH], nz[SIMD_WIDTH], d[SIMD_WIDTH];
+	float ax[SIMD_WIDTH], ay[SIMD_WIDTH], az[SIMD_WIDTH];
+	float e1x[SIMD_WIDTH], e1y[SIMD_WIDTH], e1z[SIMD_WIDTH];
+	float e2x[SIMD_WIDTH], e2y[SIMD_WIDTH], e2z[SIMD_WIDTH];
+	float d00[SIMD_WIDTH], d01[SIMD_WIDTH], d11[SIMD_WIDTH], denom[SIMD_WIDTH];
+	int shapeIdx[SIMD_WIDTH];
+};
+
+inline int makeShapeHandle(int index, ShapeType type) { return (index << 2) | type; }
+
+class ShapeStore
+{
+public:
+	ShapeStore();
+	~ShapeStore();
+
+	void build(const std::vector<std::unique_ptr<Shape>>& shapes);
+	void update(const std::vector<std::unique_ptr<Shape>>& shapes, const std::vector<int>& shapeIndices);	// Moved shapes
+
+	// Front side hit of one shape, t is the ray parameter
+	bool intersect(int shapeIdx, const glm::vec3& start, const glm::vec3& dir, float& t) const;
+
+	// Pack triangles of the leaves of the flattened BVH into blocks, after build() and on every BVH rebuild.
+	// Leaves of the rebuilt node ranges (first node, count, sorted) are packed last, so repackBlocks replaces only their blocks
+	void buildBlocks(const std::vector<FlatNode>& nodes, const std::vector<int>& indices, const std::vector<glm::ivec2>& rebuiltRanges);
+	// Pack the leaves of the rebuilt ranges again after their BVHs were rebuilt in place (no allocation)
+	void repackBlocks(const std::vector<FlatNode>& nodes, const std::vector<int>& indices, const std::vector<glm::ivec2>& rebuiltRanges);
+	// True if leaf triangles are tested by the block kernels (and should be skipped by intersect())
+	bool useBlocks() const;
+	bool isTriangle(int shapeIdx) const;
+	bool hasOtherShapes(int nodeIdx) const;	// Leaf holds shapes other than triangles
+
+	// Closest front side hit among the triangles of a leaf nearer than tMax, updates tMax and shapeIdx
+	bool intersectBlocks(int nodeIdx, const glm::vec3& start, const glm::vec3& dir, float& tMax, int& shapeIdx) const;
+	// Any front side hit among the triangles of a leaf nearer than maxDist
+	bool occludedBlocks(int nodeIdx, const glm::vec3& start, const glm::vec3& dir, float maxDist) const;
+
+	int size() const;
+
+	Intersect_alg triangleAlgorithm = BARYCENTRIC;	// EMBREE skips triangles (traced by EmbreeScene)
+
+	std::vector<int> handles;	// Per shape index
+	std::vector<StoreSphere> spheres;
+	std::vector<StorePlane> planes;
+	std::vector<StoreWall> walls;
+	std::vector<StoreTriangle> triangles;
+
+	std::vector<TriangleBlock> triangleBlocks;
+	std::vector<glm::ivec3> leafBlocks;		// Per BVH node: first block, block count, number of other shapes
+	std::vector<int> triangleLanes;			// Per triangle: block * SIMD_WIDTH + lane, -1 if not in a leaf (last of the SBVH copies)
+
+private:
+	void set(const Shape& shape, int handle);
+	void setLane(int triangleIdx);
+	void packBlocks(const std::vector<FlatNode>& nodes, const std::vector<int>& indices, int begin, int end);	// Leaves of nodes [begin, end)
+
+	// Lanes of the block hit by the ray nearer than tMax, t of every lane
+	SimdFloat intersectBlock(const TriangleBlock& block, const SimdFloat* start, const SimdFloat* dir, SimdFloat tMax, SimdFloat& t) const;
+
+	bool intersectSphere(const StoreSphere& sphere, const glm::vec3& start, const glm::vec3& dir, float& t) const;
+	bool intersectPlane(const glm::vec3& normal, float d, const glm::vec3& start, const glm::vec3& dir, float& t) const;
+	bool intersectWall(const StoreWall& wall, const glm::vec3& start, const glm::vec3& dir, float& t) const;
+	bool intersectTriangle(const StoreTriangle& triangle, const glm::vec3& start, const glm::vec3& dir, float& t) const;
+
+	int staticBlockCount = 0;	// Blocks of the leaves outside the rebuilt ranges
+};
+
+ShapeStore::ShapeStore()
+{
+}
+
+ShapeStore::~ShapeStore()
+{
+}
+
+inline void ShapeStore::build(const std::vector<std::unique_ptr<Shape>>& shapes)
+{
+	handles.clear();
+	spheres.clear();
+	planes.clear();
+	walls.clear();
+	triangles.clear();
+	triangleBlocks.clear();
+	leafBlocks.clear();
+	triangleLanes.clear();
+	staticBlockCount = 0;
+
+	handles.reserve(shapes.size());
+	for (const auto& shape : shapes) {
+		int index = 0;
+		switch (shape->type) {
+		case SHAPE_SPHERE: index = static_cast<int>(spheres.size()); spheres.emplace_back(); break;
+		case SHAPE_PLANE: index = static_cast<int>(planes.size()); planes.emplace_back(); break;
+		case SHAPE_WALL: index = static_cast<int>(walls.size()); walls.emplace_back(); break;
+		case SHAPE_TRIANGLE: index = static_cast<int>(triangles.size()); triangles.emplace_back(); break;
+		}
+
+		handles.push_back(makeShapeHandle(index, shape->type));
+		set(*shape, handles.back());
+	}
+}
+
+inline void ShapeStore::update(const std::vector<std::unique_ptr<Shape>>& shapes, const std::vector<int>& shapeIndices)
+{
+	for (int shapeIdx : shapeIndices) {
+		set(*shapes[shapeIdx], handles[shapeIdx]);
+		if (isTriangle(shapeIdx) && !triangleLanes.empty())
+			setLane(handles[shapeIdx] >> 2);
+	}
+}
+
+inline void ShapeStore::buildBlocks(const std::vector<FlatNode>& nodes, const std::vector<int>& indices, const std::vector<glm::ivec2>& rebuiltRanges)
+{
+	triangleBlocks.clear();
+	leafBlocks.assign(nodes.size(), glm::ivec3(0));
+	triangleLanes.assign(triangles.size(), -1);
+
+	// Leaves outside the rebuilt ranges first, their blocks never move
+	int begin = 0;
+	for (const glm::ivec2& range : rebuiltRanges) {
+		packBlocks(nodes, indices, begin, range.x);
+		begin = range.x + range.y;
+	}
+	packBlocks(nodes, indices, begin, static_cast<int>(nodes.size()));
+	staticBlockCount = static_cast<int>(triangleBlocks.size());
+
+	// A rebuilt range holds at most (count + 1) / 2 leaves, each with one partly filled block
+	size_t capacity = triangleBlocks.size();
+	for (const glm::ivec2& range : rebuiltRanges) {
+		int triangleCount = 0;
+		for (int nodeIdx = range.x; nodeIdx < range.x + range.y; ++nodeIdx) {
+			if (!nodes[nodeIdx].isLeaf()) continue;
+			for (int i = 0; i < nodes[nodeIdx].numShapes(); ++i)
+				triangleCount += isTriangle(indices[nodes[nodeIdx].startShapeIdx() + i]);
+		}
+		capacity += triangleCount / SIMD_WIDTH + (range.y + 1) / 2;
+	}
+	triangleBlocks.reserve(capacity);
+
+	repackBlocks(nodes, indices, rebuiltRanges);
+}
+
+inline void ShapeStore::repackBlocks(const std::vector<FlatNode>& nodes, const std::vector<int>& indices, const std::vector<glm::ivec2>& rebuiltRanges)
+{
+	triangleBlocks.resize(staticBlockCount);
+	for (const glm::ivec2& range : rebuiltRanges)
+		packBlocks(nodes, indices, range.x, range.x + range.y);
+}
+
+inline void ShapeStore::packBlocks(const std::vector<FlatNode>& nodes, const std::vector<int>& indices, int begin, int end)
+{
+	for (int nodeIdx = begin; nodeIdx < end; ++nodeIdx) {
+		const FlatNode& node = nodes[nodeIdx];
+		leafBlocks[nodeIdx] = glm::ivec3(0);
+		if (!node.isLeaf()) continue;
+
+		leafBlocks[nodeIdx].x = static_cast<int>(triangleBlocks.size());
+		int lane = SIMD_WIDTH;
+		for (int i = 0; i < node.numShapes(); ++i) {
+			int shapeIdx = indices[node.startShapeIdx() + i];
+			if (!isTriangle(shapeIdx)) {
+				leafBlocks[nodeIdx].z++;
+				continue;
+			}
+
+			if (lane == SIMD_WIDTH) {
+				// Zeroed block, empty lanes have zero normal
+				triangleBlocks.push_back(TriangleBlock());
+				std::fill(std::begin(triangleBlocks.back().shapeIdx), std::end(triangleBlocks.back().shapeIdx), -1);
+				leafBlocks[nodeIdx].y++;
+				lane = 0;
+			}
+
+			int triangleIdx = handles[shapeIdx] >> 2;
+			triangleBlocks.back().shapeIdx[lane] = shapeIdx;
+			triangleLanes[triangleIdx] = static_cast<int>(triangleBlocks.size() - 1) * SIMD_WIDTH + lane;
+			setLane(triangleIdx);
+			lane++;
+		}
+	}
+}
+
+inline bool ShapeStore::useBlocks() const
+{
+	return !triangleBlocks.empty() && triangleAlgorithm != EMBREE;
+}
+
+inline bool ShapeStore::isTriangle(int shapeIdx) const
+{
+	return (handles[shapeIdx] & 3) == SHAPE_TRIANGLE;
+}
+
+inline bool ShapeStore::hasOtherShapes(int nodeIdx) const
+{
+	return leafBlocks[nodeIdx].z > 0;
+}
+
+inline int ShapeStore::size() const
+{
+	return static_cast<int>(handles.size());
+}
+
+inline void ShapeStore::set(const Shape& shape, int handle)
+{
+	int index = handle >> 2;
+	switch (shape.type) {
+	case SHAPE_SPHERE: {
+		const Sphere& sphere = static_cast<const Sphere&>(shape);
+		spheres[index].center = sphere.m_center;
+		spheres[index].radius = sphere.m_radius;
+		break;
+	}
+	case SHAPE_PLANE: {
+		const Plane& plane = static_cast<const Plane&>(shape);
+		planes[index].normal = plane.m_normal;
+		planes[index].d = plane.d;
+		break;
+	}
+	case SHAPE_WALL: {
+		const Wall& wall = static_cast<const Wall&>(shape);
+		StoreWall& out = walls[index];
+		out.normal = wall.m_normal;
+		out.d = wall.d;
+		out.start = wall.start;
+		out.width = wall.width;
+		out.height = wall.height;
+
+		// Same axes as Wall::get_intersection
+		out.u = glm::normalize(glm::cross(wall.m_normal, glm::vec3(0, 1, 0)));
+		if (glm::length(out.u) < 1e-4) out.u = glm::normalize(glm::cross(wall.m_normal, glm::vec3(1, 0, 0)));
+		out.v = glm::normalize(glm::cross(wall.m_normal, out.u));
+		break;
+	}
+	case SHAPE_TRIANGLE: {
+		const Triangle& triangle = static_cast<const Triangle&>(shape);
+		StoreTriangle& out = triangles[index];
+		out.normal = triangle.m_normal;
+		out.d = triangle.d;
+		out.a = triangle.a;
+		out.edge1 = triangle.b - triangle.a;
+		out.edge2 = triangle.c - triangle.a;
+		out.d00 = glm::dot(out.edge1, out.edge1);
+		out.d01 = glm::dot(out.edge1, out.edge2);
+		out.d11 = glm::dot(out.edge2, out.edge2);
+		out.denom = out.d00 * out.d11 - out.d01 * out.d01;
+		break;
+	}
+	}
+}
+
+inline void ShapeStore::setLane(int triangleIdx)
+{
+	int lane = triangleLanes[triangleIdx];
+	if (lane < 0) return;
+
+	const StoreTriangle& triangle = triangles[triangleIdx];
+	TriangleBlock& block = triangleBlocks[lane / SIMD_WIDTH];
+	lane %= SIMD_WIDTH;
+
+	block.nx[lane] = triangle.normal.x; block.ny[lane] = triangle.normal.y; block.nz[lane] = triangle.normal.z;
+	block.d[lane] = triangle.d;
+	block.ax[lane] = triangle.a.x; block.ay[lane] = triangle.a.y; block.az[lane] = triangle.a.z;
+	block.e1x[lane] = triangle.edge1.x; block.e1y[lane] = triangle.edge1.y; block.e1z[lane] = triangle.edge1.z;
+	block.e2x[lane] = triangle.edge2.x; block.e2y[lane] = triangle.edge2.y; block.e2z[lane] = triangle.edge2.z;
+	block.d00[lane] = triangle.d00;
+	block.d01[lane] = triangle.d01;
+	block.d11[lane] = triangle.d11;
+	block.denom[lane] = triangle.denom;
+}
+
+inline bool ShapeStore::intersect(int shapeIdx, const glm::vec3& start, const glm::vec3& dir, float& t) const
+{
+	int handle = handles[shapeIdx];
+	int index = handle >> 2;
+	switch (handle & 3) {
+	case SHAPE_SPHERE: return intersectSphere(spheres[index], start, dir, t);
+	case SHAPE_PLANE: return intersectPlane(planes[index].normal, planes[index].d, start, dir, t);
+	case SHAPE_WALL: return intersectWall(walls[index], start, dir, t);
+	case SHAPE_TRIANGLE: return intersectTriangle(triangles[index], start, dir, t);
+	}
+	return false;
+}
+
+inline bool ShapeStore::intersectSphere(const StoreSphere& sphere, const glm::vec3& start, const glm::vec3& dir, float& t) const
+{
+	glm::vec3 toStart = start - sphere.center;
+	float aa = glm::dot(dir, dir);
+	float bb = 2 * glm::dot(dir, toStart);
+	float cc = glm::dot(toStart, toStart) - sphere.radius * sphere.radius;
+
+	float D = bb * bb - 4 * aa * cc;
+	if (D <= 0) return false;
+
+	// Near side only, hits from inside the sphere are OUTER
+	t = (-bb - sqrt(D)) / (2 * aa);
+	return t > 0;
+}
+
+inline bool ShapeStore::intersectPlane(const glm::vec3& normal, float d, const glm::vec3& start, const glm::vec3& dir, float& t) const
+{
+	float np = glm::dot(normal, dir);
+	if (!(np > 0)) return false;
+
+	t = -(d + glm::dot(normal, start)) / np;
+	return t > 0;
+}
+
+inline bool ShapeStore::intersectWall(const StoreWall& wall, const glm::vec3& start, const glm::vec3& dir, float& t) const
+{
+	if (!intersectPlane(wall.normal, wall.d, start, dir, t)) return false;
+
+	glm::vec3 localPoint = start + t * dir - wall.start;
+	float uProj = glm::dot(localPoint, wall.u);
+	float vProj = glm::dot(localPoint, wall.v);
+	return !(uProj < 0 || uProj > wall.width || vProj < 0 || vProj > wall.height);
+}
+
+inline bool ShapeStore::intersectTriangle(const StoreTriangle& triangle, const glm::vec3& start, const glm::vec3& dir, float& t) const
+{
+	if (triangleAlgorithm == EMBREE) return false;
+
+	if (triangleAlgorithm == MT) {
+		// Moller-Trumbore, front side only like the plane test
+		if (!(glm::dot(triangle.normal, dir) > 0)) return false;
+
+		glm::vec3 p = glm::cross(dir, triangle.edge2);
+		float det = glm::dot(triangle.edge1, p);
+		if (det == 0) return false;
+		float invDet = 1.f / det;
+
+		glm::vec3 toStart = start - triangle.a;
+		float u = glm::dot(toStart, p) * invDet;
+		if (u < 0 || u > 1) return false;
+
+		glm::vec3 q = glm::cross(toStart, triangle.edge1);
+		float v = glm::dot(dir, q) * invDet;
+		if (v < 0 || u + v > 1) return false;
+
+		t = glm::dot(triangle.edge2, q) * invDet;
+		return t > 0;
+	}
+
+	// Barycentric coordinates of the hit on the triangle plane
+	if (!intersectPlane(triangle.normal, triangle.d, start, dir, t)) return false;
+
+	glm::vec3 toPoint = start + t * dir - triangle.a;
+	float d20 = glm::dot(toPoint, triangle.edge1);
+	float d21 = glm::dot(toPoint, triangle.edge2);
+
+	float v = (triangle.d11 * d20 - triangle.d01 * d21) / triangle.denom;
+	float w = (triangle.d00 * d21 - triangle.d01 * d20) / triangle.denom;
+	float u = 1.0 - v - w;
+	return !(u < 0 || v < 0 || w < 0);
+}
+
+inline SimdFloat ShapeStore::intersectBlock(const TriangleBlock& block, const SimdFloat* start, const SimdFloat* dir, SimdFloat tMax, SimdFloat& t) const
+{
+	// Same operations in the same order as intersectTriangle, lane by lane
+	const SimdFloat zero = simdSet(0.f), one = simdSet(1.f);
+	SimdFloat nx = simdLoad(block.nx), ny = simdLoad(block.ny), nz = simdLoad(block.nz);
+	SimdFloat e1x = simdLoad(block.e1x), e1y = simdLoad(block.e1y), e1z = simdLoad(block.e1z);
+	SimdFloat e2x = simdLoad(block.e2x), e2y = simdLoad(block.e2y), e2z = simdLoad(block.e2z);
+
+	SimdFloat np = nx * dir[0] + ny * dir[1] + nz * dir[2];
+	SimdFloat mask = np > zero;
+
+	if (triangleAlgorithm == MT) {
+		// p = cross(dir, edge2)
+		SimdFloat px = dir[1] * e2z - e2y * dir[2];
+		SimdFloat py = dir[2] * e2x - e2z * dir[0];
+		SimdFloat pz = dir[0] * e2y - e2x * dir[1];
+		SimdFloat det = e1x * px + e1y * py + e1z * pz;
+		mask = mask & (det != zero);
+		if (!simdMask(mask)) return mask;	// Back side or parallel in all lanes
+		SimdFloat invDet = one / det;
+
+		SimdFloat sx = start[0] - simdLoad(block.ax), sy = start[1] - simdLoad(block.ay), sz = start[2] - simdLoad(block.az);
+		SimdFloat u = (sx * px + sy * py + sz * pz) * invDet;
+		mask = andNot((u < zero) | (u > one), mask);
+
+		// q = cross(toStart, edge1)
+		SimdFloat qx = sy * e1z - e1y * sz;
+		SimdFloat qy = sz * e1x - e1z * sx;
+		SimdFloat qz = sx * e1y - e1x * sy;
+		SimdFloat v = (dir[0] * qx + dir[1] * qy + dir[2] * qz) * invDet;
+		mask = andNot((v < zero) | (u + v > one), mask);
+
+		t = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+		return mask & (t > zero) & (t < tMax);
+	}
+
+	t = (zero - (simdLoad(block.d) + (nx * start[0] + ny * start[1] + nz * start[2]))) / np;
+	mask = mask & (t > zero) & (t < tMax);
+	if (!simdMask(mask)) return mask;	// Plane missed in all lanes
+
+	SimdFloat px = start[0] + t * dir[0] - simdLoad(block.ax);
+	SimdFloat py = start[1] + t * dir[1] - simdLoad(block.ay);
+	SimdFloat pz = start[2] + t * dir[2] - simdLoad(block.az);
+	SimdFloat d20 = px * e1x + py * e1y + pz * e1z;
+	SimdFloat d21 = px * e2x + py * e2y + pz * e2z;
+
+	SimdFloat d00 = simdLoad(block.d00), d01 = simdLoad(block.d01), d11 = simdLoad(block.d11), denom = simdLoad(block.denom);
+	SimdFloat v = (d11 * d20 - d01 * d21) / denom;
+	SimdFloat w = (d00 * d21 - d01 * d20) / denom;
+	SimdFloat u = one - v - w;
+	return andNot((u < zero) | (v < zero) | (w < zero), mask);
+}
+
+inline bool ShapeStore::intersectBlocks(int nodeIdx, const glm::vec3& start, const glm::vec3& dir, float& tMax, int& shapeIdx) const
+{
+	const SimdFloat startLanes[3] = { simdSet(start.x), simdSet(start.y), simdSet(start.z) };
+	const SimdFloat dirLanes[3] = { simdSet(dir.x), simdSet(dir.y), simdSet(dir.z) };
+	bool found = false;
+
+	glm::ivec3 range = leafBlocks[nodeIdx];
+	for (int b = range.x; b < range.x + range.y; ++b) {
+		SimdFloat t;
+		int hits = simdMask(intersectBlock(triangleBlocks[b], startLanes, dirLanes, simdSet(tMax), t));
+		if (!hits) continue;
+
+		// Nearest hit lane, the first one on ties like the scalar loop
+		float laneT[SIMD_WIDTH];
+		simdStore(laneT, t);
+		for (int lane = 0; lane < SIMD_WIDTH; ++lane) {
+			if ((hits >> lane & 1) && laneT[lane] < tMax) {
+				tMax = laneT[lane];
+				shapeIdx = triangleBlocks[b].shapeIdx[lane];
+				found = true;
+			}
+		}
+	}
+	return found;
+}
+
+inline bool ShapeStore::occludedBlocks(int nodeIdx, const glm::vec3& start, const glm::vec3& dir, float maxDist) const
+{
+	const SimdFloat startLanes[3] = { simdSet(start.x), simdSet(start.y), simdSet(start.z) };
+	const SimdFloat dirLanes[3] = { simdSet(dir.x), simdSet(dir.y), simdSet(dir.z) };
+
+	glm::ivec3 range = leafBlocks[nodeIdx];
+	for (int b = range.x; b < range.x + range.y; ++b) {
+		SimdFloat t;
+		if (simdMask(intersectBlock(triangleBlocks[b], startLanes, dirLanes, simdSet(maxDist), t)))
+			return true;
+	}
+	return false;
+}
+
+#endif // !SHAPE_STORE_H
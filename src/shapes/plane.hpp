@@ -30,6 +30,7 @@ Plane::Plane(glm::vec3 normal, glm::vec3 point)
 	m_normal = glm::normalize(normal);
 	d = -(glm::dot(m_normal, point));
 	origin = point;
+	type = SHAPE_PLANE;
 }
 
 Plane::~Plane()
@@ -48,7 +49,7 @@ inline Intersection Plane::get_intersection(Ray ray) const
 		return Intersection(NONE); // no intersection
 	float t = -(d + glm::dot(m_normal, ray.get_start())) / np;
 	if (t > 0) {
-		return Intersection((np > 0) ? INNER : OUTER, ray.get_point(t));
+		return Intersection((np > 0) ? INNER : OUTER, ray.get_point(t), t);
 	}
 	else
 	{
@@ -7,6 +7,15 @@
 #include "../ray.hpp"
 #include "../intersection.hpp"
 
+// Concrete type of a shape, lets hot paths switch instead of dynamic_cast (same values as FlatShapeType where shared)
+enum ShapeType
+{
+	SHAPE_SPHERE = 0,
+	SHAPE_PLANE = 1,
+	SHAPE_WALL = 2,
+	SHAPE_TRIANGLE = 3
+};
+
 class Shape
 {
 public:
@@ -19,7 +28,9 @@ public:
 
 	Material material;
 	glm::vec3 origin;
+	ShapeType type = SHAPE_SPHERE;	// Set by the constructor of the derived class
 	bool animated = false;
+	int instance = -1;		// Index of the instance the shape belongs to (shape is in its object space)
 
 private:
 
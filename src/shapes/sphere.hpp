@@ -26,6 +26,7 @@ Sphere::Sphere(glm::vec3 center, float radius)
 {
 	m_center = center;
 	m_radius = radius;
+	type = SHAPE_SPHERE;
 	//color = glm::vec3(0, 1, 0);
 	origin = center;
 }
@@ -50,10 +51,10 @@ inline Intersection Sphere::get_intersection(Ray ray) const {
 		float sD = sqrt(D);
 		float t1 = (-bb - sD) / (2 * aa);
 		if (t1 > 0) // Inner intersection
-			return Intersection(INNER, ray.get_point(t1));
+			return Intersection(INNER, ray.get_point(t1), t1);
 		float t2 = (-bb + sD) / (2 * aa);
 		if (t2 > 0) // Outer intersection
-			return Intersection(OUTER, ray.get_point(t2));
+			return Intersection(OUTER, ray.get_point(t2), t2);
 	}
 
 	return Intersection(NONE); // return empty vector if no intersection
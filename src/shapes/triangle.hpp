@@ -3,8 +3,6 @@
 
 #include "glm/glm.hpp"
 #include "plane.hpp"
-#include <embree4/rtcore.h>
-#include <embree4/rtcore_ray.h>
 #include <iostream>
 
 enum Intersect_alg
@@ -34,53 +32,21 @@ public:
 
 	// Intersection algorithm
 	Intersect_alg int_alg = BARYCENTRIC;
-
-	// Set global scene for triangles;
-	static void setTriangleScene(RTCScene* scene);
 	
 private:
 	glm::vec3 get_normal(glm::vec3 p1, glm::vec3 p2, glm::vec3 p3);
-	static RTCScene* globalScene;
 };
 
 Triangle::Triangle(glm::vec3 p1, glm::vec3 p2, glm::vec3 p3)
 	: a(p1), b(p2), c(p3), Plane(get_normal(p1, p2, p3), p1)
 {
-	if (globalScene) {
-		RTCGeometry geom = rtcNewGeometry(rtcGetSceneDevice(*globalScene), RTC_GEOMETRY_TYPE_TRIANGLE);
-		float* vertices = (float*)rtcSetNewGeometryBuffer(
-			geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, 3 * sizeof(float), 3);
-
-		vertices[0] = p1.x; vertices[1] = p1.y; vertices[2] = p1.z;
-		vertices[3] = p2.x; vertices[4] = p2.y; vertices[5] = p2.z;
-		vertices[6] = p3.x; vertices[7] = p3.y; vertices[8] = p3.z;
-
-		unsigned* indices = (unsigned*)rtcSetNewGeometryBuffer(
-			geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, 3 * sizeof(unsigned), 1);
-
-		indices[0] = 0; indices[1] = 1; indices[2] = 2;
-
-		rtcCommitGeometry(geom);
-		rtcAttachGeometry(*globalScene, geom);
-		rtcReleaseGeometry(geom);
-
-		// Commit the scene to finalize the geometry
-		rtcCommitScene(*globalScene);
-
-	}
+	type = SHAPE_TRIANGLE;
 }
 
 Triangle::~Triangle()
 {
 }
 
-RTCScene* Triangle::globalScene = nullptr;
-
-inline void Triangle::setTriangleScene(RTCScene* scene)
-{
-	globalScene = scene;
-}
-
 inline glm::vec3 Triangle::get_normal(glm::vec3 p1, glm::vec3 p2, glm::vec3 p3) {
 	// https://stackoverflow.com/questions/19350792/calculate-normal-of-a-single-triangle-in-3d-space
 	auto A = p2 - p1;
@@ -130,40 +96,33 @@ inline Intersection Triangle::get_intersection(Ray ray) const {
 	}
 	// Moller-Trumbore
 	else if (int_alg == MT) {
+		glm::vec3 dir = ray.get_dir();
+		glm::vec3 edge1 = b - a;
+		glm::vec3 edge2 = c - a;
 
-	}
-	// TODO: intel embree check
-	else if (int_alg == EMBREE) {
-		if (globalScene == nullptr) return Intersection(NONE);
-
-		// Set up Embree ray
-		RTCRayHit rayhit;
-		memset(&rayhit, 0, sizeof(RTCRayHit));
-
-		rayhit.ray.org_x = ray.get_start().x;
-		rayhit.ray.org_y = ray.get_start().y;
-		rayhit.ray.org_z = ray.get_start().z;
+		glm::vec3 p = glm::cross(dir, edge2);
+		float det = glm::dot(edge1, p);
+		if (det == 0) return Intersection(NONE); // Parallel
 
-		rayhit.ray.dir_x = ray.get_dir().x;
-		rayhit.ray.dir_y = ray.get_dir().y;
-		rayhit.ray.dir_z = ray.get_dir().z;
+		float invDet = 1.f / det;
+		glm::vec3 toStart = ray.get_start() - a;
+		float u = glm::dot(toStart, p) * invDet;
+		if (u < 0 || u > 1) return Intersection(NONE);
 
-		rayhit.ray.tnear = 0.0f;
-		rayhit.ray.tfar = std::numeric_limits<float>::infinity();
-		rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
+		glm::vec3 q = glm::cross(toStart, edge1);
+		float v = glm::dot(dir, q) * invDet;
+		if (v < 0 || u + v > 1) return Intersection(NONE);
 
-		// Intersect with Embree
-		rtcIntersect1(*globalScene, &rayhit);
+		float t = glm::dot(edge2, q) * invDet;
+		if (t <= 0) return Intersection(NONE);
 
-		// TODO: must be an error here, ray never hits the triangle??
-		if (rayhit.hit.geomID != RTC_INVALID_GEOMETRY_ID) {
-			// Hit
-			glm::vec3 hitPoint = ray.get_start() + ray.get_dir() * rayhit.ray.tfar;
-			return Intersection(INNER, hitPoint);
-		}
-		else {
-			return Intersection(NONE);
-		}
+		// Same sides as the plane
+		float np = glm::dot(m_normal, dir);
+		return Intersection((np > 0) ? INNER : OUTER, ray.get_point(t), t);
+	}
+	// Embree traces all triangles of the scene at once (EmbreeScene), not one by one
+	else if (int_alg == EMBREE) {
+		return Intersection(NONE);
 	}
 	
 	else {
@@ -37,6 +37,7 @@ private:
 Wall::Wall(glm::vec3 s, float w, float h, glm::vec3 normal)
 	: Plane(normal, s), start(s), width(w), height(h)
 {
+	type = SHAPE_WALL;
 }
 
 Wall::~Wall()
@@ -0,0 +1,104 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// Minimal float vector for the CPU intersection kernels: 8 lanes with AVX2 (/arch:AVX2), 4 lanes with SSE2
+// (always on x64) and a scalar fallback. Comparisons return lane masks, combined with & | and andNot.
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_WIDTH 8
+
+struct SimdFloat
+{
+	__m256 v;
+};
+
+inline SimdFloat simdLoad(const float* p) { return { _mm256_loadu_ps(p) }; }
+inline SimdFloat simdSet(float x) { return { _mm256_set1_ps(x) }; }
+inline void simdStore(float* p, SimdFloat a) { _mm256_storeu_ps(p, a.v); }
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { return { _mm256_add_ps(a.v, b.v) }; }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { return { _mm256_sub_ps(a.v, b.v) }; }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { return { _mm256_mul_ps(a.v, b.v) }; }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { return { _mm256_div_ps(a.v, b.v) }; }
+inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return { _mm256_min_ps(a.v, b.v) }; }
+inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return { _mm256_max_ps(a.v, b.v) }; }
+
+inline SimdFloat operator<(SimdFloat a, SimdFloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+inline SimdFloat operator>(SimdFloat a, SimdFloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+inline SimdFloat operator<=(SimdFloat a, SimdFloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+inline SimdFloat operator>=(SimdFloat a, SimdFloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+inline SimdFloat operator!=(SimdFloat a, SimdFloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_NEQ_UQ) }; }
+inline SimdFloat operator&(SimdFloat a, SimdFloat b) { return { _mm256_and_ps(a.v, b.v) }; }
+inline SimdFloat operator|(SimdFloat a, SimdFloat b) { return { _mm256_or_ps(a.v, b.v) }; }
+inline SimdFloat andNot(SimdFloat mask, SimdFloat a) { return { _mm256_andnot_ps(mask.v, a.v) }; }	// a & ~mask
+inline int simdMask(SimdFloat mask) { return _mm256_movemask_ps(mask.v); }
+
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_WIDTH 4
+
+struct SimdFloat
+{
+	__m128 v;
+};
+
+inline SimdFloat simdLoad(const float* p) { return { _mm_loadu_ps(p) }; }
+inline SimdFloat simdSet(float x) { return { _mm_set1_ps(x) }; }
+inline void simdStore(float* p, SimdFloat a) { _mm_storeu_ps(p, a.v); }
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { return { _mm_add_ps(a.v, b.v) }; }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { return { _mm_sub_ps(a.v, b.v) }; }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { return { _mm_mul_ps(a.v, b.v) }; }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { return { _mm_div_ps(a.v, b.v) }; }
+inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return { _mm_min_ps(a.v, b.v) }; }
+inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return { _mm_max_ps(a.v, b.v) }; }
+
+inline SimdFloat operator<(SimdFloat a, SimdFloat b) { return { _mm_cmplt_ps(a.v, b.v) }; }
+inline SimdFloat operator>(SimdFloat a, SimdFloat b) { return { _mm_cmpgt_ps(a.v, b.v) }; }
+inline SimdFloat operator<=(SimdFloat a, SimdFloat b) { return { _mm_cmple_ps(a.v, b.v) }; }
+inline SimdFloat operator>=(SimdFloat a, SimdFloat b) { return { _mm_cmpge_ps(a.v, b.v) }; }
+inline SimdFloat operator!=(SimdFloat a, SimdFloat b) { return { _mm_cmpneq_ps(a.v, b.v) }; }
+inline SimdFloat operator&(SimdFloat a, SimdFloat b) { return { _mm_and_ps(a.v, b.v) }; }
+inline SimdFloat operator|(SimdFloat a, SimdFloat b) { return { _mm_or_ps(a.v, b.v) }; }
+inline SimdFloat andNot(SimdFloat mask, SimdFloat a) { return { _mm_andnot_ps(mask.v, a.v) }; }	// a & ~mask
+inline int simdMask(SimdFloat mask) { return _mm_movemask_ps(mask.v); }
+
+#else
+#include <cstring>
+#define SIMD_WIDTH 1
+
+// Scalar fallback, masks are all ones or zero bits like in the vector versions
+struct SimdFloat
+{
+	float v;
+};
+
+inline unsigned simdBits(float x) { unsigned bits; std::memcpy(&bits, &x, sizeof(bits)); return bits; }
+inline SimdFloat simdFromBits(unsigned bits) { float x; std::memcpy(&x, &bits, sizeof(x)); return { x }; }
+inline SimdFloat simdMaskOf(bool value) { return simdFromBits(value ? ~0u : 0u); }
+
+inline SimdFloat simdLoad(const float* p) { return { *p }; }
+inline SimdFloat simdSet(float x) { return { x }; }
+inline void simdStore(float* p, SimdFloat a) { *p = a.v; }
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { return { a.v + b.v }; }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { return { a.v - b.v }; }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { return { a.v * b.v }; }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { return { a.v / b.v }; }
+inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return { a.v < b.v ? a.v : b.v }; }
+inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return { a.v > b.v ? a.v : b.v }; }
+
+inline SimdFloat operator<(SimdFloat a, SimdFloat b) { return simdMaskOf(a.v < b.v); }
+inline SimdFloat operator>(SimdFloat a, SimdFloat b) { return simdMaskOf(a.v > b.v); }
+inline SimdFloat operator<=(SimdFloat a, SimdFloat b) { return simdMaskOf(a.v <= b.v); }
+inline SimdFloat operator>=(SimdFloat a, SimdFloat b) { return simdMaskOf(a.v >= b.v); }
+inline SimdFloat operator!=(SimdFloat a, SimdFloat b) { return simdMaskOf(a.v != b.v); }
+inline SimdFloat operator&(SimdFloat a, SimdFloat b) { return simdFromBits(simdBits(a.v) & simdBits(b.v)); }
+inline SimdFloat operator|(SimdFloat a, SimdFloat b) { return simdFromBits(simdBits(a.v) | simdBits(b.v)); }
+inline SimdFloat andNot(SimdFloat mask, SimdFloat a) { return simdFromBits(~simdBits(mask.v) & simdBits(a.v)); }
+inline int simdMask(SimdFloat mask) { return simdBits(mask.v) >> 31; }
+
+#endif
+
+#endif // !SIMD_H
@@ -0,0 +1,177 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent pool of worker threads (the calling thread works as thread 0).
+// parallelFor() splits the index space into one contiguous range per thread,
+// a thread that finishes its own range steals indices from the others.
+class ThreadPool
+{
+public:
+	ThreadPool(int numThreads = 0);
+	~ThreadPool();
+
+	// Run task(index, threadIdx) for every index in [0, count) and wait until all are done
+	void parallelFor(int count, const std::function<void(int, int)>& task);
+
+	// Change number of threads (0 = all hardware threads)
+	void resize(int numThreads);
+	int size() const;
+
+	static int hardwareThreads();
+
+private:
+	// Padded to a cache line, threads do not share the counters (no alignas, C++14 new would not honour it)
+	struct WorkRange {
+		std::atomic<int> next;
+		int end;
+		char padding[64 - sizeof(std::atomic<int>) - sizeof(int)];
+	};
+
+	void startWorkers();
+	void stopWorkers();
+	void workerLoop(int threadIdx, unsigned seenGeneration);
+	void runRanges(int threadIdx);
+
+	int threadCount;
+	std::vector<std::thread> workers;
+	std::unique_ptr<WorkRange[]> ranges;
+
+	const std::function<void(int, int)>* currentTask = nullptr;
+	std::mutex mutex;
+	std::condition_variable wakeCondition;
+	std::condition_variable doneCondition;
+	unsigned generation = 0;
+	int busyWorkers = 0;
+	bool stopping = false;
+};
+
+ThreadPool::ThreadPool(int numThreads)
+{
+	threadCount = numThreads > 0 ? numThreads : hardwareThreads();
+	startWorkers();
+}
+
+ThreadPool::~ThreadPool()
+{
+	stopWorkers();
+}
+
+inline int ThreadPool::hardwareThreads()
+{
+	unsigned n = std::thread::hardware_concurrency();
+	return n > 0 ? static_cast<int>(n) : 1;
+}
+
+inline int ThreadPool::size() const
+{
+	return threadCount;
+}
+
+inline void ThreadPool::resize(int numThreads)
+{
+	int n = numThreads > 0 ? numThreads : hardwareThreads();
+	if (n == threadCount) return;
+
+	stopWorkers();
+	threadCount = n;
+	startWorkers();
+}
+
+inline void ThreadPool::startWorkers()
+{
+	ranges.reset(new WorkRange[threadCount]());
+	stopping = false;
+
+	// New workers wait for the next parallelFor, not the last one before a resize
+	for (int i = 1; i < threadCount; ++i)
+		workers.emplace_back(&ThreadPool::workerLoop, this, i, generation);
+}
+
+inline void ThreadPool::stopWorkers()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wakeCondition.notify_all();
+	for (auto& worker : workers)
+		worker.join();
+	workers.clear();
+}
+
+inline void ThreadPool::parallelFor(int count, const std::function<void(int, int)>& task)
+{
+	if (count <= 0) return;
+
+	// Not worth waking the workers
+	if (threadCount == 1 || count == 1) {
+		for (int i = 0; i < count; ++i)
+			task(i, 0);
+		return;
+	}
+
+	// Initial distribution, one contiguous range per thread
+	for (int t = 0; t < threadCount; ++t) {
+		ranges[t].next.store(static_cast<int>(static_cast<long long>(count) * t / threadCount), std::memory_order_relaxed);
+		ranges[t].end = static_cast<int>(static_cast<long long>(count) * (t + 1) / threadCount);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		currentTask = &task;
+		busyWorkers = threadCount - 1;
+		++generation;
+	}
+	wakeCondition.notify_all();
+
+	runRanges(0);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	doneCondition.wait(lock, [this] { return busyWorkers == 0; });
+	currentTask = nullptr;
+}
+
+inline void ThreadPool::workerLoop(int threadIdx, unsigned seenGeneration)
+{
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wakeCondition.wait(lock, [&] { return stopping || generation != seenGeneration; });
+			if (stopping) return;
+			seenGeneration = generation;
+		}
+
+		runRanges(threadIdx);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			--busyWorkers;
+		}
+		doneCondition.notify_one();
+	}
+}
+
+inline void ThreadPool::runRanges(int threadIdx)
+{
+	const auto& task = *currentTask;
+
+	// Own range first, then steal from the others
+	for (int k = 0; k < threadCount; ++k) {
+		WorkRange& range = ranges[(threadIdx + k) % threadCount];
+		while (true) {
+			int i = range.next.fetch_add(1, std::memory_order_relaxed);
+			if (i >= range.end) break;
+			task(i, threadIdx);
+		}
+	}
+}
+
+#endif // !THREAD_POOL_H
@@ -0,0 +1,243 @@
+#ifndef TLAS_H
+#define TLAS_H
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "flatStructures.hpp"
+#include "ray.hpp"
+#include "shapes/shape.hpp"
+#include "BoundingBox.hpp"
+#include "bvh.hpp"
+#include "wideBvh.hpp"
+
+// Two-level BVH. Every instance (a mesh, or the loose shapes of the scene) has its own bottom level BVH (BLAS)
+// in flatNodes, built once. The top level BVH (TLAS) over instance bounds is rebuilt when instances move.
+// Shapes of an instance are kept in object space, rays are transformed into it instead. Transforms are expected
+// to be rigid (rotation + translation), so hit distances are the same in object and world space.
+
+// Placed BLAS
+struct Instance
+{
+	glm::mat4 transform = glm::mat4(1);		// Object -> world
+	glm::mat4 invTransform = glm::mat4(1);	// World -> object
+
+	std::vector<int> shapeIndices;	// All of one primitive type (see FlatInstance)
+	int blasRoot = -1;		// Root node of the BLAS in flatNodes
+	int primitiveType = 0;	// GPU primitives of the leaves, set when the scene is serialized
+	int primitiveOffset = 0;
+	BoundingBox bounds;		// Root box of the BLAS (object space)
+
+	void setTransform(const glm::mat4& objectToWorld);
+	BoundingBox worldBounds() const;
+
+	Ray toObject(Ray ray) const;
+	glm::vec3 pointToObject(const glm::vec3& point) const;
+	glm::vec3 pointToWorld(const glm::vec3& point) const;
+	glm::vec3 normalToWorld(const glm::vec3& normal) const;
+};
+
+inline void Instance::setTransform(const glm::mat4& objectToWorld)
+{
+	transform = objectToWorld;
+	invTransform = glm::inverse(objectToWorld);
+}
+
+inline BoundingBox Instance::worldBounds() const
+{
+	BoundingBox box;
+	if (bounds.isEmpty()) return box;
+
+	for (int i = 0; i < 8; ++i) {
+		glm::vec3 corner((i & 1) ? bounds.Max.x : bounds.Min.x, (i & 2) ? bounds.Max.y : bounds.Min.y, (i & 4) ? bounds.Max.z : bounds.Min.z);
+		box.growToInclude(pointToWorld(corner));
+	}
+	return box;
+}
+
+inline Ray Instance::toObject(Ray ray) const
+{
+	return Ray(pointToObject(ray.get_start()), glm::mat3(invTransform) * ray.get_dir());
+}
+
+inline glm::vec3 Instance::pointToObject(const glm::vec3& point) const
+{
+	return glm::vec3(invTransform * glm::vec4(point, 1.f));
+}
+
+inline glm::vec3 Instance::pointToWorld(const glm::vec3& point) const
+{
+	return glm::vec3(transform * glm::vec4(point, 1.f));
+}
+
+inline glm::vec3 Instance::normalToWorld(const glm::vec3& normal) const
+{
+	return glm::normalize(glm::transpose(glm::mat3(invTransform)) * normal);
+}
+
+// Top level BVH, one instance per leaf (startShapeIdx is the instance index), root is the last node
+class TLAS
+{
+public:
+	TLAS();
+	~TLAS();
+
+	void build(const std::vector<Instance>& instances);
+	const std::vector<FlatNode>& getNodes() const;
+
+private:
+	int split(int first, int count);
+
+	// Scratch kept between the per-frame rebuilds
+	std::vector<BoundingBox> instanceBoxes;
+	std::vector<int> order;
+	std::vector<FlatNode> nodes;
+};
+
+TLAS::TLAS()
+{
+}
+
+TLAS::~TLAS()
+{
+}
+
+inline void TLAS::build(const std::vector<Instance>& instances)
+{
+	nodes.clear();
+	instanceBoxes.clear();
+	order.clear();
+	if (instances.empty()) return;
+
+	for (int i = 0; i < instances.size(); ++i) {
+		instanceBoxes.push_back(instances[i].worldBounds());
+		order.push_back(i);
+	}
+
+	split(0, static_cast<int>(order.size()));
+}
+
+inline const std::vector<FlatNode>& TLAS::getNodes() const
+{
+	return nodes;
+}
+
+inline int TLAS::split(int first, int count)
+{
+	FlatNode node;
+	node.setLeaf(order[first], 1);
+
+	BoundingBox box;
+	for (int i = first; i < first + count; ++i)
+		box.growToInclude(instanceBoxes[order[i]]);
+
+	// Few instances, median split on the longest axis is good enough
+	if (count > 1) {
+		glm::vec3 size = box.Max - box.Min;
+		int axis = size.x > glm::max(size.y, size.z) ? 0 : size.y > size.z ? 1 : 2;
+
+		auto begin = order.begin() + first;
+		std::nth_element(begin, begin + count / 2, begin + count, [&](int a, int b) {
+			return instanceBoxes[a].Min[axis] + instanceBoxes[a].Max[axis] < instanceBoxes[b].Min[axis] + instanceBoxes[b].Max[axis];
+		});
+
+		int left = split(first, count / 2);
+		int right = split(first + count / 2, count - count / 2);
+		node.setInner(left, right);
+	}
+
+	node.boundsMin = box.Min;
+	node.boundsMax = box.Max;
+	nodes.push_back(node);
+	return static_cast<int>(nodes.size()) - 1;
+}
+
+// Closest hit over all instances, hit point is in world space.
+// Instance BVHs are traversed in their wide form when wide is given, binary otherwise.
+inline bool intersectTLAS(const std::vector<FlatNode>& tlasNodes, const std::vector<Instance>& instances,
+	const std::vector<FlatNode>& nodes, const std::vector<int>& indices,
+	const ShapeStore& store, const WideBVH* wide, Ray ray, BVHHit& hit, BVHStats* stats = nullptr)
+{
+	if (tlasNodes.empty()) return false;
+
+	glm::vec3 start = ray.get_start();
+	glm::vec3 invDir = 1.f / ray.get_dir();
+
+	int root = static_cast<int>(tlasNodes.size()) - 1;
+	float tMin, tMax;
+	if (stats) stats->nodeVisits++;
+	if (stats && stats->cache) stats->cache->access(tlasNodes.data(), root * sizeof(FlatNode), sizeof(FlatNode));
+	if (!rayIntersectsAABB(start, invDir, tlasNodes[root].boundsMin, tlasNodes[root].boundsMax, tMin, tMax) || tMin > hit.dist)
+		return false;
+
+	// Same ordered traversal as intersectBVH, nearer instances first
+	int stack[BVH_STACK_SIZE];
+	float stackT[BVH_STACK_SIZE];
+	int stackIdx = 0;
+	stackT[stackIdx] = tMin;
+	stack[stackIdx++] = root;
+
+	while (stackIdx > 0) {
+		--stackIdx;
+		if (stackT[stackIdx] > hit.dist)
+			continue;
+		const FlatNode& node = tlasNodes[stack[stackIdx]];
+
+		if (node.isLeaf()) { // Instance
+			const Instance& instance = instances[node.startShapeIdx()];
+
+			BVHHit localHit = hit;
+			bool found = wide ? intersectWideBVH(*wide, nodes, indices, store, instance.toObject(ray), localHit, wide->rootOf(instance.blasRoot), stats)
+				: intersectBVH(nodes, indices, store, instance.toObject(ray), localHit, instance.blasRoot, stats);
+			if (found && localHit.dist < hit.dist) {
+				hit = localHit;
+				hit.point = instance.pointToWorld(localHit.point);
+			}
+		}
+		else {
+			pushChildrenOrdered(tlasNodes, node, start, invDir, hit.dist, stack, stackT, stackIdx, stats);
+		}
+	}
+
+	return hit.shapeIdx != -1;
+}
+
+// Any hit over all instances closer than maxDist
+inline bool occludedTLAS(const std::vector<FlatNode>& tlasNodes, const std::vector<Instance>& instances,
+	const std::vector<FlatNode>& nodes, const std::vector<int>& indices,
+	const ShapeStore& store, const WideBVH* wide, Ray ray, float maxDist)
+{
+	if (tlasNodes.empty()) return false;
+
+	glm::vec3 start = ray.get_start();
+	glm::vec3 invDir = 1.f / ray.get_dir();
+
+	int stack[BVH_STACK_SIZE];
+	int stackIdx = 0;
+	stack[stackIdx++] = static_cast<int>(tlasNodes.size()) - 1;
+
+	while (stackIdx > 0) {
+		const FlatNode& node = tlasNodes[stack[--stackIdx]];
+
+		float tMin, tMax;
+		if (!rayIntersectsAABB(start, invDir, node.boundsMin, node.boundsMax, tMin, tMax) || tMin > maxDist)
+			continue;
+
+		if (node.isLeaf()) { // Instance
+			const Instance& instance = instances[node.startShapeIdx()];
+			bool occluded = wide ? occludedWideBVH(*wide, nodes, indices, store, instance.toObject(ray), maxDist, wide->rootOf(instance.blasRoot))
+				: occludedBVH(nodes, indices, store, instance.toObject(ray), maxDist, instance.blasRoot);
+			if (occluded)
+				return true;
+		}
+		else {
+			stack[stackIdx++] = node.leftChild();
+			stack[stackIdx++] = node.rightChild();
+		}
+	}
+
+	return false;
+}
+
+#endif // !TLAS_H
@@ -0,0 +1,215 @@
+#ifndef UPLOAD_RING_H
+#define UPLOAD_RING_H
+
+#include <glad/glad.h>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+// Streaming uploads of the per-frame scene updates (camera, light, animated shapes, refitted BVH nodes).
+// One staging buffer created with glBufferStorage and mapped once (persistent + coherent), split into
+// UPLOAD_RING_FRAMES regions. Dirty ranges of a frame are written one after another into its region and copied
+// into the SSBOs on the GPU (glCopyBufferSubData), a region is written again only after the fence of its frame.
+// Without GL 4.4 every upload falls back to glBufferSubData.
+
+const int UPLOAD_RING_FRAMES = 3;
+
+class UploadRing
+{
+public:
+	UploadRing();
+	~UploadRing();
+
+	// Create the staging buffer with given bytes per frame, false if persistent mapping is not available
+	bool init(size_t frameBytes);
+	void release();
+
+	// Wait for the GPU to finish reading the region of this frame (grows the regions if the last frame overflowed)
+	void beginFrame();
+	// Write data into the mapped region and queue a copy into dst at dstOffset
+	void upload(GLuint dst, size_t dstOffset, const void* data, size_t size);
+	// Issue the queued copies and fence the region
+	void endFrame();
+
+	bool persistent() const;
+	size_t frameBytes() const;
+
+	// Statistics since init
+	int stalls = 0;			// Frames that waited for a fence
+	int fallbacks = 0;		// Uploads that did not fit into the region (glBufferSubData)
+
+private:
+	struct Copy
+	{
+		GLuint dst;
+		size_t srcOffset;
+		size_t dstOffset;
+		size_t size;
+	};
+
+	void waitFence(int idx);
+
+	GLuint buffer = 0;
+	char* mapped = nullptr;
+	size_t regionSize = 0;
+	size_t used = 0;			// Bytes written into the current region
+	size_t neededSize = 0;		// Bytes the last frame wanted to write
+	int region = 0;
+	GLsync fences[UPLOAD_RING_FRAMES];
+	std::vector<Copy> copies;
+};
+
+UploadRing::UploadRing()
+{
+	for (GLsync& fence : fences)
+		fence = 0;
+}
+
+UploadRing::~UploadRing()
+{
+	release();
+}
+
+inline bool UploadRing::init(size_t frameBytes)
+{
+	release();
+	if (!GLAD_GL_VERSION_4_4) {
+		std::cout << "ERROR::UPLOAD_RING::GL_4_4_NOT_SUPPORTED (using glBufferSubData)" << std::endl;
+		return false;
+	}
+
+	// Region offsets stay 16 byte aligned
+	regionSize = (frameBytes + 15) & ~size_t(15);
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+	glBufferStorage(GL_COPY_READ_BUFFER, regionSize * UPLOAD_RING_FRAMES, nullptr, flags);
+	mapped = static_cast<char*>(glMapBufferRange(GL_COPY_READ_BUFFER, 0, regionSize * UPLOAD_RING_FRAMES, flags));
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+	if (!mapped) {
+		std::cout << "ERROR::UPLOAD_RING::MAPPING_FAILED (using glBufferSubData)" << std::endl;
+		release();
+		return false;
+	}
+
+	region = 0;
+	used = 0;
+	neededSize = 0;
+	return true;
+}
+
+inline void UploadRing::release()
+{
+	for (int i = 0; i < UPLOAD_RING_FRAMES; ++i) {
+		if (fences[i]) {
+			waitFence(i);
+			glDeleteSync(fences[i]);
+			fences[i] = 0;
+		}
+	}
+
+	if (buffer) {
+		if (mapped) {
+			glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+			glUnmapBuffer(GL_COPY_READ_BUFFER);
+			glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		}
+		glDeleteBuffers(1, &buffer);
+	}
+	buffer = 0;
+	mapped = nullptr;
+	regionSize = 0;
+	copies.clear();
+}
+
+inline void UploadRing::waitFence(int idx)
+{
+	GLenum result = glClientWaitSync(fences[idx], 0, 0);
+	if (result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED)
+		return;
+
+	++stalls;
+	do {
+		result = glClientWaitSync(fences[idx], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);	// 1 s
+	} while (result == GL_TIMEOUT_EXPIRED);
+}
+
+inline void UploadRing::beginFrame()
+{
+	if (!mapped) return;
+
+	// Last frame did not fit, reallocate with some headroom (waits for all regions)
+	if (neededSize > regionSize) {
+		init(neededSize + neededSize / 2);
+		if (!mapped) return;
+	}
+
+	region = (region + 1) % UPLOAD_RING_FRAMES;
+	if (fences[region]) {
+		waitFence(region);
+		glDeleteSync(fences[region]);
+		fences[region] = 0;
+	}
+
+	used = 0;
+	neededSize = 0;
+	copies.clear();
+}
+
+inline void UploadRing::upload(GLuint dst, size_t dstOffset, const void* data, size_t size)
+{
+	if (size == 0) return;
+
+	neededSize += size;
+	if (!mapped || used + size > regionSize) {
+		if (mapped) ++fallbacks;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, dst);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, dstOffset, size, data);
+		return;
+	}
+
+	size_t srcOffset = region * regionSize + used;
+	std::memcpy(mapped + srcOffset, data, size);
+	used += size;
+
+	// Ranges that continue the previous one are copied together
+	if (!copies.empty()) {
+		Copy& last = copies.back();
+		if (last.dst == dst && last.dstOffset + last.size == dstOffset && last.srcOffset + last.size == srcOffset) {
+			last.size += size;
+			return;
+		}
+	}
+	copies.push_back({ dst, srcOffset, dstOffset, size });
+}
+
+inline void UploadRing::endFrame()
+{
+	if (!mapped || copies.empty()) return;
+
+	// Coherent mapping, the writes are visible to the copies without a flush
+	glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+	for (const Copy& copy : copies) {
+		glBindBuffer(GL_COPY_WRITE_BUFFER, copy.dst);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, copy.srcOffset, copy.dstOffset, copy.size);
+	}
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	copies.clear();
+}
+
+inline bool UploadRing::persistent() const
+{
+	return mapped != nullptr;
+}
+
+inline size_t UploadRing::frameBytes() const
+{
+	return regionSize;
+}
+
+#endif // !UPLOAD_RING_H
@@ -0,0 +1,306 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <vector>
+#include "flatStructures.hpp"
+#include "ray.hpp"
+#include "simd.hpp"
+#include "shapeStore.hpp"
+#include "bvh.hpp"
+
+// Wide BVH for CPU traversal, collapsed from the binary flatNodes after every build. Each node has up to
+// BVH_WIDTH children with their boxes in SoA form, all child boxes are tested in one SIMD slab test.
+// Leaf children point back to the leaves in flatNodes, so shapes and triangle blocks are shared with the binary BVH.
+
+const int BVH_WIDTH = SIMD_WIDTH > 4 ? SIMD_WIDTH : 4;	// 4 with SSE, 8 with AVX2
+const int WIDE_BVH_STACK_SIZE = BVH_STACK_SIZE * (BVH_WIDTH - 1);
+
+struct WideNode
+{
+	float minX[BVH_WIDTH], minY[BVH_WIDTH], minZ[BVH_WIDTH];
+	float maxX[BVH_WIDTH], maxY[BVH_WIDTH], maxZ[BVH_WIDTH];
+	int child[BVH_WIDTH];		// Wide node index, or leaf node index in flatNodes
+	int flatChild[BVH_WIDTH];	// Child node in flatNodes (for refit)
+	int leafMask = 0;			// Bit per child that is a leaf
+	int count = 0;				// Used children, the rest is never hit
+};
+
+class WideBVH
+{
+public:
+	WideBVH();
+	~WideBVH();
+
+	// Collapse the binary BVHs with given roots (one per instance). BVHs of the rebuilt node ranges (first node, count,
+	// root first) are collapsed last, so rebuild() replaces only their wide nodes
+	void build(const std::vector<FlatNode>& flatNodes, const std::vector<int>& roots, const std::vector<glm::ivec2>& rebuiltRanges);
+	// Collapse the BVHs of the rebuilt ranges again after they were rebuilt in place (no allocation)
+	void rebuild(const std::vector<FlatNode>& flatNodes, const std::vector<glm::ivec2>& rebuiltRanges);
+	// Copy child boxes again after the binary BVH was refitted
+	void refit(const std::vector<FlatNode>& flatNodes);
+
+	// Wide node collapsed from given binary node (every BVH root and some inner nodes), -1 if none
+	int rootOf(int flatIdx) const;
+
+	std::vector<WideNode> nodes;
+
+private:
+	int collapse(const std::vector<FlatNode>& flatNodes, int flatIdx);
+	void setChild(WideNode& node, int lane, const FlatNode& flatNode) const;
+
+	std::vector<int> flatToWide;	// Per flat node, wide node collapsed from it or -1
+	int staticNodeCount = 0;		// Wide nodes of the BVHs outside the rebuilt ranges
+};
+
+WideBVH::WideBVH()
+{
+}
+
+WideBVH::~WideBVH()
+{
+}
+
+inline void WideBVH::build(const std::vector<FlatNode>& flatNodes, const std::vector<int>& roots, const std::vector<glm::ivec2>& rebuiltRanges)
+{
+	nodes.clear();
+	flatToWide.assign(flatNodes.size(), -1);
+
+	for (int root : roots) {
+		if (root < 0 || root >= flatNodes.size()) continue;
+
+		bool rebuilt = false;
+		for (const glm::ivec2& range : rebuiltRanges)
+			rebuilt = rebuilt || range.x == root;
+		if (!rebuilt)
+			collapse(flatNodes, root);
+	}
+	staticNodeCount = static_cast<int>(nodes.size());
+
+	// At most one wide node per inner node of a rebuilt range (or one for a leaf root)
+	size_t capacity = nodes.size();
+	for (const glm::ivec2& range : rebuiltRanges)
+		capacity += range.y / 2 + 1;
+	nodes.reserve(capacity);
+
+	rebuild(flatNodes, rebuiltRanges);
+}
+
+inline void WideBVH::rebuild(const std::vector<FlatNode>& flatNodes, const std::vector<glm::ivec2>& rebuiltRanges)
+{
+	nodes.resize(staticNodeCount);
+	for (const glm::ivec2& range : rebuiltRanges) {
+		std::fill(flatToWide.begin() + range.x, flatToWide.begin() + range.x + range.y, -1);
+		if (range.y > 0)
+			collapse(flatNodes, range.x);
+	}
+}
+
+inline int WideBVH::collapse(const std::vector<FlatNode>& flatNodes, int flatIdx)
+{
+	// Open the child with the largest surface area until the node is full
+	int lanes[BVH_WIDTH];
+	int laneCount = 0;
+	if (flatNodes[flatIdx].isLeaf()) {
+		lanes[laneCount++] = flatIdx;
+	}
+	else {
+		lanes[laneCount++] = flatNodes[flatIdx].leftChild();
+		lanes[laneCount++] = flatNodes[flatIdx].rightChild();
+	}
+
+	while (laneCount < BVH_WIDTH) {
+		int best = -1;
+		float bestArea = -1.f;
+		for (int i = 0; i < laneCount; ++i) {
+			const FlatNode& node = flatNodes[lanes[i]];
+			if (node.isLeaf()) continue;
+
+			glm::vec3 size = node.boundsMax - node.boundsMin;
+			float area = size.x * size.y + size.y * size.z + size.z * size.x;
+			if (area > bestArea) {
+				bestArea = area;
+				best = i;
+			}
+		}
+		if (best == -1) break;
+
+		const FlatNode& opened = flatNodes[lanes[best]];
+		lanes[best] = opened.leftChild();
+		lanes[laneCount++] = opened.rightChild();
+	}
+
+	WideNode node;
+	node.count = laneCount;
+	for (int i = 0; i < BVH_WIDTH; ++i) {
+		if (i < node.count) {
+			setChild(node, i, flatNodes[lanes[i]]);
+			node.flatChild[i] = lanes[i];
+		}
+		else {
+			// Unused lanes are masked out by count
+			node.minX[i] = node.minY[i] = node.minZ[i] = node.maxX[i] = node.maxY[i] = node.maxZ[i] = 0.f;
+			node.flatChild[i] = -1;
+		}
+		node.child[i] = -1;
+	}
+
+	for (int i = 0; i < node.count; ++i) {
+		if (flatNodes[lanes[i]].isLeaf()) {
+			node.child[i] = lanes[i];
+			node.leafMask |= 1 << i;
+		}
+		else {
+			node.child[i] = collapse(flatNodes, lanes[i]);
+		}
+	}
+
+	// Children before parents
+	nodes.push_back(node);
+	flatToWide[flatIdx] = static_cast<int>(nodes.size()) - 1;
+	return flatToWide[flatIdx];
+}
+
+inline void WideBVH::setChild(WideNode& node, int lane, const FlatNode& flatNode) const
+{
+	node.minX[lane] = flatNode.boundsMin.x;
+	node.minY[lane] = flatNode.boundsMin.y;
+	node.minZ[lane] = flatNode.boundsMin.z;
+	node.maxX[lane] = flatNode.boundsMax.x;
+	node.maxY[lane] = flatNode.boundsMax.y;
+	node.maxZ[lane] = flatNode.boundsMax.z;
+}
+
+inline void WideBVH::refit(const std::vector<FlatNode>& flatNodes)
+{
+	for (WideNode& node : nodes) {
+		for (int i = 0; i < node.count; ++i)
+			setChild(node, i, flatNodes[node.flatChild[i]]);
+	}
+}
+
+inline int WideBVH::rootOf(int flatIdx) const
+{
+	return (flatIdx >= 0 && flatIdx < flatToWide.size()) ? flatToWide[flatIdx] : -1;
+}
+
+// Slab test of all children of a node, returns a bit per child hit before maxDist with its entry distance in tEntry
+inline int wideNodeHits(const WideNode& node, const SimdFloat* start, const SimdFloat* invDir, float maxDist, float* tEntry)
+{
+	const SimdFloat zero = simdSet(0.f), limit = simdSet(maxDist);
+	int hits = 0;
+	for (int lane = 0; lane < BVH_WIDTH; lane += SIMD_WIDTH) {
+		SimdFloat tx0 = (simdLoad(node.minX + lane) - start[0]) * invDir[0];
+		SimdFloat tx1 = (simdLoad(node.maxX + lane) - start[0]) * invDir[0];
+		SimdFloat ty0 = (simdLoad(node.minY + lane) - start[1]) * invDir[1];
+		SimdFloat ty1 = (simdLoad(node.maxY + lane) - start[1]) * invDir[1];
+		SimdFloat tz0 = (simdLoad(node.minZ + lane) - start[2]) * invDir[2];
+		SimdFloat tz1 = (simdLoad(node.maxZ + lane) - start[2]) * invDir[2];
+
+		SimdFloat tMin = simdMax(simdMax(simdMin(tx0, tx1), simdMin(ty0, ty1)), simdMin(tz0, tz1));
+		SimdFloat tMax = simdMin(simdMin(simdMax(tx0, tx1), simdMax(ty0, ty1)), simdMax(tz0, tz1));
+
+		SimdFloat mask = (tMax >= tMin) & (tMax > zero) & (tMin <= limit);
+		hits |= simdMask(mask) << lane;
+		simdStore(tEntry + lane, tMin);
+	}
+	return hits & ((1 << node.count) - 1);
+}
+
+// Closest hit query in the wide BVH with given wide root, same results as intersectBVH
+inline bool intersectWideBVH(const WideBVH& wide, const std::vector<FlatNode>& flatNodes, const std::vector<int>& indices,
+	const ShapeStore& store, Ray ray, BVHHit& hit, int root, BVHStats* stats = nullptr)
+{
+	if (root < 0) return false;
+
+	glm::vec3 start = ray.get_start();
+	glm::vec3 dir = ray.get_dir();
+	glm::vec3 invDir = 1.f / dir;
+	const SimdFloat startLanes[3] = { simdSet(start.x), simdSet(start.y), simdSet(start.z) };
+	const SimdFloat invDirLanes[3] = { simdSet(invDir.x), simdSet(invDir.y), simdSet(invDir.z) };
+
+	// Entries are wide nodes, or flat leaves (encoded as ~index), with their entry distance
+	int stack[WIDE_BVH_STACK_SIZE];
+	float stackT[WIDE_BVH_STACK_SIZE];
+	int stackIdx = 0;
+	stackT[stackIdx] = 0.f;
+	stack[stackIdx++] = root;
+
+	while (stackIdx > 0) {
+		--stackIdx;
+		if (stackT[stackIdx] > hit.dist)
+			continue;
+
+		int entry = stack[stackIdx];
+		if (entry < 0) { // Leaf
+			intersectLeaf(flatNodes, indices, store, ~entry, start, dir, hit, stats);
+			continue;
+		}
+
+		const WideNode& node = wide.nodes[entry];
+		if (stats) stats->nodeVisits += node.count;
+
+		float tEntry[BVH_WIDTH];
+		int hits = wideNodeHits(node, startLanes, invDirLanes, hit.dist, tEntry);
+
+		// Sort hit children by entry distance, the nearest is pushed last (visited first)
+		int order[BVH_WIDTH];
+		int hitCount = 0;
+		for (int i = 0; i < node.count; ++i) {
+			if (!(hits >> i & 1)) continue;
+
+			int j = hitCount++;
+			while (j > 0 && tEntry[order[j - 1]] < tEntry[i]) {
+				order[j] = order[j - 1];
+				--j;
+			}
+			order[j] = i;
+		}
+
+		for (int i = 0; i < hitCount; ++i) {
+			int lane = order[i];
+			stackT[stackIdx] = tEntry[lane];
+			stack[stackIdx++] = (node.leafMask >> lane & 1) ? ~node.child[lane] : node.child[lane];
+		}
+	}
+
+	return hit.shapeIdx != -1;
+}
+
+// Any hit query in the wide BVH with given wide root, expects normalized ray direction like occludedBVH
+inline bool occludedWideBVH(const WideBVH& wide, const std::vector<FlatNode>& flatNodes, const std::vector<int>& indices,
+	const ShapeStore& store, Ray ray, float maxDist, int root)
+{
+	if (root < 0) return false;
+
+	glm::vec3 start = ray.get_start();
+	glm::vec3 dir = ray.get_dir();
+	glm::vec3 invDir = 1.f / dir;
+	const SimdFloat startLanes[3] = { simdSet(start.x), simdSet(start.y), simdSet(start.z) };
+	const SimdFloat invDirLanes[3] = { simdSet(invDir.x), simdSet(invDir.y), simdSet(invDir.z) };
+
+	int stack[WIDE_BVH_STACK_SIZE];
+	int stackIdx = 0;
+	stack[stackIdx++] = root;
+
+	while (stackIdx > 0) {
+		const WideNode& node = wide.nodes[stack[--stackIdx]];
+
+		float tEntry[BVH_WIDTH];
+		int hits = wideNodeHits(node, startLanes, invDirLanes, maxDist, tEntry);
+
+		for (int i = 0; i < node.count; ++i) {
+			if (!(hits >> i & 1)) continue;
+
+			if (!(node.leafMask >> i & 1))
+				stack[stackIdx++] = node.child[i];
+			else if (occludedLeaf(flatNodes, indices, store, node.child[i], start, dir, maxDist))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+#endif // !WIDE_BVH_H